@@ -13,12 +13,21 @@ solution "rayrun"
 		optimize "On"
 
 -- 
+if os.istarget("windows") then
 project "rayrun"
 	kind "ConsoleApp"
 	language "C++"
 	characterset "MBCS"
 	files {
 		"src/main.cpp",
+		"src/harness.hpp",
+		"src/mappedfile.hpp",
+		"src/meshcache.hpp",
+		"src/objparser.hpp",
+		"src/perfcounter.hpp",
+		"src/plugin.hpp",
+		"src/raytrace.hpp",
+		"src/scheduler.hpp",
 		"src/rayrun.hpp",
 		"thirdparty/imgui/examples/imgui_impl_win32.cpp",
 		"thirdparty/imgui/examples/imgui_impl_win32.h",
@@ -28,12 +37,8 @@ project "rayrun"
 		"thirdparty/imgui/imgui_draw.cpp",
 		"thirdparty/imgui/imgui_widgets.cpp",
 	}
-	buildoptions { 
-	"/openmp"
-	}
 	includedirs {
 		"thirdparty/stb/",
-		"thirdparty/tinyobjloader/",
 		"thirdparty/picojson/",
 		"thirdparty/imgui/",
 		"thirdparty/imgui/examples",
@@ -44,6 +49,86 @@ project "rayrun"
 	}
 	cppdialect "C++17"
 	dependson { "refimp" }
+end
+
+-- 
+project "rayrun_bench"
+	kind "ConsoleApp"
+	language "C++"
+	characterset "MBCS"
+	files {
+		"src/bench_main.cpp",
+		"src/harness.hpp",
+		"src/mappedfile.hpp",
+		"src/meshcache.hpp",
+		"src/objparser.hpp",
+		"src/perfcounter.hpp",
+		"src/plugin.hpp",
+		"src/raytrace.hpp",
+		"src/scheduler.hpp",
+		"src/rayrun.hpp",
+	}
+	includedirs {
+		"thirdparty/picojson/",
+		"thirdparty/glm/",
+	}
+	cppdialect "C++17"
+	filter "system:linux"
+		links { "dl", "pthread" }
+	filter {}
+	dependson { "refimp" }
+
+-- 
+project "rayrun_replay"
+	kind "ConsoleApp"
+	language "C++"
+	characterset "MBCS"
+	files {
+		"src/replay_main.cpp",
+		"src/harness.hpp",
+		"src/mappedfile.hpp",
+		"src/meshcache.hpp",
+		"src/objparser.hpp",
+		"src/plugin.hpp",
+		"src/raytrace.hpp",
+		"src/scheduler.hpp",
+		"src/rayrun.hpp",
+	}
+	includedirs {
+		"thirdparty/picojson/",
+		"thirdparty/glm/",
+	}
+	cppdialect "C++17"
+	filter "system:linux"
+		links { "dl", "pthread" }
+	filter {}
+	dependson { "refimp" }
+
+-- 
+project "rayrun_test"
+	kind "ConsoleApp"
+	language "C++"
+	characterset "MBCS"
+	files {
+		"test/harness_test.cpp",
+		"src/harness.hpp",
+		"src/mappedfile.hpp",
+		"src/meshcache.hpp",
+		"src/objparser.hpp",
+		"src/raytrace.hpp",
+		"src/scheduler.hpp",
+		"src/rayrun.hpp",
+	}
+	includedirs {
+		"src/",
+		"thirdparty/picojson/",
+		"thirdparty/glm/",
+		"thirdparty/tinyobjloader/",
+	}
+	cppdialect "C++17"
+	filter "system:linux"
+		links { "pthread" }
+	filter {}
 
 -- 
 project "refimp"
@@ -54,4 +139,7 @@ project "refimp"
 		"src/refimpl.cpp",
 		"src/rayrun.hpp",
 	}
-	cppdialect "C++17"
\ No newline at end of file
+	cppdialect "C++17"
+	filter "system:linux"
+		visibility "Hidden"
+	filter {}
\ No newline at end of file
@@ -13,12 +13,21 @@ solution "my_rayrun"
 		optimize "On"
 
 -- 
+if os.istarget("windows") then
 project "my_rayrun"
 	kind "ConsoleApp"
 	language "C++"
 	characterset "MBCS"
 	files {
 		"src/main.cpp",
+		"src/harness.hpp",
+		"src/mappedfile.hpp",
+		"src/meshcache.hpp",
+		"src/objparser.hpp",
+		"src/perfcounter.hpp",
+		"src/plugin.hpp",
+		"src/raytrace.hpp",
+		"src/scheduler.hpp",
 		"src/rayrun.hpp",
 		"thirdparty/imgui/examples/imgui_impl_win32.cpp",
 		"thirdparty/imgui/examples/imgui_impl_win32.h",
@@ -28,12 +37,8 @@ project "my_rayrun"
 		"thirdparty/imgui/imgui_draw.cpp",
 		"thirdparty/imgui/imgui_widgets.cpp",
 	}
-	buildoptions { 
-	"/openmp"
-	}
 	includedirs {
 		"thirdparty/stb/",
-		"thirdparty/tinyobjloader/",
 		"thirdparty/picojson/",
 		"thirdparty/imgui/",
 		"thirdparty/imgui/examples",
@@ -44,6 +49,7 @@ project "my_rayrun"
 	}
 	cppdialect "C++17"
 	dependson { "salsa" }
+end
 
 -- 
 project "salsa"
@@ -53,12 +59,105 @@ project "salsa"
 	files {
 		"salsa/include/s3d_math.h",
 		"salsa/include/s3d_bvh.h",
+		"salsa/include/s3d_parallel.h",
 		"salsa/src/dll_main.cpp",
 		"salsa/src/s3d_bvh.cpp",
+		"salsa/src/s3d_bvh_kernel.inl",
+		"salsa/src/s3d_bvh_sse42.cpp",
+		"salsa/src/s3d_bvh_avx2.cpp",
+		"salsa/src/s3d_bvh_avx512.cpp",
 		"src/rayrun.hpp",
 	}
 	includedirs {
 		"salsa/include/",
 		"src/",
 	}	
-	cppdialect "C++17"
\ No newline at end of file
+	cppdialect "C++17"
+	-- 命令セットはカーネルの関数ごとに target で指定するので, ファイル単位の -m や /arch は付けない
+	-- カーネルごとに交差判定の結果が変わらないように, 積和の融合もしない
+	filter "system:linux"
+		visibility "Hidden"
+		buildoptions { "-ffp-contract=off" }
+		links { "pthread" }
+	filter {}
+
+-- 
+project "rayrun_bench"
+	kind "ConsoleApp"
+	language "C++"
+	characterset "MBCS"
+	files {
+		"src/bench_main.cpp",
+		"src/harness.hpp",
+		"src/mappedfile.hpp",
+		"src/meshcache.hpp",
+		"src/objparser.hpp",
+		"src/perfcounter.hpp",
+		"src/plugin.hpp",
+		"src/raytrace.hpp",
+		"src/scheduler.hpp",
+		"src/rayrun.hpp",
+	}
+	includedirs {
+		"thirdparty/picojson/",
+		"thirdparty/glm/",
+	}
+	cppdialect "C++17"
+	filter "system:linux"
+		links { "dl", "pthread" }
+	filter {}
+	dependson { "salsa" }
+
+-- 
+project "rayrun_replay"
+	kind "ConsoleApp"
+	language "C++"
+	characterset "MBCS"
+	files {
+		"src/replay_main.cpp",
+		"src/harness.hpp",
+		"src/mappedfile.hpp",
+		"src/meshcache.hpp",
+		"src/objparser.hpp",
+		"src/plugin.hpp",
+		"src/raytrace.hpp",
+		"src/scheduler.hpp",
+		"src/rayrun.hpp",
+	}
+	includedirs {
+		"thirdparty/picojson/",
+		"thirdparty/glm/",
+	}
+	cppdialect "C++17"
+	filter "system:linux"
+		links { "dl", "pthread" }
+	filter {}
+	dependson { "salsa" }
+-- 
+-- 全ての走査経路とカーネルの結果を総当たりの交差判定と比べる(失敗すると終了コードが1になる)
+project "salsa_test"
+	kind "ConsoleApp"
+	language "C++"
+	characterset "MBCS"
+	files {
+		"salsa/include/s3d_math.h",
+		"salsa/include/s3d_bvh.h",
+		"salsa/include/s3d_parallel.h",
+		"salsa/src/dll_main.cpp",
+		"salsa/src/s3d_bvh.cpp",
+		"salsa/src/s3d_bvh_kernel.inl",
+		"salsa/src/s3d_bvh_sse42.cpp",
+		"salsa/src/s3d_bvh_avx2.cpp",
+		"salsa/src/s3d_bvh_avx512.cpp",
+		"salsa/test/s3d_bvh_test.cpp",
+		"src/rayrun.hpp",
+	}
+	includedirs {
+		"salsa/include/",
+		"src/",
+	}
+	cppdialect "C++17"
+	filter "system:linux"
+		buildoptions { "-ffp-contract=off" }
+		links { "pthread" }
+	filter {}
@@ -9,24 +9,132 @@
 //-----------------------------------------------------------------------------
 #include <s3d_math.h>
 #include <vector>
+#include <emmintrin.h>
+
+
+//-----------------------------------------------------------------------------
+// Macros.
+//-----------------------------------------------------------------------------
+#ifndef SALSA_PREFETCH_HINT
+#define SALSA_PREFETCH_HINT         _MM_HINT_T0 // 先読みのヒント(_MM_HINT_T0/T1/T2/NTA).
+#endif
+
+// 距離0/1/4や三角形の先読みなしとの差は計測のばらつきの範囲内だったので, 既定値は2のままにしている(計測方法と結果は readme.md).
+#ifndef SALSA_PREFETCH_DISTANCE
+#define SALSA_PREFETCH_DISTANCE     (2)         // 何ノード先まで先読みするか(0なら先読みしない).
+#endif
+
+#ifndef SALSA_PREFETCH_TRIANGLES
+#define SALSA_PREFETCH_TRIANGLES    (1)         // 葉ノードの三角形の頂点データを先読みするなら1.
+#endif
 
 
 namespace s3d {
 
+constexpr uint32_t  kPacketSize     = 4;    //!< ストリーム巡回でまとめて判定するレイの本数(SSE).
+constexpr uint32_t  kMaxPacketSize  = 16;   //!< パケットの最大レーン数(AVX-512).
+constexpr uint32_t  kInterleaveSize = 8;    //!< 交互に進めるレイの本数.
+constexpr uint32_t  kShortStackSize = 16;   //!< ショートスタックの段数(2のべき乗).
+constexpr uint32_t  kOccluderCacheSize = 4; //!< 遮蔽物キャッシュのエントリ数.
+constexpr uint32_t  kWideNodeSize   = 8;    //!< 多分木ノードの子の数(AVX-512).
+constexpr uint32_t  kWideStackSize  = 256;  //!< 多分木の巡回スタックの段数.
+
 ///////////////////////////////////////////////////////////////////////////////
-// Node structure
+// ChildBoxNode structure
 ///////////////////////////////////////////////////////////////////////////////
-struct Node
+struct alignas(64) ChildBoxNode
 {
-    AABB        Box;    //!< バウンディングボックス.
-    uint32_t    L;      //!< 子ノード左. (末尾が0x1なら葉ノード). 
-    uint32_t    R;      //!< 子ノード右. (末尾が0x1なら葉ノード).
-
-    __forceinline Node() noexcept
-    : Box(nullptr)
-    , L  (kInvalid)
-    , R  (kInvalid)
-    { /* DO_NOTHING */ }
+    float       BoxX[4];    //!< 子のバウンディングボックスのX座標 (左min, 右min, 左max, 右max).
+    float       BoxY[4];    //!< 子のバウンディングボックスのY座標 (左min, 右min, 左max, 右max).
+    float       BoxZ[4];    //!< 子のバウンディングボックスのZ座標 (左min, 右min, 左max, 右max).
+    uint32_t    L;          //!< 子ノード左. (末尾が0x1なら葉ノード).
+    uint32_t    R;          //!< 子ノード右. (末尾が0x1なら葉ノード).
+    uint32_t    Parent;     //!< 親ノード.
+    uint32_t    Reserved;   //!< 予約領域.
+
+    __forceinline AABB GetBox(uint32_t side) const noexcept
+    {
+        // side は左の子が0, 右の子が1.
+        return AABB(
+            Vector3f(BoxX[side    ], BoxY[side    ], BoxZ[side    ]),
+            Vector3f(BoxX[side + 2], BoxY[side + 2], BoxZ[side + 2]));
+    }
+};
+static_assert(sizeof(ChildBoxNode) == 64, "ChildBoxNode must fit in a cache line.");
+
+///////////////////////////////////////////////////////////////////////////////
+// WideNode structure
+///////////////////////////////////////////////////////////////////////////////
+struct alignas(64) WideNode
+{
+    float       BoxX[kWideNodeSize * 2];    //!< 子のバウンディングボックスのX座標 (前半がmin, 後半がmax).
+    float       BoxY[kWideNodeSize * 2];    //!< 子のバウンディングボックスのY座標 (前半がmin, 後半がmax).
+    float       BoxZ[kWideNodeSize * 2];    //!< 子のバウンディングボックスのZ座標 (前半がmin, 後半がmax).
+    uint32_t    Child[kWideNodeSize];       //!< 子ノード. (末尾が0x1なら葉ノード).
+    uint32_t    Mask;                       //!< 有効な子のビットマスク.
+    uint32_t    Reserved[7];                //!< 予約領域.
+};
+static_assert(sizeof(WideNode) == 256, "WideNode must fit in four cache lines.");
+
+///////////////////////////////////////////////////////////////////////////////
+// ShortStack structure
+///////////////////////////////////////////////////////////////////////////////
+struct ShortStack
+{
+    uint32_t    Entry[kShortStackSize]; //!< リングバッファ.
+    uint32_t    Top         = 0;        //!< 次に積む位置.
+    uint32_t    Count       = 0;        //!< 積まれている数.
+    bool        Overflow    = false;    //!< 溢れて捨てたエントリがあれば true.
+
+    __forceinline void Push(uint32_t value) noexcept
+    {
+        // 溢れたら一番古いエントリを上書きする. 捨てた分は親リンクを辿って復帰する.
+        Entry[Top] = value;
+        Top = (Top + 1) & (kShortStackSize - 1);
+        if (Count < kShortStackSize)
+        { Count++; }
+        else
+        { Overflow = true; }
+    }
+
+    __forceinline uint32_t Pop() noexcept
+    {
+        Top = (Top - 1) & (kShortStackSize - 1);
+        Count--;
+        return Entry[Top];
+    }
+
+    __forceinline uint32_t Peek(uint32_t depth) const noexcept
+    {
+        // depth番目に取り出されるエントリ. 無ければ kInvalid.
+        return (depth < Count) ? Entry[(Top - 1 - depth) & (kShortStackSize - 1)] : kInvalid;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// OccluderCache structure
+///////////////////////////////////////////////////////////////////////////////
+struct OccluderCache
+{
+    uint32_t    Entry[kOccluderCacheSize];  //!< 最近交差した面番号(先頭が最新).
+    uint32_t    Count = 0;                  //!< 有効なエントリ数.
+
+    __forceinline void Touch(uint32_t face_id) noexcept
+    {
+        // 既にあればその位置から, 無ければ末尾から詰めて先頭に入れる.
+        auto i = 0u;
+        while(i < Count && Entry[i] != face_id)
+        { i++; }
+
+        if (i == Count && Count < kOccluderCacheSize)
+        { Count++; }
+        if (i == kOccluderCacheSize)
+        { i--; }
+
+        for(; i > 0; --i)
+        { Entry[i] = Entry[i - 1]; }
+        Entry[0] = face_id;
+    }
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -50,6 +158,21 @@ struct Ray
     float       tmax;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// RayPacket structure
+///////////////////////////////////////////////////////////////////////////////
+struct alignas(64) RayPacket
+{
+    float       dir    [3][kMaxPacketSize]; //!< レイ方向(SoA). 使うのは先頭からカーネルのレーン数分.
+    float       inv_dir[3][kMaxPacketSize]; //!< レイ方向の逆数(SoA).
+    float       tmin      [kMaxPacketSize]; //!< 交差判定を開始する距離.
+    float       tmax      [kMaxPacketSize]; //!< 交差判定を終了する距離.
+    Vector3f    pos;        //!< パケット内で共有するレイ原点.
+    float       dir_len;    //!< レーンの中で最も長いレイ方向の長さ.
+    uint32_t    sign[3];    //!< 方向の符号(パケット内で共通, 負なら1).
+    int         mask;       //!< 有効なレーンのビットマスク.
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // HitRecord structure
 ///////////////////////////////////////////////////////////////////////////////
@@ -62,6 +185,30 @@ struct HitRecord
     int         face_id;    //!< 交差した面の番号.
 };
 
+struct LBVH;
+
+///////////////////////////////////////////////////////////////////////////////
+// KernelTable structure
+///////////////////////////////////////////////////////////////////////////////
+struct KernelTable
+{
+    const char* Name;       //!< 表示名.
+    uint32_t    PacketSize; //!< パケットのレーン数.
+    void (*TraverseIterative  )(const LBVH& bvh, const Ray& ray, HitRecord& record, bool hitAny);
+    void (*TraverseStackless  )(const LBVH& bvh, const Ray& ray, HitRecord& record, bool hitAny);
+    void (*TraversePacket     )(const LBVH& bvh, const RayPacket& packet, HitRecord* records, bool hitAny);
+    void (*TraverseInterleaved)(const LBVH& bvh, const Ray* rays, HitRecord* records, size_t count, bool hitAny);
+    void (*TraverseWide       )(const LBVH& bvh, const Ray& ray, HitRecord& record, bool hitAny);                  //!< 多分木の巡回(無ければ nullptr).
+    void (*TraversePacketWide )(const LBVH& bvh, const RayPacket& packet, HitRecord* records, bool hitAny);        //!< 多分木のパケット巡回(無ければ nullptr).
+    void (*InterpolateNormals )(const LBVH& bvh, const uint32_t* face_ids, const float* u, const float* v, float* const* targets, size_t count);   //!< 交差位置の法線を補間して targets[i][0..2] に書き込む.
+};
+
+// 命令セットごとに別の翻訳単位でコンパイルされる走査カーネル.
+namespace sse2   { extern const KernelTable Kernel; }
+namespace sse42  { extern const KernelTable Kernel; }
+namespace avx2   { extern const KernelTable Kernel; }
+namespace avx512 { extern const KernelTable Kernel; }
+
 ///////////////////////////////////////////////////////////////////////////////
 // LBVH structure
 ///////////////////////////////////////////////////////////////////////////////
@@ -74,11 +221,25 @@ struct LBVH
     size_t                      PositionCount   = 0;
     size_t                      NormalCount     = 0;
     size_t                      IndexCount      = 0;
-    std::vector<Node>           Nodes;
+    AABB                        Bounds          = AABB(nullptr);
+    AABB                        ClipBounds      = AABB(nullptr);
+    std::vector<ChildBoxNode>   ChildBoxNodes;
+    std::vector<WideNode>       WideNodes;
+    const KernelTable*          Kernel          = &sse2::Kernel;
+    bool                        Stackless       = false;    //!< スタックを使わずに親リンクだけで巡回するなら true.
 
     void Build();
+    void BuildWide();
     void Destruct();
-    void TraverseIterative(const Ray& ray, HitRecord& record) const;
+    bool ClipRay(Ray& ray, HitRecord& record) const;
+    void TraverseIterative(const Ray& ray, HitRecord& record, bool hitAny) const;
+    uint32_t NextSibling(uint32_t node) const;
+    uint32_t NextSibling(uint32_t node, const Ray& ray, float dist) const;
+    void TraversePacket(const RayPacket& packet, HitRecord* records, bool hitAny) const;
+    void TraverseStream(const Ray* rays, HitRecord* records, size_t count, bool hitAny) const;
+    void TraverseInterleaved(const Ray* rays, HitRecord* records, size_t count, bool hitAny) const;
+    void TraverseWide(const Ray& ray, HitRecord& record, bool hitAny) const;
+    void TraversePacketWide(const RayPacket& packet, HitRecord* records, bool hitAny) const;
 
     __forceinline void IsHit(const Ray& ray, HitRecord& record, uint32_t face_id) const noexcept
     {
@@ -100,6 +261,61 @@ struct LBVH
         }
     }
 
+    __forceinline bool TestOccluders(const Ray& ray, HitRecord& record, const OccluderCache& cache) const noexcept
+    {
+        // 最近遮蔽した三角形に当たれば巡回せずに終了.
+        for(auto i = 0u; i < cache.Count; ++i)
+        {
+            if (cache.Entry[i] * 3 >= IndexCount)
+            { continue; }
+
+            IsHit(ray, record, cache.Entry[i]);
+            if (record.hit)
+            { return true; }
+        }
+        return false;
+    }
+
+    __forceinline void PrefetchNodes(uint32_t next, const ShortStack& stack) const noexcept
+    {
+        // 次に読むノードと, その後にスタックから取り出すノードを先読み.
+        if (SALSA_PREFETCH_DISTANCE < 1 || next == kInvalid)
+        { return; }
+
+        _mm_prefetch(reinterpret_cast<const char*>(&ChildBoxNodes[next]), SALSA_PREFETCH_HINT);
+        for(uint32_t i = 0; i + 1 < SALSA_PREFETCH_DISTANCE; ++i)
+        {
+            const auto idx = stack.Peek(i);
+            if (idx == kInvalid)
+            { break; }
+            _mm_prefetch(reinterpret_cast<const char*>(&ChildBoxNodes[idx]), SALSA_PREFETCH_HINT);
+        }
+    }
+
+    __forceinline void PrefetchWideNodes(const uint32_t* stack, uint32_t top) const noexcept
+    {
+        // スタックの上から SALSA_PREFETCH_DISTANCE 個の多分木のノードを先読み. 1ノードはキャッシュライン4つ分.
+        for(uint32_t i = 0; i < SALSA_PREFETCH_DISTANCE && i < top; ++i)
+        {
+            const auto node = reinterpret_cast<const char*>(&WideNodes[stack[top - 1 - i] >> 1]);
+            _mm_prefetch(node +   0, SALSA_PREFETCH_HINT);
+            _mm_prefetch(node +  64, SALSA_PREFETCH_HINT);
+            _mm_prefetch(node + 128, SALSA_PREFETCH_HINT);
+            _mm_prefetch(node + 192, SALSA_PREFETCH_HINT);
+        }
+    }
+
+    __forceinline void PrefetchTriangle(uint32_t face_id) const noexcept
+    {
+        if (!SALSA_PREFETCH_TRIANGLES)
+        { return; }
+
+        const auto id = face_id * 3;
+        _mm_prefetch(reinterpret_cast<const char*>(&Positions[Indices[id + 0].P]), SALSA_PREFETCH_HINT);
+        _mm_prefetch(reinterpret_cast<const char*>(&Positions[Indices[id + 1].P]), SALSA_PREFETCH_HINT);
+        _mm_prefetch(reinterpret_cast<const char*>(&Positions[Indices[id + 2].P]), SALSA_PREFETCH_HINT);
+    }
+
     __forceinline Vector3f CalcPosition(uint32_t face_id, float u, float v, float w) const noexcept
     {
         const auto id = face_id * 3;
@@ -10,14 +10,24 @@
 //-----------------------------------------------------------------------------
 #include <cstdint>
 #include <cmath>
+#include <cfloat>
 #include <limits>
 
 
+//-----------------------------------------------------------------------------
+// Macros.
+//-----------------------------------------------------------------------------
+#if !defined(_MSC_VER) && !defined(__forceinline)
+#define __forceinline   inline __attribute__((always_inline))
+#endif
+
+
 namespace s3d {
 
 constexpr float     kMaxBound = std::numeric_limits<float>::max();
 constexpr float     kMinBound = std::numeric_limits<float>::lowest();
 constexpr uint32_t  kInvalid  = std::numeric_limits<uint32_t>::max();
+constexpr float     kMachineEpsilon = std::numeric_limits<float>::epsilon() * 0.5f;
 
 constexpr float   F_PI        = 3.1415926535897932384626433832795f;     //!< πです.
 constexpr float   F_2PI       = 6.283185307179586476925286766559f;      //!< 2πです.
@@ -54,6 +64,17 @@ __forceinline bool IsZero(float value) noexcept
 __forceinline float SafeSqrt(float value) noexcept
 { return (value > FLT_EPSILON) ? sqrt(value) : 0.0f; }
 
+// レイ方向の逆数. -0 は (value < 0) で判定するオクタントと揃うように +inf にする.
+// 原点がスラブの面上にあると 0 * inf で NaN になるが, スラブ判定側でその軸を無視する.
+__forceinline float InvDir(float value) noexcept
+{ return 1.0f / ((value == 0.0f) ? 0.0f : value); }
+
+// 浮動小数点演算 n 回分の相対誤差の上限 (PBRT の gamma(n)).
+constexpr float Gamma(int n) noexcept
+{ return (n * kMachineEpsilon) / (1.0f - n * kMachineEpsilon); }
+
+constexpr float     kSlabScale = 1.0f + 2.0f * Gamma(3);    //!< スラブ判定の遠い側に掛ける係数(Ize 2013).
+
 
 __forceinline uint32_t ExpandBits(uint32_t v) noexcept
 {
@@ -722,6 +743,13 @@ struct AABB
     , maxi(value.maxi)
     { /* DO_NOTHING */ }
 
+    __forceinline AABB& operator = (const AABB& value) noexcept
+    {
+        mini = value.mini;
+        maxi = value.maxi;
+        return *this;
+    }
+
     __forceinline Vector3f GetCenter() const noexcept
     { return (mini + maxi) * 0.5f; }
 
@@ -737,6 +765,12 @@ struct AABB
         maxi = Vector3f::Max(maxi, value);
     }
 
+    __forceinline float SurfaceArea() const noexcept
+    {
+        const auto size = maxi - mini;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
     __forceinline Vector3f Normalize(const Vector3f& p) const noexcept
     { return (p - mini) / (maxi - mini); }
 
@@ -753,20 +787,36 @@ struct AABB
     }
 
     __forceinline bool Intersect(const Vector3f& rayPos, const Vector3f& invRayDir, const float length) const noexcept
+    { return Intersect(rayPos, invRayDir, 0.0f, length); }
+
+    __forceinline bool Intersect(const Vector3f& rayPos, const Vector3f& invRayDir, float start, float length) const noexcept
+    { return Clip(rayPos, invRayDir, start, length); }
+
+    __forceinline bool Clip(const Vector3f& rayPos, const Vector3f& invRayDir, float& start, float& length) const noexcept
     {
-        Vector3f v;
-        v.x = ((0 < invRayDir.x ? mini.x : maxi.x) - rayPos.x) * invRayDir.x;
-        v.y = ((0 < invRayDir.y ? mini.y : maxi.y) - rayPos.y) * invRayDir.y;
-        v.z = ((0 < invRayDir.z ? mini.z : maxi.z) - rayPos.z) * invRayDir.z;
+        Vector3f t0;
+        t0.x = ((0 < invRayDir.x ? mini.x : maxi.x) - rayPos.x) * invRayDir.x;
+        t0.y = ((0 < invRayDir.y ? mini.y : maxi.y) - rayPos.y) * invRayDir.y;
+        t0.z = ((0 < invRayDir.z ? mini.z : maxi.z) - rayPos.z) * invRayDir.z;
+
+        Vector3f t1;
+        t1.x = ((0 < invRayDir.x ? maxi.x : mini.x) - rayPos.x) * invRayDir.x;
+        t1.y = ((0 < invRayDir.y ? maxi.y : mini.y) - rayPos.y) * invRayDir.y;
+        t1.z = ((0 < invRayDir.z ? maxi.z : mini.z) - rayPos.z) * invRayDir.z;
+
+        // NaN になった軸は比較が偽になって無視されるように, 各軸の値を左辺に置く.
+        auto tmin = Max(t0.z, Max(t0.y, Max(t0.x, start)));
+        auto tmax = Min(t1.z, Min(t1.y, Min(t1.x, length)));
 
-        const auto tmin = Max3(v);
+        // 丸め誤差で境界をすり抜けないように遠い側を広げる(Ize 2013).
+        tmax *= kSlabScale;
 
-        v.x = ((0 < invRayDir.x ? maxi.x : mini.x) - rayPos.x) * invRayDir.x;
-        v.y = ((0 < invRayDir.y ? maxi.y : mini.y) - rayPos.y) * invRayDir.y;
-        v.z = ((0 < invRayDir.z ? maxi.z : mini.z) - rayPos.z) * invRayDir.z;
+        if (!(tmin <= tmax))
+        { return false; }
 
-        const auto tmax = Min3(v);
-        return (tmin <= tmax) && (0.0f < tmax) && (tmin < length);
+        start  = tmin;
+        length = tmax;
+        return true;
     }
 
     __forceinline void Clear() noexcept
@@ -888,7 +938,7 @@ public:
     }
 
     __forceinline float GetAsF32() noexcept
-    { return static_cast<float>( GetAsU32() ) / 0xffffffffui32; }
+    { return static_cast<float>( GetAsU32() ) / 0xffffffffu; }
 
     __forceinline PCG& operator = (const PCG& value) noexcept
     {
@@ -0,0 +1,354 @@
+﻿//-----------------------------------------------------------------------------
+// File : s3d_parallel.h
+// Desc : Parallel Algorithms.
+// Copyright(c) Project Asura. All right reserved.
+//-----------------------------------------------------------------------------
+#pragma once
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+#include <algorithm>
+#include <iterator>
+#if defined(_MSC_VER)
+#include <ppl.h>
+#else
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+
+#if !defined(_MSC_VER)
+// MSVC以外では PPL が無いので, 使っている関数だけ同じ名前で用意する.
+//
+// 入れ子の規則:
+//   parallel_for の中(ワーカースレッド, または parallel_for を実行中の呼び出し元)から
+//   さらに parallel_for を呼んだ場合は分割せず, 呼んだスレッドだけで順番に処理する.
+//   別々のスレッドから同時に呼ばれた parallel_for は互いを待たず, 空いているワーカーを分け合う.
+//
+// 後始末:
+//   ワーカースレッドは最初の parallel_for で作られ, プロセスの終了時か共有ライブラリの解放時に
+//   WorkerPool のデストラクタで終了を待つ. ワーカーの thread_local はスレッドの終了とともに破棄されるので,
+//   コードがアンマップされる前に全て片付く.
+namespace concurrency {
+
+///////////////////////////////////////////////////////////////////////////////
+// WorkerPool class
+///////////////////////////////////////////////////////////////////////////////
+class WorkerPool
+{
+public:
+    ///////////////////////////////////////////////////////////////////////////
+    // Job structure
+    ///////////////////////////////////////////////////////////////////////////
+    struct Job
+    {
+        ///////////////////////////////////////////////////////////////////////
+        // Slot structure
+        ///////////////////////////////////////////////////////////////////////
+        struct alignas(64) Slot
+        {
+            std::atomic<uint64_t>   Range;  //!< まだ誰も取っていないチャンクの範囲(下位32bit が begin, 上位32bit が end).
+        };
+
+        const std::function<void(uint32_t)>*    Func;       //!< チャンク番号を受け取って処理する関数.
+        std::vector<Slot>                       Slots;      //!< 参加者ごとの範囲(0番が呼び出し元, i+1番が i番目のワーカー).
+        std::atomic<uint32_t>                   Queued;     //!< まだ処理を始めていないチャンク数(盗んで移している途中の分も含む).
+        uint32_t                                Workers;    //!< 今このジョブを処理しているワーカー数(WorkerPool::m_Mutex で保護).
+
+        Job(const std::function<void(uint32_t)>& func, uint32_t chunks, size_t participants)
+        : Func      (&func)
+        , Slots     (participants)
+        , Queued    (chunks)
+        , Workers   (0)
+        {
+            // 最初は参加者に均等に配っておき, 手が空いたら他の参加者から盗む.
+            for(size_t i = 0; i < participants; ++i)
+            {
+                const auto begin = uint32_t(uint64_t(chunks) * i / participants);
+                const auto end   = uint32_t(uint64_t(chunks) * (i + 1) / participants);
+                Slots[i].Range.store(Pack(begin, end), std::memory_order_relaxed);
+            }
+        }
+
+        //---------------------------------------------------------------------
+        //      自分の範囲と他の参加者の範囲が全て空になるまでチャンクを処理します.
+        //---------------------------------------------------------------------
+        void Work(size_t self)
+        {
+            for(;;)
+            {
+                uint32_t chunk;
+                if (!Pop(self, chunk) && !Steal(self, chunk))
+                {
+                    // 盗まれて持ち主が書き込むまでの間は, どの範囲にも見えないチャンクがある.
+                    // Queued が0になるまでは抜けずに探し直す.
+                    if (Queued.load(std::memory_order_acquire) == 0)
+                    { return; }
+
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                Queued.fetch_sub(1, std::memory_order_acq_rel);
+                (*Func)(chunk);
+            }
+        }
+
+        //---------------------------------------------------------------------
+        //      まだ始めていないチャンクが残っているかどうか?
+        //---------------------------------------------------------------------
+        bool HasWork() const
+        { return Queued.load(std::memory_order_acquire) != 0; }
+
+    private:
+        static uint64_t Pack(uint32_t begin, uint32_t end)
+        { return uint64_t(begin) | (uint64_t(end) << 32); }
+
+        static uint32_t Begin(uint64_t range)
+        { return uint32_t(range); }
+
+        static uint32_t End(uint64_t range)
+        { return uint32_t(range >> 32); }
+
+        //---------------------------------------------------------------------
+        //      自分の範囲の先頭から1つ取ります.
+        //---------------------------------------------------------------------
+        bool Pop(size_t self, uint32_t& chunk)
+        {
+            auto& range = Slots[self].Range;
+            auto  value = range.load(std::memory_order_acquire);
+            while (Begin(value) < End(value))
+            {
+                if (range.compare_exchange_weak(value, Pack(Begin(value) + 1, End(value)), std::memory_order_acq_rel))
+                {
+                    chunk = Begin(value);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //---------------------------------------------------------------------
+        //      他の参加者の範囲の後ろ半分を盗み, 1つを返して残りを自分の範囲に置きます.
+        //---------------------------------------------------------------------
+        bool Steal(size_t self, uint32_t& chunk)
+        {
+            const auto count = Slots.size();
+            for(size_t i = 1; i < count; ++i)
+            {
+                auto& range = Slots[(self + i) % count].Range;
+                auto  value = range.load(std::memory_order_acquire);
+                while (Begin(value) < End(value))
+                {
+                    const auto size  = End(value) - Begin(value);
+                    const auto split = End(value) - (size + 1) / 2;
+                    if (range.compare_exchange_weak(value, Pack(Begin(value), split), std::memory_order_acq_rel))
+                    {
+                        // 自分の範囲は空なので, 他の参加者が書き換えることは無い.
+                        chunk = split;
+                        Slots[self].Range.store(Pack(split + 1, End(value)), std::memory_order_release);
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+    };
+
+    //-------------------------------------------------------------------------
+    //      最初の呼び出しでワーカースレッドを作り, 以降は使い回します.
+    //-------------------------------------------------------------------------
+    static WorkerPool& Instance()
+    {
+        static WorkerPool pool;
+        return pool;
+    }
+
+    //-------------------------------------------------------------------------
+    //      呼び出し元も含めた参加者数を返します.
+    //-------------------------------------------------------------------------
+    size_t GetParticipantCount() const
+    { return m_Threads.size() + 1; }
+
+    //-------------------------------------------------------------------------
+    //      ジョブを登録し, 呼び出し元も処理に加わって全てのチャンクが終わるまで待ちます.
+    //-------------------------------------------------------------------------
+    void Run(Job& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Jobs.push_back(&job);
+        }
+        m_Wake.notify_all();
+
+        InParallel() = true;
+        job.Work(0);
+        InParallel() = false;
+
+        // 新しいワーカーが加わらないように外してから, 処理中のワーカーを待つ.
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Jobs.erase(std::find(m_Jobs.begin(), m_Jobs.end(), &job));
+        m_Done.wait(lock, [&]() { return job.Workers == 0; });
+    }
+
+    //-------------------------------------------------------------------------
+    //      今のスレッドが parallel_for の中にいるかどうか?
+    //-------------------------------------------------------------------------
+    static bool& InParallel()
+    {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+private:
+    std::vector<std::thread>    m_Threads;
+    std::vector<Job*>           m_Jobs;
+    std::mutex                  m_Mutex;
+    std::condition_variable     m_Wake;
+    std::condition_variable     m_Done;
+    bool                        m_Exit  = false;
+
+    //-------------------------------------------------------------------------
+    //      呼び出し元の分を除いた数のワーカーを作ります.
+    //-------------------------------------------------------------------------
+    WorkerPool()
+    {
+        const auto count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        m_Threads.reserve(count);
+        for(auto i = 0u; i < count; ++i)
+        { m_Threads.emplace_back([this, i]() { Loop(i + 1); }); }
+    }
+
+    //-------------------------------------------------------------------------
+    //      ワーカーを起こして終了を待ちます.
+    //-------------------------------------------------------------------------
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Exit = true;
+        }
+        m_Wake.notify_all();
+
+        for(auto& thread : m_Threads)
+        { thread.join(); }
+    }
+
+    //-------------------------------------------------------------------------
+    //      始めていないチャンクが残っているジョブを探します.
+    //-------------------------------------------------------------------------
+    Job* FindJob() const
+    {
+        for(auto job : m_Jobs)
+        {
+            if (job->HasWork())
+            { return job; }
+        }
+        return nullptr;
+    }
+
+    //-------------------------------------------------------------------------
+    //      仕事が来るまで眠り, 来たら自分の番号の範囲から処理します.
+    //-------------------------------------------------------------------------
+    void Loop(size_t self)
+    {
+        InParallel() = true;
+        for(;;)
+        {
+            Job* job = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_Wake.wait(lock, [&]() { return m_Exit || (job = FindJob()) != nullptr; });
+                if (m_Exit)
+                { return; }
+
+                job->Workers++;
+            }
+
+            job->Work(self);
+
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                if (--job->Workers == 0)
+                { m_Done.notify_all(); }
+            }
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator = (const WorkerPool&) = delete;
+};
+
+//-----------------------------------------------------------------------------
+//      [first, last) を全スレッドで分担して処理します.
+//      参加者ごとに範囲を持ち, 空いたスレッドは他の参加者の残りの後ろ半分を盗むので, 処理量に偏りがあっても均されます.
+//      スレッドは呼び出しごとに作らず, 常駐するワーカーを使い回します.
+//      parallel_for の中から呼ばれた場合は呼び出し元のスレッドだけで処理します.
+//-----------------------------------------------------------------------------
+template<typename T, typename Func>
+void parallel_for(T first, T last, const Func& func)
+{
+    if (!(first < last))
+    { return; }
+
+    const auto count = size_t(last - first);
+    if (count == 1 || WorkerPool::InParallel())
+    {
+        for(size_t i = 0; i < count; ++i)
+        { func(T(first + i)); }
+        return;
+    }
+
+    auto& pool = WorkerPool::Instance();
+    const auto participants = pool.GetParticipantCount();
+    const auto grain        = std::max<size_t>(1, count / (participants * 8));
+    const auto chunks       = uint32_t((count + grain - 1) / grain);
+
+    const std::function<void(uint32_t)> chunk = [&](uint32_t index)
+    {
+        const auto begin = size_t(index) * grain;
+        const auto end   = std::min(begin + grain, count);
+        for(auto i = begin; i < end; ++i)
+        { func(T(first + i)); }
+    };
+
+    if (participants == 1 || chunks == 1)
+    {
+        for(uint32_t i = 0; i < chunks; ++i)
+        { chunk(i); }
+        return;
+    }
+
+    WorkerPool::Job job(chunk, chunks, participants);
+    pool.Run(job);
+}
+
+} // namespace concurrency
+#endif
+
+
+namespace s3d {
+
+//-----------------------------------------------------------------------------
+//      キーの昇順に安定ソートします.
+//      MSVC では PPL の parallel_radixsort, それ以外では std::stable_sort で並べます.
+//-----------------------------------------------------------------------------
+template<typename Iterator, typename Func>
+void SortByKey(Iterator begin, Iterator end, const Func& key)
+{
+#if defined(_MSC_VER)
+    concurrency::parallel_radixsort(begin, end, key);
+#else
+    using Value = typename std::iterator_traits<Iterator>::value_type;
+    std::stable_sort(begin, end, [&](const Value& lhs, const Value& rhs)
+    { return key(lhs) < key(rhs); });
+#endif
+}
+
+} // namespace s3d
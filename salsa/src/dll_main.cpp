@@ -1,124 +1,667 @@
-﻿//-----------------------------------------------------------------------------
-// File : dll_main.cpp
-// Desc : DLL Main Entry Point.
-// Copyright(c) Project Asura. All right reserved.
-//-----------------------------------------------------------------------------
-
-#if 1
-
-#define WIN32_LEAN_AND_MEAN
-#define NOMINMAX
-
-//-----------------------------------------------------------------------------
-// Includes
-//-----------------------------------------------------------------------------
-#include <cstdint>
-#include <Windows.h>
-#include "../../src/rayrun.hpp"
-#include <s3d_bvh.h>
-#include <ppl.h>
-
-
-//-----------------------------------------------------------------------------
-// Using Statements
-//-----------------------------------------------------------------------------
-using namespace concurrency;
-
-
-//-----------------------------------------------------------------------------
-// Gloval Variables.
-//-----------------------------------------------------------------------------
-s3d::LBVH gLBVH;        // Linear BVH.
-
-//-----------------------------------------------------------------------------
-//      DLLメインエントリーポイントです.
-//-----------------------------------------------------------------------------
-BOOL APIENTRY DllMain(HMODULE, DWORD, LPVOID)
-{ return TRUE; }
-
-//-----------------------------------------------------------------------------
-//      競技で定められている事前処理関数(スレッドによる規定は書いてない).
-//-----------------------------------------------------------------------------
-void preprocess
-(
-    const float*    vertices,       // 頂点座標配列.
-    size_t          vertexCount,    // 頂点数.
-    const float*    normals,        // 法線配列.
-    size_t          normalCount,    // 法線数.
-    const uint32_t* indices,        // 頂点インデックス(v0, n0, v1, n1, v2, n2...のように格納される, また三角形はすでに行われているものとする).
-    size_t          faceCount       // 頂点インデックス数.
-)
-{
-    gLBVH.PositionCount = vertexCount;
-    gLBVH.Positions     = reinterpret_cast<const s3d::Vector3f*>(vertices);
-
-    gLBVH.NormalCount   = normalCount;
-    gLBVH.Normals       = reinterpret_cast<const s3d::Vector3f*>(normals);
-
-    gLBVH.IndexCount    = faceCount * 3;
-    gLBVH.Indices       = reinterpret_cast<const s3d::VertexIndex*>(indices);
-
-    gLBVH.Build();
-}
-
-//------------------------------------------------------------------------------
-//      競技で定められている交差判定関数(マルチスレッドで呼び出される).
-//------------------------------------------------------------------------------
-void intersect
-(
-    Ray*    rays,           // レイ配列.
-    size_t  rayCount,       // レイ数.
-    bool    /*hitAny*/      // 交差が1つ以上あることが確定した段階で戻るか?
-)
-{
-    // ここはparallel_for化してもそんなに早くならなかった(むしろ，ちょっと遅くなる).
-    for(size_t i=0; i<rayCount; ++i)
-    {
-        // 無効なレイは処理しない.
-        if (!rays[i].valid)
-        {
-            rays[i].isisect = false;
-            continue;
-        }
-
-        s3d::Ray ray;
-        ray.pos.x = rays[i].pos[0];
-        ray.pos.y = rays[i].pos[1];
-        ray.pos.z = rays[i].pos[2];
-
-        ray.dir.x = rays[i].dir[0];
-        ray.dir.y = rays[i].dir[1];
-        ray.dir.z = rays[i].dir[2];
-
-        ray.inv_dir.x = 1.0f / ray.dir.x;
-        ray.inv_dir.y = 1.0f / ray.dir.y;
-        ray.inv_dir.z = 1.0f / ray.dir.z;
-
-        ray.tmin = rays[i].tnear;
-        ray.tmax = rays[i].tfar;
-
-        s3d::HitRecord record;
-        record.hit  = false;
-        record.dist = rays[i].tfar;
-
-        gLBVH.TraverseIterative(ray, record);
-        rays[i].isisect = record.hit;
-
-        // 交差していた場合のみ計算を行う.
-        if (record.hit)
-        { 
-            auto w = 1.0f - record.u - record.v;
-            auto pos = gLBVH.CalcPosition(record.face_id, record.u, record.v, w);
-            rays[i].isect[0] = pos.x;
-            rays[i].isect[1] = pos.y;
-            rays[i].isect[2] = pos.z;
-
-            auto nrm = gLBVH.CalcNormal(record.face_id, record.u, record.v, w);
-            rays[i].ns[0] = nrm.x;
-            rays[i].ns[1] = nrm.y;
-            rays[i].ns[2] = nrm.z;
-        }
-    }
-}
-
+﻿//-----------------------------------------------------------------------------
+// File : dll_main.cpp
+// Desc : DLL Main Entry Point.
+// Copyright(c) Project Asura. All right reserved.
+//-----------------------------------------------------------------------------
+
+#if 1
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+#include <cstdint>
+#if defined(_WIN32)
+#include <Windows.h>
+#endif
+#include "../../src/rayrun.hpp"
+#include <s3d_bvh.h>
+#include <s3d_parallel.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+
+//-----------------------------------------------------------------------------
+// Using Statements
+//-----------------------------------------------------------------------------
+using namespace concurrency;
+
+
+//-----------------------------------------------------------------------------
+// Macros.
+//-----------------------------------------------------------------------------
+#ifndef SALSA_SORT_MIN_RAYS
+#define SALSA_SORT_MIN_RAYS     (256)   // 並び替えを行うバッチの最小レイ数(salsa.lua の defines で変更可).
+#endif
+
+#ifndef SALSA_PARALLEL_MIN_RAYS
+#define SALSA_PARALLEL_MIN_RAYS (65536) // 内部で分割して並列に処理するバッチの最小レイ数(salsa.lua の defines で変更可).
+#endif
+
+
+//-----------------------------------------------------------------------------
+// Gloval Variables.
+//-----------------------------------------------------------------------------
+s3d::LBVH gLBVH;        // Linear BVH.
+
+
+namespace {
+
+//-----------------------------------------------------------------------------
+// Constant Values.
+//-----------------------------------------------------------------------------
+constexpr size_t kPacketMinRays = 8;    // パケット化するバッチの最小レイ数.
+constexpr size_t kStreamMinRays = 1024; // ストリーム巡回に切り替えるバッチの最小レイ数.
+constexpr size_t kSortMinRays   = SALSA_SORT_MIN_RAYS;
+constexpr size_t kInterleaveMinRays = 16;   // 複数レイを交互に進める巡回に切り替えるバッチの最小レイ数.
+constexpr size_t kParallelMinRays   = SALSA_PARALLEL_MIN_RAYS;
+constexpr size_t kParallelChunkRays = 4096; // 並列処理で1つのタスクが受け持つレイ数.
+
+///////////////////////////////////////////////////////////////////////////////
+// PendingNormals structure
+///////////////////////////////////////////////////////////////////////////////
+struct PendingNormals
+{
+    std::vector<float*>     Targets;    //!< 書き込み先のレイの法線.
+    std::vector<uint32_t>   FaceIds;    //!< 交差した面の番号.
+    std::vector<float>      U;          //!< 重心座標(yに適用).
+    std::vector<float>      V;          //!< 重心座標(zに適用).
+
+    void Push(Ray& dst, const s3d::HitRecord& record)
+    {
+        Targets.push_back(dst.ns);
+        FaceIds.push_back(uint32_t(record.face_id));
+        U      .push_back(record.u);
+        V      .push_back(record.v);
+    }
+
+    void Clear()
+    {
+        Targets.clear();
+        FaceIds.clear();
+        U      .clear();
+        V      .clear();
+    }
+};
+
+//-----------------------------------------------------------------------------
+// Thread Local Variables.
+//-----------------------------------------------------------------------------
+thread_local s3d::OccluderCache         tOccluders;     // 最近 hitAny で交差した面.
+thread_local PendingNormals            tNormals;       // 法線の計算を後回しにした交差(SoA).
+
+//-----------------------------------------------------------------------------
+// Gloval Variables.
+//-----------------------------------------------------------------------------
+std::atomic<uint32_t> gCallerThreads(0);    // intersect() を呼んだことがあり, まだ生きているスレッド数.
+std::atomic<uint32_t> gActiveCalls(0);      // 今 intersect() の中にいる呼び出しの数.
+
+///////////////////////////////////////////////////////////////////////////////
+// CallerThread structure
+///////////////////////////////////////////////////////////////////////////////
+struct CallerThread
+{
+    bool    Registered; //!< intersect() を呼んで gCallerThreads に数えられているか?
+
+    // MSVC では DLL の thread_local はスレッドのアタッチ時に全スレッド(ワーカーも含む)で初期化されるので,
+    // コンストラクタでは数えず, intersect() の中で明示的に登録する.
+    constexpr CallerThread() noexcept
+    : Registered(false)
+    { /* DO_NOTHING */ }
+
+    ~CallerThread() noexcept
+    {
+        if (Registered)
+        { gCallerThreads.fetch_sub(1); }
+    }
+};
+
+thread_local CallerThread tCaller;  // 最初の intersect() の呼び出しで登録され, スレッドの終了で外れる.
+
+//-----------------------------------------------------------------------------
+//      競技用のレイを内部形式に変換します.
+//      範囲はシーンのボックスで切り詰め, シーンに当たらなければ false を返します.
+//-----------------------------------------------------------------------------
+__forceinline bool SetupRay(const Ray& src, s3d::Ray& dst, s3d::HitRecord& record)
+{
+    dst.pos.x = src.pos[0];
+    dst.pos.y = src.pos[1];
+    dst.pos.z = src.pos[2];
+
+    dst.dir.x = src.dir[0];
+    dst.dir.y = src.dir[1];
+    dst.dir.z = src.dir[2];
+
+    // -0 も +0 として逆数を取る. 軸に平行なレイの NaN はスラブ判定で無視される.
+    dst.inv_dir.x = s3d::InvDir(dst.dir.x);
+    dst.inv_dir.y = s3d::InvDir(dst.dir.y);
+    dst.inv_dir.z = s3d::InvDir(dst.dir.z);
+
+    dst.tmin = src.tnear;
+    dst.tmax = src.tfar;
+
+    record.hit  = false;
+    record.dist = src.tfar;
+
+    return gLBVH.ClipRay(dst, record);
+}
+
+//-----------------------------------------------------------------------------
+//      交差結果を競技用のレイに書き戻します.
+//-----------------------------------------------------------------------------
+__forceinline void StoreHit(const s3d::HitRecord& record, Ray& dst, bool hitAny)
+{
+    dst.isisect = record.hit;
+
+    // 交差していた場合のみ計算を行う.
+    if (record.hit)
+    {
+        // 遮蔽した面は近くのレイも遮蔽しやすいので覚えておく.
+        if (hitAny)
+        { tOccluders.Touch(uint32_t(record.face_id)); }
+
+        // 交差位置は頂点を補間せずにレイの式から求める.
+        dst.isect[0] = dst.pos[0] + dst.dir[0] * record.dist;
+        dst.isect[1] = dst.pos[1] + dst.dir[1] * record.dist;
+        dst.isect[2] = dst.pos[2] + dst.dir[2] * record.dist;
+        dst.faceid   = record.face_id;
+
+        // 法線はバッチの最後にまとめて補間する.
+        tNormals.Push(dst, record);
+    }
+}
+
+//-----------------------------------------------------------------------------
+//      後回しにした法線をカーネルのレーン数ずつまとめて補間して書き戻します.
+//-----------------------------------------------------------------------------
+void StoreNormals()
+{
+    const auto count = tNormals.Targets.size();
+    if (count == 0)
+    { return; }
+
+    // 頂点番号と法線の読み込みは AVX2/AVX-512 のカーネルならギャザー, それ以外はスカラーで行う.
+    gLBVH.Kernel->InterpolateNormals(
+        gLBVH,
+        tNormals.FaceIds.data(),
+        tNormals.U.data(),
+        tNormals.V.data(),
+        tNormals.Targets.data(),
+        count);
+
+    tNormals.Clear();
+}
+
+//-----------------------------------------------------------------------------
+//      レイを巡回する必要があるかチェックし, 必要なら内部形式に変換します.
+//      無効なレイ, シーンに当たらないレイ, 最近遮蔽した面で交差が確定したレイは
+//      結果を書き戻して false を返します.
+//-----------------------------------------------------------------------------
+__forceinline bool PrepareRay(Ray& src, s3d::Ray& ray, s3d::HitRecord& record, bool hitAny)
+{
+    if (!src.valid || !SetupRay(src, ray, record))
+    {
+        src.isisect = false;
+        return false;
+    }
+
+    if (hitAny && tOccluders.Count > 0 && gLBVH.TestOccluders(ray, record, tOccluders))
+    {
+        StoreHit(record, src, true);
+        return false;
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+//      有効なレイが全て同じ原点を持つかどうかチェックします.
+//-----------------------------------------------------------------------------
+bool IsSharedOrigin(const Ray* rays, size_t rayCount)
+{
+    const Ray* first = nullptr;
+    for(size_t i=0; i<rayCount; ++i)
+    {
+        if (!rays[i].valid)
+        { continue; }
+
+        if (first == nullptr)
+        {
+            first = &rays[i];
+            continue;
+        }
+
+        if (rays[i].pos[0] != first->pos[0]
+         || rays[i].pos[1] != first->pos[1]
+         || rays[i].pos[2] != first->pos[2])
+        { return false; }
+    }
+
+    return first != nullptr;
+}
+
+//-----------------------------------------------------------------------------
+//      head から原点が同じレイが続く本数を返します.
+//-----------------------------------------------------------------------------
+__forceinline size_t GetOriginRun(const Ray* rays, size_t head, size_t rayCount)
+{
+    const auto& first = rays[head];
+
+    auto tail = head + 1;
+    while(tail < rayCount
+       && rays[tail].pos[0] == first.pos[0]
+       && rays[tail].pos[1] == first.pos[1]
+       && rays[tail].pos[2] == first.pos[2])
+    { tail++; }
+
+    return tail - head;
+}
+
+//-----------------------------------------------------------------------------
+//      原点が同じレイの区間が, 平均してパケットにできる長さで並んでいるかチェックします.
+//      AOのように交差点ごとにレイをまとめて並べたバッチが該当します.
+//-----------------------------------------------------------------------------
+bool HasOriginRuns(const Ray* rays, size_t rayCount)
+{
+    size_t runCount = 0;
+    for(size_t head=0; head<rayCount; head+=GetOriginRun(rays, head, rayCount))
+    { runCount++; }
+
+    return rayCount >= runCount * kPacketMinRays;
+}
+
+//-----------------------------------------------------------------------------
+//      レイ番号を オクタント + 原点のモートンコード + 量子化した方向 の順に並べ替えます.
+//-----------------------------------------------------------------------------
+void SortRays(const Ray* rays, uint32_t* order, size_t count)
+{
+    thread_local std::vector<s3d::Vector2lu> keys;
+    keys.resize(count);
+
+    for(size_t i=0; i<count; ++i)
+    {
+        const auto& ray = rays[order[i]];
+
+        const auto octant = (ray.dir[0] < 0.0f ? 1 : 0)
+                          | (ray.dir[1] < 0.0f ? 2 : 0)
+                          | (ray.dir[2] < 0.0f ? 4 : 0);
+
+        const auto unitcube = gLBVH.Bounds.Normalize(s3d::Vector3f(ray.pos[0], ray.pos[1], ray.pos[2]));
+        const auto origin   = s3d::Morton3D(unitcube.x, unitcube.y, unitcube.z);
+        const auto dir      = s3d::Morton3D(
+            (ray.dir[0] + 1.0f) * 0.5f,
+            (ray.dir[1] + 1.0f) * 0.5f,
+            (ray.dir[2] + 1.0f) * 0.5f);
+
+        keys[i].x = (uint64_t(octant) << 60) | (uint64_t(origin) << 30) | dir;
+        keys[i].y = order[i];
+    }
+
+    std::sort(keys.begin(), keys.end(), [](const s3d::Vector2lu& lhs, const s3d::Vector2lu& rhs)
+    { return lhs.x < rhs.x; });
+
+    for(size_t i=0; i<count; ++i)
+    { order[i] = uint32_t(keys[i].y); }
+}
+
+//-----------------------------------------------------------------------------
+//      レイを1本ずつ交差判定します.
+//-----------------------------------------------------------------------------
+void IntersectSingle(Ray* rays, size_t rayCount, bool hitAny)
+{
+    // 小さなバッチはそのままの順で1本ずつ処理.
+    if (rayCount < kInterleaveMinRays)
+    {
+        for(size_t i=0; i<rayCount; ++i)
+        {
+            // 無効なレイやシーンに当たらないレイは巡回しない.
+            s3d::Ray ray;
+            s3d::HitRecord record;
+            if (!PrepareRay(rays[i], ray, record, hitAny))
+            { continue; }
+
+            if (!gLBVH.WideNodes.empty())
+            { gLBVH.TraverseWide(ray, record, hitAny); }
+            else
+            { gLBVH.TraverseIterative(ray, record, hitAny); }
+            StoreHit(record, rays[i], hitAny);
+        }
+        return;
+    }
+
+    thread_local std::vector<s3d::Ray>       traced;
+    thread_local std::vector<s3d::HitRecord> records;
+    thread_local std::vector<uint32_t>       order;
+
+    traced .resize(rayCount);
+    records.resize(rayCount);
+    order  .resize(rayCount);
+
+    size_t count = 0;
+    for(size_t i=0; i<rayCount; ++i)
+    {
+        if (PrepareRay(rays[i], traced[count], records[count], hitAny))
+        { order[count++] = uint32_t(i); }
+    }
+
+    // 近いレイを続けて処理し, ノードや三角形をキャッシュに残したまま使う.
+    // 並び替えのコストに見合わない小さなバッチはそのままの順で処理.
+    if (count >= kSortMinRays)
+    {
+        SortRays(rays, order.data(), count);
+
+        for(size_t i=0; i<count; ++i)
+        { SetupRay(rays[order[i]], traced[i], records[i]); }
+    }
+
+    // 多分木は1本あたりの巡回が短いので, 交互に進めずに順に処理する.
+    if (!gLBVH.WideNodes.empty())
+    {
+        for(size_t i=0; i<count; ++i)
+        { gLBVH.TraverseWide(traced[i], records[i], hitAny); }
+    }
+
+    // スタックレス巡回はレイごとの状態を持たないので, 交互に進めずに順に処理する.
+    else if (gLBVH.Stackless)
+    {
+        for(size_t i=0; i<count; ++i)
+        { gLBVH.TraverseIterative(traced[i], records[i], hitAny); }
+    }
+    else
+    { gLBVH.TraverseInterleaved(traced.data(), records.data(), count, hitAny); }
+
+    for(size_t i=0; i<count; ++i)
+    { StoreHit(records[i], rays[order[i]], hitAny); }
+}
+
+//-----------------------------------------------------------------------------
+//      原点を共有するレイを方向の符号(オクタント)ごとにパケット化して交差判定します.
+//      原点が共通なので, ノードや三角形に対する原点依存の量はパケットごとに1回だけ求まります.
+//-----------------------------------------------------------------------------
+void IntersectPacket(Ray* rays, size_t rayCount, bool hitAny)
+{
+    thread_local std::vector<uint32_t> order;
+    thread_local std::vector<uint32_t> pending;
+    thread_local std::vector<float>    starts;
+    thread_local std::vector<float>    clipped;
+    order  .resize(rayCount);
+    pending.resize(rayCount);
+    starts .resize(rayCount);
+    clipped.resize(rayCount);
+
+    // 巡回が必要なレイだけを残し, シーンで切り詰めた区間を覚えておく.
+    size_t pendingCount = 0;
+    for(size_t i=0; i<rayCount; ++i)
+    {
+        s3d::Ray ray;
+        s3d::HitRecord record;
+        if (!PrepareRay(rays[i], ray, record, hitAny))
+        { continue; }
+
+        starts [i] = ray.tmin;
+        clipped[i] = record.dist;
+        pending[pendingCount++] = uint32_t(i);
+    }
+
+    // オクタントごとに数える.
+    uint32_t offset[9] = {};
+    for(size_t j=0; j<pendingCount; ++j)
+    {
+        const auto i = pending[j];
+        const auto octant = (rays[i].dir[0] < 0.0f ? 1 : 0)
+                          | (rays[i].dir[1] < 0.0f ? 2 : 0)
+                          | (rays[i].dir[2] < 0.0f ? 4 : 0);
+        offset[octant + 1]++;
+    }
+
+    for(auto i=0; i<8; ++i)
+    { offset[i + 1] += offset[i]; }
+
+    // オクタント順に並べる.
+    uint32_t cursor[8];
+    for(auto i=0; i<8; ++i)
+    { cursor[i] = offset[i]; }
+
+    for(size_t j=0; j<pendingCount; ++j)
+    {
+        const auto i = pending[j];
+        const auto octant = (rays[i].dir[0] < 0.0f ? 1 : 0)
+                          | (rays[i].dir[1] < 0.0f ? 2 : 0)
+                          | (rays[i].dir[2] < 0.0f ? 4 : 0);
+        order[cursor[octant]++] = uint32_t(i);
+    }
+
+    // パケットのレーン数は選ばれたカーネルの命令セットで決まる.
+    const auto packetSize = gLBVH.Kernel->PacketSize;
+
+    for(auto octant=0; octant<8; ++octant)
+    {
+        for(auto head=offset[octant]; head<offset[octant + 1]; head+=packetSize)
+        {
+            const auto count = s3d::Min(packetSize, offset[octant + 1] - head);
+
+            s3d::RayPacket packet;
+            s3d::HitRecord records[s3d::kMaxPacketSize];
+
+            // 方向は正規化されているとは限らないので, 最も長いレーンの長さを覚えておく.
+            auto dir_len_sq = 0.0f;
+
+            // 空きレーンは先頭のレイで埋めておき, マスクで無効化する.
+            for(uint32_t i=0; i<packetSize; ++i)
+            {
+                const auto  ray = order[head + s3d::Min(i, count - 1)];
+                const auto& src = rays[ray];
+                for(auto j=0; j<3; ++j)
+                {
+                    packet.dir    [j][i] = src.dir[j];
+                    packet.inv_dir[j][i] = s3d::InvDir(src.dir[j]);
+                }
+                dir_len_sq = s3d::Max(dir_len_sq, src.dir[0] * src.dir[0] + src.dir[1] * src.dir[1] + src.dir[2] * src.dir[2]);
+                // 単一レイの巡回と同じく, シーンのボックスで切り詰めた区間から巡回を始める.
+                packet.tmin[i] = starts [ray];
+                packet.tmax[i] = clipped[ray];
+
+                records[i].hit  = false;
+                records[i].dist = clipped[ray];
+            }
+
+            const auto& origin = rays[order[head]].pos;
+
+            packet.pos     = s3d::Vector3f(origin[0], origin[1], origin[2]);
+            packet.dir_len = sqrt(dir_len_sq);
+            packet.sign[0] = (octant & 1) ? 1 : 0;
+            packet.sign[1] = (octant & 2) ? 1 : 0;
+            packet.sign[2] = (octant & 4) ? 1 : 0;
+            packet.mask    = (1 << count) - 1;
+
+            if (!gLBVH.WideNodes.empty())
+            { gLBVH.TraversePacketWide(packet, records, hitAny); }
+            else
+            { gLBVH.TraversePacket(packet, records, hitAny); }
+
+            for(uint32_t i=0; i<count; ++i)
+            { StoreHit(records[i], rays[order[head + i]], hitAny); }
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+//      大きなバッチをレイの集合としてまとめて巡回し交差判定します.
+//-----------------------------------------------------------------------------
+void IntersectStream(Ray* rays, size_t rayCount, bool hitAny, bool sharedOrigin)
+{
+    thread_local std::vector<s3d::Ray>       stream;
+    thread_local std::vector<s3d::HitRecord> records;
+    thread_local std::vector<uint32_t>       order;
+
+    stream .resize(rayCount);
+    records.resize(rayCount);
+    order  .resize(rayCount);
+
+    // 巡回が必要なレイだけを詰める.
+    size_t count = 0;
+    for(size_t i=0; i<rayCount; ++i)
+    {
+        if (PrepareRay(rays[i], stream[count], records[count], hitAny))
+        { order[count++] = uint32_t(i); }
+    }
+
+    if (count == 0)
+    { return; }
+
+    // バラバラなレイは並び替えてからストリームに詰める.
+    if (!sharedOrigin && count >= kSortMinRays)
+    {
+        SortRays(rays, order.data(), count);
+
+        for(size_t i=0; i<count; ++i)
+        { SetupRay(rays[order[i]], stream[i], records[i]); }
+    }
+
+    gLBVH.TraverseStream(stream.data(), records.data(), count, hitAny);
+
+    for(size_t i=0; i<count; ++i)
+    { StoreHit(records[i], rays[order[i]], hitAny); }
+}
+
+//-----------------------------------------------------------------------------
+//      原点が同じレイの区間ごとに交差判定します.
+//      パケットにできる長さの区間はパケットで, 短い区間は隣り合うものをまとめて1本ずつ処理します.
+//-----------------------------------------------------------------------------
+void IntersectOriginRuns(Ray* rays, size_t rayCount, bool hitAny)
+{
+    // 1本ずつ処理する区間の先頭.
+    size_t single = 0;
+
+    size_t head = 0;
+    while(head < rayCount)
+    {
+        const auto count = GetOriginRun(rays, head, rayCount);
+        if (count >= kPacketMinRays)
+        {
+            if (single < head)
+            { IntersectSingle(rays + single, head - single, hitAny); }
+
+            IntersectPacket(rays + head, count, hitAny);
+            single = head + count;
+        }
+
+        head += count;
+    }
+
+    if (single < rayCount)
+    { IntersectSingle(rays + single, rayCount - single, hitAny); }
+}
+
+//-----------------------------------------------------------------------------
+//      バッチの大きさとレイの性質に合わせた方法で交差判定します.
+//-----------------------------------------------------------------------------
+void IntersectBatch(Ray* rays, size_t rayCount, bool hitAny)
+{
+    const auto sharedOrigin = (rayCount >= kPacketMinRays) && IsSharedOrigin(rays, rayCount);
+
+    // タイル単位のAOのように交差点ごとのレイの束が並んだバッチは, 束ごとにパケットで処理する.
+    if (!sharedOrigin && rayCount >= kPacketMinRays * 2 && HasOriginRuns(rays, rayCount))
+    { IntersectOriginRuns(rays, rayCount, hitAny); }
+
+    // タイル単位などの大きなバッチはノードの読み込みをレイ全体で共有する.
+    // 多分木があれば, 大きなバッチもパケットか1本ずつ多分木で辿る方が速い.
+    else if (rayCount >= kStreamMinRays && gLBVH.WideNodes.empty())
+    { IntersectStream(rays, rayCount, hitAny, sharedOrigin); }
+
+    // AOのように1点から飛ばすレイの束はパケットでまとめて処理する.
+    else if (sharedOrigin)
+    { IntersectPacket(rays, rayCount, hitAny); }
+
+    else
+    { IntersectSingle(rays, rayCount, hitAny); }
+
+    // 交差したレイの法線をまとめて求める.
+    StoreNormals();
+}
+
+} // namespace
+
+#if defined(_WIN32)
+//-----------------------------------------------------------------------------
+//      DLLメインエントリーポイントです.
+//-----------------------------------------------------------------------------
+BOOL APIENTRY DllMain(HMODULE, DWORD, LPVOID)
+{ return TRUE; }
+#endif
+
+//-----------------------------------------------------------------------------
+//      競技で定められている事前処理関数(スレッドによる規定は書いてない).
+//-----------------------------------------------------------------------------
+void preprocess
+(
+    const float*    vertices,       // 頂点座標配列.
+    size_t          vertexCount,    // 頂点数.
+    const float*    normals,        // 法線配列.
+    size_t          normalCount,    // 法線数.
+    const uint32_t* indices,        // 頂点インデックス(v0, n0, v1, n1, v2, n2...のように格納される, また三角形はすでに行われているものとする).
+    size_t          faceCount       // 頂点インデックス数.
+)
+{
+    gLBVH.PositionCount = vertexCount;
+    gLBVH.Positions     = reinterpret_cast<const s3d::Vector3f*>(vertices);
+
+    gLBVH.NormalCount   = normalCount;
+    gLBVH.Normals       = reinterpret_cast<const s3d::Vector3f*>(normals);
+
+    gLBVH.IndexCount    = faceCount * 3;
+    gLBVH.Indices       = reinterpret_cast<const s3d::VertexIndex*>(indices);
+
+    gLBVH.Build();
+}
+
+//------------------------------------------------------------------------------
+//      競技で定められている交差判定関数(マルチスレッドで呼び出される).
+//------------------------------------------------------------------------------
+void intersect
+(
+    Ray*    rays,           // レイ配列.
+    size_t  rayCount,       // レイ数.
+    bool    hitAny          // 交差が1つ以上あることが確定した段階で戻るか?
+)
+{
+    // 呼び出し側が複数スレッドから小さなバッチで呼ぶ場合は,
+    // ここをparallel_for化してもそんなに早くならなかった(むしろ，ちょっと遅くなる).
+    // 呼び出し側が複数スレッドで動いている場合は, 今 intersect() の中にいるのが1つだけでも
+    // 他のスレッドがコアを使っているので分割しない. 1つのスレッドからしか呼ばれていない場合だけ,
+    // 大きなバッチを分割して常駐ワーカーと一緒に処理する(MSVC の PPL でも同じ).
+    // 呼び出したスレッドが1つでも, 他の呼び出しが中にいる間も分割しない.
+    if (!tCaller.Registered)
+    {
+        tCaller.Registered = true;
+        gCallerThreads.fetch_add(1);
+    }
+
+    const auto active = gActiveCalls.fetch_add(1) + 1;
+
+    if (rayCount >= kParallelMinRays && active == 1 && gCallerThreads.load() == 1)
+    {
+        const auto chunkCount = (rayCount + kParallelChunkRays - 1) / kParallelChunkRays;
+        parallel_for<size_t>(0, chunkCount, [&](size_t i)
+        {
+            const auto offset = i * kParallelChunkRays;
+            IntersectBatch(rays + offset, std::min(kParallelChunkRays, rayCount - offset), hitAny);
+        });
+    }
+    else
+    { IntersectBatch(rays, rayCount, hitAny); }
+
+    gActiveCalls.fetch_sub(1);
+}
+
+//------------------------------------------------------------------------------
+//      使用している走査カーネルの名前を返します(preprocess後に有効).
+//      rayrun.hpp の関数ではないので, ハーネスは見つかった場合だけ呼び出します.
+//------------------------------------------------------------------------------
+RAYRUN_EXPORT const char* kernelName()
+{ return gLBVH.Kernel->Name; }
+
 #endif
\ No newline at end of file
@@ -1,211 +1,738 @@
-﻿//-----------------------------------------------------------------------------
-// File : s3d_bvh.cpp
-// Desc : Bounding Volume Hierarchy.
-// Copyright(c) Project Asura. All right reserved.
-//-----------------------------------------------------------------------------
-
-//-----------------------------------------------------------------------------
-// Includes
-//-----------------------------------------------------------------------------
-#include <s3d_bvh.h>
-#include <ppl.h>
-
-
-//-----------------------------------------------------------------------------
-// Using Statements
-//-----------------------------------------------------------------------------
-using namespace concurrency;
-
-
-namespace {
-
-// delta function in sec3 of the paper
-// "Fast and Simple Agglomerative LBVH Construction"
-__forceinline uint32_t Delta(const std::vector<s3d::Vector2u> &leaves, const uint32_t id)
-{ return leaves[id + 1].y ^ leaves[id].y; }
-
-} // namespace
-
-
-namespace s3d {
-
-///////////////////////////////////////////////////////////////////////////////
-// LBVH structure
-///////////////////////////////////////////////////////////////////////////////
-
-//-----------------------------------------------------------------------------
-//      構築処理を行います.
-//-----------------------------------------------------------------------------
-void LBVH::Build()
-{
-    AABB box;
-    box.Clear();
-
-    // 全体のバウンディングボックスを求める.
-    for(size_t i=0; i<PositionCount; ++i)
-    { box.Merge(Positions[i]); }
-
-    // ポリゴン数.
-    const auto T = uint32_t(IndexCount / 3);
-
-    // allocate pair <reference, morton code>
-    std::vector<Vector2u> leaves;
-    leaves.resize(T);
-
-    // モートンコードを設定.
-    parallel_for<uint32_t>(0, T, [&](uint32_t i)
-    {
-        const auto id = i * 3;
-        const auto centroid = (Positions[Indices[id + 0].P] + Positions[Indices[id + 1].P] + Positions[Indices[id + 2].P]) / 3.0f;
-        const auto unitcube = box.Normalize(centroid);
-        leaves[i].x = i;
-        leaves[i].y = Morton3D(unitcube.x, unitcube.y, unitcube.z);
-    });
-
-    // モートンコードでソートする.
-    parallel_radixsort(leaves.begin(), leaves.end(), [&](const Vector2u& val)
-    {
-        return val.y;
-    });
-
-    // ノードの数.
-    const auto N = T - 1;
-    Nodes.resize(N);
-
-    // otherBounds in algorithm 1 of the paper
-    // "Massively Parallel Construction of Radix Tree Forests for the Efficient Sampling of Discrete Probability Distributions"
-    // https://arxiv.org/pdf/1901.05423.pdf
-    std::vector<std::atomic<uint32_t>> other_bounds(N);
-    parallel_for<size_t>(0, N, [&](size_t i)
-    {
-        other_bounds[i].store(kInvalid);
-    });
-
-    parallel_for<uint32_t>(0, T, [&](uint32_t i)
-    {
-        // 現在のリーフ/ノードID.
-        auto current = i;
-
-        // 範囲.
-        auto L = current;
-        auto R = current;
-
-        // 葉ノードのAABB
-        const auto id = leaves[i].x * 3;
-        AABB aabb (Positions[Indices[id + 0].P]);
-        aabb.Merge(Positions[Indices[id + 1].P]);
-        aabb.Merge(Positions[Indices[id + 2].P]);
-        aabb.mini -= box.mini;
-        aabb.maxi -= box.mini;
-
-        // リーフまたはノードか?.
-        auto is_leaf = true;
-        while(1)
-        {
-            // 全体の範囲がカバーされたら, おしまい.
-            if (0 == L && R == N)
-            {
-                Root = current;
-                break;
-            }
-
-            // リーフ/ノード番号.
-            // 下位1ビットはリーフノード判定ビットとして利用するため, 1bitシフト.
-            const auto index = (is_leaf) ? (leaves[current].x << 1) + 1 : current << 1;
-
-            uint32_t previous, parent;
-            if (0 == L || (R != N && Delta(leaves, R) < Delta(leaves, L - 1)) )
-            {
-                // 右が親で，"左"は変化しない.
-                parent = R;
-                previous = other_bounds[parent].exchange(L);
-                if (kInvalid != previous)
-                { R = previous; }
-                Nodes[parent].L = index;
-            }
-            else
-            {
-                // 親が左で，"右"は変換しない.
-                parent = L - 1;
-                previous = other_bounds[parent].exchange(R);
-                if (kInvalid != previous)
-                { L = previous; }
-                Nodes[parent].R = index;
-            }
-
-            // マージする.
-            Nodes[parent].Box.Merge(aabb);
-
-            // このスレッドを終了する.
-            if (kInvalid == previous)
-            { break; }
-
-            current = parent;
-            aabb    = Nodes[current].Box;
-            is_leaf = false;
-        }
-    });
-
-    // ずらした分を戻す.
-    parallel_for<size_t>(0, N, [&](size_t i)
-    {
-        Nodes[i].Box.mini += box.mini;
-        Nodes[i].Box.maxi += box.mini;
-    });
-}
-
-//-----------------------------------------------------------------------------
-//      データを破棄します.
-//-----------------------------------------------------------------------------
-void LBVH::Destruct()
-{
-    Nodes.clear();
-    Nodes.shrink_to_fit();
-
-    PositionCount = 0;
-    Positions = nullptr;
-
-    NormalCount = 0;
-    Normals = nullptr;
-
-    IndexCount = 0;
-    Indices = nullptr;
-}
-
-//-----------------------------------------------------------------------------
-//      ノードを巡回し交差判定を取ります.
-//-----------------------------------------------------------------------------
-void LBVH::TraverseIterative(const Ray& ray, HitRecord& record) const
-{
-    uint32_t visit_stack[64];
-    uint32_t stack_ptr = 1;
-
-    // ルートノードだけpush
-    visit_stack[0] = Root;
-
-    // スタックが空になるまで処理.
-    while(stack_ptr > 0)
-    {
-        --stack_ptr; // pop.
-        const auto  idx  = visit_stack[stack_ptr];
-        const auto& node = Nodes[idx];
-
-        if (!node.Box.Intersect(ray.pos, ray.inv_dir, record.dist))
-        { continue; }
-
-        const auto idxL = node.L >> 1;
-        const auto idxR = node.R >> 1;
-
-        if (node.L & 0x1)
-            IsHit(ray, record, idxL);
-        else
-            visit_stack[stack_ptr++] = idxL; // push.
-
-        if (node.R & 0x1)
-            IsHit(ray, record, idxR);
-        else
-            visit_stack[stack_ptr++] = idxR; // push.
-    }
-}
-
-} // namespace s3d
+﻿//-----------------------------------------------------------------------------
+// File : s3d_bvh.cpp
+// Desc : Bounding Volume Hierarchy.
+// Copyright(c) Project Asura. All right reserved.
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+#include <s3d_bvh.h>
+#include <s3d_parallel.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+
+//-----------------------------------------------------------------------------
+// Using Statements
+//-----------------------------------------------------------------------------
+using namespace concurrency;
+
+
+namespace {
+
+///////////////////////////////////////////////////////////////////////////////
+// Node structure
+///////////////////////////////////////////////////////////////////////////////
+struct Node
+{
+    s3d::AABB   Box;    //!< バウンディングボックス.
+    uint32_t    L;      //!< 子ノード左. (末尾が0x1なら葉ノード).
+    uint32_t    R;      //!< 子ノード右. (末尾が0x1なら葉ノード).
+
+    __forceinline Node() noexcept
+    : Box(nullptr)
+    , L  (s3d::kInvalid)
+    , R  (s3d::kInvalid)
+    { /* DO_NOTHING */ }
+};
+
+// delta function in sec3 of the paper
+// "Fast and Simple Agglomerative LBVH Construction"
+__forceinline uint32_t Delta(const std::vector<s3d::Vector2u> &leaves, const uint32_t id)
+{ return leaves[id + 1].y ^ leaves[id].y; }
+
+// マスクが立っているレーンだけ値を差し替える.
+__forceinline __m128 Select(__m128 mask, __m128 a, __m128 b)
+{ return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+// 4本のレイに対するスラブ判定.
+__forceinline int IntersectBox4
+(
+    const s3d::AABB&    box,
+    const __m128*       pos,
+    const __m128*       inv_dir,
+    __m128              start,
+    __m128              dist
+)
+{
+    const auto tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.mini.x), pos[0]), inv_dir[0]);
+    const auto ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.mini.y), pos[1]), inv_dir[1]);
+    const auto tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.mini.z), pos[2]), inv_dir[2]);
+    const auto tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maxi.x), pos[0]), inv_dir[0]);
+    const auto ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maxi.y), pos[1]), inv_dir[1]);
+    const auto tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maxi.z), pos[2]), inv_dir[2]);
+
+    // 近い面と遠い面はレーンごとの方向の符号で選び, NaN の軸は第1引数にして無視する.
+    const auto zero = _mm_setzero_ps();
+    const auto nx = _mm_cmplt_ps(inv_dir[0], zero);
+    const auto ny = _mm_cmplt_ps(inv_dir[1], zero);
+    const auto nz = _mm_cmplt_ps(inv_dir[2], zero);
+
+    auto tmin = start;
+    auto tmax = dist;
+    tmin = _mm_max_ps(Select(nx, tx1, tx0), tmin);
+    tmin = _mm_max_ps(Select(ny, ty1, ty0), tmin);
+    tmin = _mm_max_ps(Select(nz, tz1, tz0), tmin);
+    tmax = _mm_min_ps(Select(nx, tx0, tx1), tmax);
+    tmax = _mm_min_ps(Select(ny, ty0, ty1), tmax);
+    tmax = _mm_min_ps(Select(nz, tz0, tz1), tmax);
+    tmax = _mm_mul_ps(tmax, _mm_set1_ps(s3d::kSlabScale));
+
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+}
+
+// レイ番号で指定した4本のレイに対する左右の子のスラブ判定. 戻り値は下位4ビットが左, 上位4ビットが右.
+// レイのデータは1回だけ集めて, 2つのボックスの判定で使い回す.
+__forceinline int IntersectChildren4
+(
+    const s3d::ChildBoxNode&    node,
+    const s3d::Ray*             rays,
+    const s3d::HitRecord*       records,
+    const uint32_t*             id
+)
+{
+    const auto& r0 = rays[id[0]];
+    const auto& r1 = rays[id[1]];
+    const auto& r2 = rays[id[2]];
+    const auto& r3 = rays[id[3]];
+
+    const __m128 pos[3] = {
+        _mm_setr_ps(r0.pos.x, r1.pos.x, r2.pos.x, r3.pos.x),
+        _mm_setr_ps(r0.pos.y, r1.pos.y, r2.pos.y, r3.pos.y),
+        _mm_setr_ps(r0.pos.z, r1.pos.z, r2.pos.z, r3.pos.z)
+    };
+    const __m128 inv_dir[3] = {
+        _mm_setr_ps(r0.inv_dir.x, r1.inv_dir.x, r2.inv_dir.x, r3.inv_dir.x),
+        _mm_setr_ps(r0.inv_dir.y, r1.inv_dir.y, r2.inv_dir.y, r3.inv_dir.y),
+        _mm_setr_ps(r0.inv_dir.z, r1.inv_dir.z, r2.inv_dir.z, r3.inv_dir.z)
+    };
+    const auto start = _mm_setr_ps(r0.tmin, r1.tmin, r2.tmin, r3.tmin);
+    const auto dist  = _mm_setr_ps(
+        records[id[0]].dist,
+        records[id[1]].dist,
+        records[id[2]].dist,
+        records[id[3]].dist);
+
+    return IntersectBox4(node.GetBox(0), pos, inv_dir, start, dist)
+        | (IntersectBox4(node.GetBox(1), pos, inv_dir, start, dist) << 4);
+}
+
+
+//-----------------------------------------------------------------------------
+//      CPUの対応命令を調べて, 使えるうち最も幅の広いカーネルを選びます.
+//      環境変数 SALSA_KERNEL (sse2/sse42/avx2/avx512) で上限を指定できます.
+//-----------------------------------------------------------------------------
+const s3d::KernelTable* SelectKernel()
+{
+    bool sse42  = false;
+    bool avx2   = false;
+    bool avx512 = false;
+
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const auto max_id = info[0];
+
+    __cpuid(info, 1);
+    const auto osxsave = (info[2] & (1 << 27)) != 0;
+    const auto avx     = (info[2] & (1 << 28)) != 0;
+    sse42 = (info[2] & (1 << 20)) != 0;
+
+    // OSがYMM/ZMMレジスタを退避しているかどうかも確認する.
+    if (max_id >= 7 && osxsave && avx)
+    {
+        const auto xcr0 = _xgetbv(0);
+        const auto ymm  = (xcr0 & 0x06) == 0x06;
+        const auto zmm  = (xcr0 & 0xe6) == 0xe6;
+
+        __cpuidex(info, 7, 0);
+        const auto ebx = uint32_t(info[1]);
+        avx2   = ymm && (ebx & (1u << 5)) != 0;
+
+        // AVX-512 のカーネルは F, CD, BW, DQ, VL の命令を使う.
+        const auto mask = (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31);
+        avx512 = avx2 && zmm && (ebx & mask) == mask;
+    }
+#else
+    __builtin_cpu_init();
+    sse42  = __builtin_cpu_supports("sse4.2") != 0;
+    avx2   = __builtin_cpu_supports("avx2") != 0;
+    avx512 = avx2
+          && __builtin_cpu_supports("avx512f")
+          && __builtin_cpu_supports("avx512cd")
+          && __builtin_cpu_supports("avx512bw")
+          && __builtin_cpu_supports("avx512dq")
+          && __builtin_cpu_supports("avx512vl");
+#endif
+
+    // 比較用にカーネルを落とせるようにしておく.
+    if (const auto limit = getenv("SALSA_KERNEL"))
+    {
+        if (strcmp(limit, "sse2") == 0)
+        { sse42 = avx2 = avx512 = false; }
+        else if (strcmp(limit, "sse42") == 0)
+        { avx2 = avx512 = false; }
+        else if (strcmp(limit, "avx2") == 0)
+        { avx512 = false; }
+    }
+
+    if (avx512)
+    { return &s3d::avx512::Kernel; }
+
+    if (avx2)
+    { return &s3d::avx2::Kernel; }
+
+    if (sse42)
+    { return &s3d::sse42::Kernel; }
+
+    return &s3d::sse2::Kernel;
+}
+
+} // namespace
+
+
+namespace s3d {
+
+///////////////////////////////////////////////////////////////////////////////
+// LBVH structure
+///////////////////////////////////////////////////////////////////////////////
+
+//-----------------------------------------------------------------------------
+//      構築処理を行います.
+//-----------------------------------------------------------------------------
+void LBVH::Build()
+{
+    Kernel = SelectKernel();
+
+    // 比較用に, 環境変数 SALSA_TRAVERSAL=stackless でスタックを使わない巡回に切り替えられるようにしておく.
+    const auto traversal = getenv("SALSA_TRAVERSAL");
+    Stackless = (traversal != nullptr) && strcmp(traversal, "stackless") == 0;
+
+    AABB box;
+    box.Clear();
+
+    // 全体のバウンディングボックスを求める.
+    for(size_t i=0; i<PositionCount; ++i)
+    { box.Merge(Positions[i]); }
+
+    Bounds = box;
+
+    // 境界上の三角形を丸め誤差で落とさないように, 切り詰め用のボックスは少し広げておく.
+    {
+        const auto size   = box.maxi - box.mini;
+        const auto margin = Max3(size) * 1e-4f + FLT_EPSILON;
+        ClipBounds = AABB(
+            box.mini - Vector3f(margin, margin, margin),
+            box.maxi + Vector3f(margin, margin, margin));
+    }
+
+    // ポリゴン数.
+    const auto T = uint32_t(IndexCount / 3);
+
+    // allocate pair <reference, morton code>
+    std::vector<Vector2u> leaves;
+    leaves.resize(T);
+
+    // モートンコードを設定.
+    parallel_for<uint32_t>(0, T, [&](uint32_t i)
+    {
+        const auto id = i * 3;
+        const auto centroid = (Positions[Indices[id + 0].P] + Positions[Indices[id + 1].P] + Positions[Indices[id + 2].P]) / 3.0f;
+        const auto unitcube = box.Normalize(centroid);
+        leaves[i].x = i;
+        leaves[i].y = Morton3D(unitcube.x, unitcube.y, unitcube.z);
+    });
+
+    // モートンコードでソートする.
+    SortByKey(leaves.begin(), leaves.end(), [&](const Vector2u& val)
+    {
+        return val.y;
+    });
+
+    // ノードの数.
+    // 巡回には子のボックスを親に持たせたノードだけを使うので, 構築用のノードと親リンクは構築後に捨てる.
+    const auto N = T - 1;
+    std::vector<Node>     nodes  (N);
+    std::vector<uint32_t> parents(N);
+
+    // otherBounds in algorithm 1 of the paper
+    // "Massively Parallel Construction of Radix Tree Forests for the Efficient Sampling of Discrete Probability Distributions"
+    // https://arxiv.org/pdf/1901.05423.pdf
+    std::vector<std::atomic<uint32_t>> other_bounds(N);
+    parallel_for<size_t>(0, N, [&](size_t i)
+    {
+        other_bounds[i].store(kInvalid);
+        parents[i] = kInvalid;
+    });
+
+    parallel_for<uint32_t>(0, T, [&](uint32_t i)
+    {
+        // 現在のリーフ/ノードID.
+        auto current = i;
+
+        // 範囲.
+        auto L = current;
+        auto R = current;
+
+        // 葉ノードのAABB
+        const auto id = leaves[i].x * 3;
+        AABB aabb (Positions[Indices[id + 0].P]);
+        aabb.Merge(Positions[Indices[id + 1].P]);
+        aabb.Merge(Positions[Indices[id + 2].P]);
+        aabb.mini -= box.mini;
+        aabb.maxi -= box.mini;
+
+        // リーフまたはノードか?.
+        auto is_leaf = true;
+        while(1)
+        {
+            // 全体の範囲がカバーされたら, おしまい.
+            if (0 == L && R == N)
+            {
+                Root = current;
+                break;
+            }
+
+            // リーフ/ノード番号.
+            // 下位1ビットはリーフノード判定ビットとして利用するため, 1bitシフト.
+            const auto index = (is_leaf) ? (leaves[current].x << 1) + 1 : current << 1;
+
+            uint32_t previous, parent;
+            if (0 == L || (R != N && Delta(leaves, R) < Delta(leaves, L - 1)) )
+            {
+                // 右が親で，"左"は変化しない.
+                parent = R;
+                previous = other_bounds[parent].exchange(L);
+                if (kInvalid != previous)
+                { R = previous; }
+                nodes[parent].L = index;
+            }
+            else
+            {
+                // 親が左で，"右"は変換しない.
+                parent = L - 1;
+                previous = other_bounds[parent].exchange(R);
+                if (kInvalid != previous)
+                { L = previous; }
+                nodes[parent].R = index;
+            }
+
+            // 親リンク(スタックレス巡回用).
+            if (!is_leaf)
+            { parents[current] = parent; }
+
+            // マージする.
+            nodes[parent].Box.Merge(aabb);
+
+            // このスレッドを終了する.
+            if (kInvalid == previous)
+            { break; }
+
+            current = parent;
+            aabb    = nodes[current].Box;
+            is_leaf = false;
+        }
+    });
+
+    // ずらした分を戻す.
+    // 引いて足す間の丸め誤差で頂点がボックスからはみ出さないように, 誤差の上限だけ外側に広げる.
+    parallel_for<size_t>(0, N, [&](size_t i)
+    {
+        auto& b = nodes[i].Box;
+        b.mini += box.mini;
+        b.maxi += box.mini;
+
+        b.mini.x -= Gamma(3) * (fabs(b.mini.x) + fabs(box.mini.x));
+        b.mini.y -= Gamma(3) * (fabs(b.mini.y) + fabs(box.mini.y));
+        b.mini.z -= Gamma(3) * (fabs(b.mini.z) + fabs(box.mini.z));
+        b.maxi.x += Gamma(3) * (fabs(b.maxi.x) + fabs(box.mini.x));
+        b.maxi.y += Gamma(3) * (fabs(b.maxi.y) + fabs(box.mini.y));
+        b.maxi.z += Gamma(3) * (fabs(b.maxi.z) + fabs(box.mini.z));
+    });
+
+    // 子のボックス. 内部ノードはノードのボックス, 葉ノードは三角形から求める.
+    const auto get_child_box = [&](uint32_t child)
+    {
+        if (!(child & 0x1))
+        { return nodes[child >> 1].Box; }
+
+        const auto id = (child >> 1) * 3;
+        AABB aabb (Positions[Indices[id + 0].P]);
+        aabb.Merge(Positions[Indices[id + 1].P]);
+        aabb.Merge(Positions[Indices[id + 2].P]);
+        return aabb;
+    };
+
+    // 子のボックスを親に持たせたノードを作る.
+    ChildBoxNodes.resize(N);
+    parallel_for<size_t>(0, N, [&](size_t i)
+    {
+        const auto boxL = get_child_box(nodes[i].L);
+        const auto boxR = get_child_box(nodes[i].R);
+
+        auto& dst = ChildBoxNodes[i];
+        dst.BoxX[0] = boxL.mini.x; dst.BoxX[1] = boxR.mini.x; dst.BoxX[2] = boxL.maxi.x; dst.BoxX[3] = boxR.maxi.x;
+        dst.BoxY[0] = boxL.mini.y; dst.BoxY[1] = boxR.mini.y; dst.BoxY[2] = boxL.maxi.y; dst.BoxY[3] = boxR.maxi.y;
+        dst.BoxZ[0] = boxL.mini.z; dst.BoxZ[1] = boxR.mini.z; dst.BoxZ[2] = boxL.maxi.z; dst.BoxZ[3] = boxR.maxi.z;
+        dst.L        = nodes[i].L;
+        dst.R        = nodes[i].R;
+        dst.Parent   = parents[i];
+        dst.Reserved = 0;
+    });
+
+    // 多分木を辿れるカーネルを使う場合だけ多分木を作る. スタックレス巡回は2分木だけで行う.
+    if (Kernel->TraverseWide != nullptr && !Stackless)
+    { BuildWide(); }
+    else
+    {
+        WideNodes.clear();
+        WideNodes.shrink_to_fit();
+    }
+}
+
+//-----------------------------------------------------------------------------
+//      2分木を畳み込んで, 子を最大8つ持つ多分木を構築します.
+//-----------------------------------------------------------------------------
+void LBVH::BuildWide()
+{
+    WideNodes.clear();
+
+    // 畳み込む前の2分木のノード(先頭から順に多分木のノードになる)と深さ.
+    std::vector<uint32_t> sources;
+    std::vector<uint32_t> depths;
+    sources.reserve(ChildBoxNodes.size());
+    depths .reserve(ChildBoxNodes.size());
+    sources.push_back(Root << 1);
+    depths .push_back(1);
+
+    WideNodes.reserve(ChildBoxNodes.size() / 2 + 1);
+
+    // 幅優先で作るので, 兄弟ノードは連続して並ぶ.
+    for(size_t head=0; head<sources.size(); ++head)
+    {
+        const auto& src = ChildBoxNodes[sources[head] >> 1];
+
+        // 子のボックスは親が持っているので, 子と一緒に覚えておく.
+        uint32_t children[kWideNodeSize];
+        AABB     boxes   [kWideNodeSize];
+        uint32_t count = 0;
+        children[count] = src.L; boxes[count] = src.GetBox(0); count++;
+        children[count] = src.R; boxes[count] = src.GetBox(1); count++;
+
+        // 表面積が最大の内部ノードを子と入れ替えて, 子が8つになるまで広げる.
+        while(count < kWideNodeSize)
+        {
+            auto best      = kInvalid;
+            auto best_area = -1.0f;
+            for(uint32_t i=0; i<count; ++i)
+            {
+                if (children[i] & 0x1)
+                { continue; }
+
+                const auto area = boxes[i].SurfaceArea();
+                if (area > best_area)
+                {
+                    best      = i;
+                    best_area = area;
+                }
+            }
+
+            if (best == kInvalid)
+            { break; }
+
+            const auto& expand = ChildBoxNodes[children[best] >> 1];
+            children[best]  = expand.L; boxes[best]  = expand.GetBox(0);
+            children[count] = expand.R; boxes[count] = expand.GetBox(1); count++;
+        }
+
+        WideNode dst = {};
+        for(uint32_t i=0; i<count; ++i)
+        {
+            const auto& box = boxes[i];
+            dst.BoxX[i] = box.mini.x; dst.BoxX[i + kWideNodeSize] = box.maxi.x;
+            dst.BoxY[i] = box.mini.y; dst.BoxY[i + kWideNodeSize] = box.maxi.y;
+            dst.BoxZ[i] = box.mini.z; dst.BoxZ[i + kWideNodeSize] = box.maxi.z;
+
+            if (children[i] & 0x1)
+            { dst.Child[i] = children[i]; }
+            else
+            {
+                dst.Child[i] = uint32_t(sources.size()) << 1;
+                sources.push_back(children[i]);
+                depths .push_back(depths[head] + 1);
+            }
+        }
+        for(uint32_t i=count; i<kWideNodeSize; ++i)
+        { dst.Child[i] = kInvalid; }
+        dst.Mask = (1u << count) - 1;
+
+        // 1段下りるごとにスタックは最大7つ増えるので, 深すぎる木は2分木のまま辿る.
+        if (depths[head] * (kWideNodeSize - 1) >= kWideStackSize)
+        {
+            WideNodes.clear();
+            WideNodes.shrink_to_fit();
+            return;
+        }
+
+        WideNodes.push_back(dst);
+    }
+}
+
+//-----------------------------------------------------------------------------
+//      データを破棄します.
+//-----------------------------------------------------------------------------
+void LBVH::Destruct()
+{
+    ChildBoxNodes.clear();
+    ChildBoxNodes.shrink_to_fit();
+
+    WideNodes.clear();
+    WideNodes.shrink_to_fit();
+
+    Bounds.Clear();
+    ClipBounds.Clear();
+
+    PositionCount = 0;
+    Positions = nullptr;
+
+    NormalCount = 0;
+    Normals = nullptr;
+
+    IndexCount = 0;
+    Indices = nullptr;
+}
+
+//-----------------------------------------------------------------------------
+//      レイの範囲をシーン全体のボックスで切り詰めます.
+//      シーンに当たらない場合は false を返し, ノードは一切読みません.
+//      巡回関数はこの関数を通したレイを前提とします.
+//-----------------------------------------------------------------------------
+bool LBVH::ClipRay(Ray& ray, HitRecord& record) const
+{
+    // [tnear, tfar] とシーンの区間が重ならなければ交差しない.
+    auto start = ray.tmin;
+    if (!ClipBounds.Clip(ray.pos, ray.inv_dir, start, record.dist))
+    { return false; }
+
+    // シーンに入る手前と, tfar が無限大でもシーンを抜けた先のボックスは判定しない.
+    ray.tmin = start;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+//      巡回を終えたノードから親を辿り, 次に巡回するノードを求めます.
+//-----------------------------------------------------------------------------
+uint32_t LBVH::NextSibling(uint32_t idx) const
+{
+    // 子は右から先に辿るので, 右の子から上がってきた時だけ左の子が未処理.
+    while(idx != Root)
+    {
+        const auto  parent = ChildBoxNodes[idx].Parent;
+        const auto& node   = ChildBoxNodes[parent];
+
+        if (node.R == (idx << 1) && !(node.L & 0x1))
+        { return node.L >> 1; }
+
+        idx = parent;
+    }
+
+    return kInvalid;
+}
+
+//-----------------------------------------------------------------------------
+//      巡回を終えたノードから親を辿り, 次に巡回するノードを求めます.
+//      子のボックスを持つノード用で, レイが当たらない左の子は飛ばします.
+//-----------------------------------------------------------------------------
+uint32_t LBVH::NextSibling(uint32_t idx, const Ray& ray, float dist) const
+{
+    // 子は右から先に辿るので, 右の子から上がってきた時だけ左の子が未処理.
+    while(idx != Root)
+    {
+        const auto  parent = ChildBoxNodes[idx].Parent;
+        const auto& node   = ChildBoxNodes[parent];
+
+        if (node.R == (idx << 1) && !(node.L & 0x1))
+        {
+            if (node.GetBox(0).Intersect(ray.pos, ray.inv_dir, ray.tmin, dist))
+            { return node.L >> 1; }
+        }
+
+        idx = parent;
+    }
+
+    return kInvalid;
+}
+
+//-----------------------------------------------------------------------------
+//      レイの集合でノードを巡回し交差判定を取ります.
+//      各ノードでレイ集合全体を左右の子のボックスでふるいにかけ, 残ったレイ番号を子ごとに詰めて渡します.
+//-----------------------------------------------------------------------------
+void LBVH::TraverseStream(const Ray* rays, HitRecord* records, size_t count, bool hitAny) const
+{
+    struct Entry
+    {
+        uint32_t    Node;   //!< ノード番号.
+        uint32_t    Begin;  //!< 親ノードで残ったレイ番号リストの開始位置.
+        uint32_t    Count;  //!< レイ数.
+    };
+
+    // レイ番号リストはスタックと同じ順に積む.
+    // 左の子のリストの直後に右の子のリストを置き, 右を先に取り出すので,
+    // 取り出したエントリのリストが常に使用中の末尾になり, その後ろに書き出せばよい.
+    thread_local std::vector<uint32_t>  ids;
+    thread_local std::vector<Entry>     visit_stack;
+
+    if (ids.size() < count * 3 + kPacketSize * 2)
+    { ids.resize(count * 3 + kPacketSize * 2); }
+
+    for(size_t i=0; i<count; ++i)
+    { ids[i] = uint32_t(i); }
+
+    visit_stack.clear();
+    visit_stack.push_back({ Root, 0, uint32_t(count) });
+
+    // スタックが空になるまで処理.
+    while(!visit_stack.empty())
+    {
+        const auto entry = visit_stack.back();
+        visit_stack.pop_back(); // pop.
+
+        // 左右の子のリストはそれぞれ最大でレイ数分. 端数のレーンも書き込むので, その分を空けて並べる.
+        const auto begin = entry.Begin + entry.Count;
+        const auto size  = entry.Count + kPacketSize;
+        if (ids.size() < begin + size * 2)
+        { ids.resize((begin + size * 2) * 2); }
+
+        const auto& node  = ChildBoxNodes[entry.Node];
+        const auto  src   = ids.data() + entry.Begin;
+        const auto  listL = ids.data() + begin;
+        const auto  listR = listL + size;
+
+        // 端数は最後のレイで埋めておく.
+        for(auto i=entry.Count; i<entry.Count + kPacketSize; ++i)
+        { src[i] = src[entry.Count - 1]; }
+
+        // 子のボックスごとに, 当たるレイだけを詰めて書き出す.
+        uint32_t aliveL = 0;
+        uint32_t aliveR = 0;
+        for(uint32_t i=0; i<entry.Count; i+=kPacketSize)
+        {
+            const auto valid = (entry.Count - i < kPacketSize) ? (1 << (entry.Count - i)) - 1 : 0xf;
+            const auto bits  = IntersectChildren4(node, rays, records, src + i);
+            const auto bitsL = bits & valid;
+            const auto bitsR = (bits >> 4) & valid;
+
+            for(uint32_t j=0; j<kPacketSize; ++j)
+            {
+                listL[aliveL] = src[i + j];
+                listR[aliveR] = src[i + j];
+                aliveL += (bitsL >> j) & 0x1;
+                aliveR += (bitsR >> j) & 0x1;
+            }
+        }
+
+        const auto test_leaf = [&](uint32_t face_id, const uint32_t* list, uint32_t alive)
+        {
+            for(uint32_t i=0; i<alive; ++i)
+            {
+                const auto id = list[i];
+                IsHit(rays[id], records[id], face_id);
+            }
+        };
+
+        // 葉の子はその場で三角形と判定する.
+        if (node.L & 0x1)
+        {
+            test_leaf(node.L >> 1, listL, aliveL);
+            aliveL = 0;
+        }
+
+        if (node.R & 0x1)
+        {
+            test_leaf(node.R >> 1, listR, aliveR);
+            aliveR = 0;
+        }
+
+        // 交差が確定したレイは以降のノードに渡さない.
+        if (hitAny)
+        {
+            const auto compact = [&](uint32_t* list, uint32_t& alive)
+            {
+                uint32_t rest = 0;
+                for(uint32_t i=0; i<alive; ++i)
+                {
+                    const auto id = list[i];
+                    list[rest] = id;
+                    rest += records[id].hit ? 0 : 1;
+                }
+                alive = rest;
+            };
+            compact(listL, aliveL);
+            compact(listR, aliveR);
+        }
+
+        // 右の子のリストを左の子のリストの直後に詰める.
+        if (aliveR > 0)
+        { memmove(listL + aliveL, listR, sizeof(uint32_t) * aliveR); }
+
+        // TraverseIterative() と同じく右を先に処理する.
+        if (aliveL > 0)
+        { visit_stack.push_back({ node.L >> 1, begin, aliveL }); } // push.
+
+        if (aliveR > 0)
+        { visit_stack.push_back({ node.R >> 1, begin + aliveL, aliveR }); } // push.
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+//      ノードを巡回し交差判定を取ります.
+//-----------------------------------------------------------------------------
+void LBVH::TraverseIterative(const Ray& ray, HitRecord& record, bool hitAny) const
+{
+    if (Stackless)
+    { Kernel->TraverseStackless(*this, ray, record, hitAny); }
+    else
+    { Kernel->TraverseIterative(*this, ray, record, hitAny); }
+}
+
+//-----------------------------------------------------------------------------
+//      パケット単位でノードを巡回し交差判定を取ります.
+//-----------------------------------------------------------------------------
+void LBVH::TraversePacket(const RayPacket& packet, HitRecord* records, bool hitAny) const
+{ Kernel->TraversePacket(*this, packet, records, hitAny); }
+
+//-----------------------------------------------------------------------------
+//      複数のレイを交互に進めながらノードを巡回し交差判定を取ります.
+//-----------------------------------------------------------------------------
+void LBVH::TraverseInterleaved(const Ray* rays, HitRecord* records, size_t count, bool hitAny) const
+{ Kernel->TraverseInterleaved(*this, rays, records, count, hitAny); }
+
+//-----------------------------------------------------------------------------
+//      多分木のノードを巡回し交差判定を取ります(多分木がある場合だけ呼べます).
+//-----------------------------------------------------------------------------
+void LBVH::TraverseWide(const Ray& ray, HitRecord& record, bool hitAny) const
+{ Kernel->TraverseWide(*this, ray, record, hitAny); }
+
+//-----------------------------------------------------------------------------
+//      パケット単位で多分木のノードを巡回し交差判定を取ります(多分木がある場合だけ呼べます).
+//-----------------------------------------------------------------------------
+void LBVH::TraversePacketWide(const RayPacket& packet, HitRecord* records, bool hitAny) const
+{ Kernel->TraversePacketWide(*this, packet, records, hitAny); }
+
+} // namespace s3d
+
+
+//-----------------------------------------------------------------------------
+// SSE2 Kernel.
+//-----------------------------------------------------------------------------
+#define SALSA_KERNEL_NAMESPACE  sse2
+#define SALSA_KERNEL_NAME       "SSE2"
+#define SALSA_KERNEL_SSE41      (0)
+#include "s3d_bvh_kernel.inl"
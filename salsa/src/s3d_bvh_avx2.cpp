@@ -0,0 +1,32 @@
+﻿//-----------------------------------------------------------------------------
+// File : s3d_bvh_avx2.cpp
+// Desc : Bounding Volume Hierarchy Traversal Kernels (AVX2).
+// Copyright(c) Project Asura. All right reserved.
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+#include <s3d_bvh.h>
+#include <immintrin.h>
+
+
+//-----------------------------------------------------------------------------
+// Macros.
+//-----------------------------------------------------------------------------
+#define SALSA_KERNEL_NAMESPACE  avx2
+#define SALSA_KERNEL_NAME       "AVX2"
+#define SALSA_KERNEL_SSE41      (1)
+#define SALSA_KERNEL_AVX2       (1)
+
+
+#if !defined(_MSC_VER)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+#include "s3d_bvh_kernel.inl"
+
+#if !defined(_MSC_VER)
+#pragma GCC pop_options
+#endif
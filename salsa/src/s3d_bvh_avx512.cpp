@@ -0,0 +1,33 @@
+﻿//-----------------------------------------------------------------------------
+// File : s3d_bvh_avx512.cpp
+// Desc : Bounding Volume Hierarchy Traversal Kernels (AVX-512).
+// Copyright(c) Project Asura. All right reserved.
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+#include <s3d_bvh.h>
+#include <immintrin.h>
+
+
+//-----------------------------------------------------------------------------
+// Macros.
+//-----------------------------------------------------------------------------
+#define SALSA_KERNEL_NAMESPACE  avx512
+#define SALSA_KERNEL_NAME       "AVX-512"
+#define SALSA_KERNEL_SSE41      (1)
+#define SALSA_KERNEL_AVX2       (1)
+#define SALSA_KERNEL_AVX512     (1)
+
+
+#if !defined(_MSC_VER)
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512cd,avx512bw,avx512dq,avx512vl")
+#endif
+
+#include "s3d_bvh_kernel.inl"
+
+#if !defined(_MSC_VER)
+#pragma GCC pop_options
+#endif
@@ -0,0 +1,1138 @@
+﻿//-----------------------------------------------------------------------------
+// File : s3d_bvh_kernel.inl
+// Desc : Bounding Volume Hierarchy Traversal Kernels.
+// Copyright(c) Project Asura. All right reserved.
+//-----------------------------------------------------------------------------
+
+// 命令セットごとに別の翻訳単位から取り込まれる.
+// 取り込む前に以下のマクロを定義すること.
+//   SALSA_KERNEL_NAMESPACE ... カーネルを配置する名前空間.
+//   SALSA_KERNEL_NAME      ... 統計出力に表示するカーネル名.
+//   SALSA_KERNEL_SSE41     ... SSE4.1 の命令を使う場合は 1.
+//   SALSA_KERNEL_AVX2      ... AVX2 の8レーンでパケットを処理する場合は 1.
+//   SALSA_KERNEL_AVX512    ... AVX-512 の16レーンのパケットと多分木巡回を使う場合は 1.
+//
+// 取り込む翻訳単位では, この .inl だけを #pragma GCC push_options / target("...") / pop_options で囲む.
+// 共有ヘッダのインライン関数は既定の命令セットでコンパイルし, カーネルの関数だけに命令セットを許可するためで,
+// ファイル全体に -m や /arch を付けると, ヘッダの関数の拡張命令版の実体がリンク時に他の翻訳単位の呼び出しにも使われてしまう.
+// MSVC は /arch の指定なしで全ての組み込み関数を使えるので, 既定の設定のままコンパイルする.
+#ifndef SALSA_KERNEL_NAMESPACE
+#error "SALSA_KERNEL_NAMESPACE is not defined."
+#endif
+
+#ifndef SALSA_KERNEL_SSE41
+#define SALSA_KERNEL_SSE41  (0)
+#endif
+
+#ifndef SALSA_KERNEL_AVX2
+#define SALSA_KERNEL_AVX2   (0)
+#endif
+
+#ifndef SALSA_KERNEL_AVX512
+#define SALSA_KERNEL_AVX512 (0)
+#endif
+
+
+namespace s3d {
+namespace SALSA_KERNEL_NAMESPACE {
+
+namespace {
+
+// マスクが立っているレーンだけ値を差し替える.
+__forceinline __m128 Select(__m128 mask, __m128 a, __m128 b)
+{
+#if SALSA_KERNEL_SSE41
+    return _mm_blendv_ps(b, a, mask);
+#else
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+#endif
+}
+
+// 左右の子のボックスを1回のSSE演算でまとめて判定する. 戻り値は左が0x1, 右が0x2.
+__forceinline int IntersectChildren
+(
+    const s3d::ChildBoxNode&    node,
+    const __m128*               pos,
+    const __m128*               inv_dir,
+    float                       start,
+    float                       dist
+)
+{
+    // (左min, 右min, 左max, 右max) の順に並んでいる.
+    const auto tx = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.BoxX), pos[0]), inv_dir[0]);
+    const auto ty = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.BoxY), pos[1]), inv_dir[1]);
+    const auto tz = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.BoxZ), pos[2]), inv_dir[2]);
+
+    // minとmaxを入れ替えたもの.
+    const auto sx = _mm_shuffle_ps(tx, tx, _MM_SHUFFLE(1, 0, 3, 2));
+    const auto sy = _mm_shuffle_ps(ty, ty, _MM_SHUFFLE(1, 0, 3, 2));
+    const auto sz = _mm_shuffle_ps(tz, tz, _MM_SHUFFLE(1, 0, 3, 2));
+
+    // 近い面と遠い面は値の大小ではなく方向の符号で選ぶ.
+    // 原点が面上にあり方向が0の軸は NaN になるが, min/max で他の面の値に化けない.
+    const auto zero = _mm_setzero_ps();
+    const auto nx = _mm_cmplt_ps(inv_dir[0], zero);
+    const auto ny = _mm_cmplt_ps(inv_dir[1], zero);
+    const auto nz = _mm_cmplt_ps(inv_dir[2], zero);
+
+    // minps/maxps は NaN なら第2引数を返すので, 各軸の値を第1引数にして NaN の軸を無視する.
+    auto tmin = _mm_set1_ps(start);
+    auto tmax = _mm_set1_ps(dist);
+    tmin = _mm_max_ps(Select(nx, sx, tx), tmin);
+    tmin = _mm_max_ps(Select(ny, sy, ty), tmin);
+    tmin = _mm_max_ps(Select(nz, sz, tz), tmin);
+    tmax = _mm_min_ps(Select(nx, tx, sx), tmax);
+    tmax = _mm_min_ps(Select(ny, ty, sy), tmax);
+    tmax = _mm_min_ps(Select(nz, tz, sz), tmax);
+
+    // 丸め誤差で境界をすり抜けないように遠い側を広げる(Ize 2013).
+    tmax = _mm_mul_ps(tmax, _mm_set1_ps(s3d::kSlabScale));
+
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) & 0x3;
+}
+
+//-----------------------------------------------------------------------------
+// パケットのレーン.
+// SSE2/SSE4.2 は __m128 の4レーン, AVX2 は __m256 の8レーン, AVX-512 は __m512 の16レーンで処理する.
+// 比較結果のマスクは AVX-512 だけマスクレジスタ, それ以外はベクトルで持つ.
+//-----------------------------------------------------------------------------
+#if SALSA_KERNEL_AVX512
+using PacketF = __m512;
+using PacketM = __mmask16;
+constexpr uint32_t kLaneCount = 16;
+
+__forceinline PacketF PLoad (const float* p)          { return _mm512_load_ps(p); }
+__forceinline void    PStore(float* p, PacketF a)     { _mm512_store_ps(p, a); }
+__forceinline PacketF PSet1 (float a)                 { return _mm512_set1_ps(a); }
+__forceinline PacketF PSet1i(int32_t a)               { return _mm512_castsi512_ps(_mm512_set1_epi32(a)); }
+__forceinline PacketF PZero ()                        { return _mm512_setzero_ps(); }
+__forceinline PacketF PAdd  (PacketF a, PacketF b)    { return _mm512_add_ps(a, b); }
+__forceinline PacketF PSub  (PacketF a, PacketF b)    { return _mm512_sub_ps(a, b); }
+__forceinline PacketF PMul  (PacketF a, PacketF b)    { return _mm512_mul_ps(a, b); }
+__forceinline PacketF PDiv  (PacketF a, PacketF b)    { return _mm512_div_ps(a, b); }
+// GCC 12 以前は _mm512_min_ps などが内部で使う _mm512_undefined_ps() に -Wmaybe-uninitialized を出す(GCC bug 105593).
+// 全レーンを有効にしたマスク付きの命令は同じ命令になるので, 未定義値を使わない方で書く.
+__forceinline PacketF PMin  (PacketF a, PacketF b)    { return _mm512_mask_min_ps(a, 0xFFFF, a, b); }
+__forceinline PacketF PMax  (PacketF a, PacketF b)    { return _mm512_mask_max_ps(a, 0xFFFF, a, b); }
+__forceinline PacketM PCmpLE (PacketF a, PacketF b)   { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+__forceinline PacketM PCmpLT (PacketF a, PacketF b)   { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+__forceinline PacketM PCmpGE (PacketF a, PacketF b)   { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+__forceinline PacketM PCmpNEQ(PacketF a, PacketF b)   { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); }
+__forceinline PacketM PAnd  (PacketM a, PacketM b)    { return PacketM(a & b); }
+__forceinline PacketM PMask (int bits)                { return PacketM(bits); }
+__forceinline int     PBits (PacketM a)               { return int(a); }
+__forceinline PacketF PSelect(PacketM m, PacketF a, PacketF b) { return _mm512_mask_blend_ps(m, b, a); }
+#elif SALSA_KERNEL_AVX2
+using PacketF = __m256;
+using PacketM = __m256;
+constexpr uint32_t kLaneCount = 8;
+
+__forceinline PacketF PLoad (const float* p)          { return _mm256_load_ps(p); }
+__forceinline void    PStore(float* p, PacketF a)     { _mm256_store_ps(p, a); }
+__forceinline PacketF PSet1 (float a)                 { return _mm256_set1_ps(a); }
+__forceinline PacketF PSet1i(int32_t a)               { return _mm256_castsi256_ps(_mm256_set1_epi32(a)); }
+__forceinline PacketF PZero ()                        { return _mm256_setzero_ps(); }
+__forceinline PacketF PAdd  (PacketF a, PacketF b)    { return _mm256_add_ps(a, b); }
+__forceinline PacketF PSub  (PacketF a, PacketF b)    { return _mm256_sub_ps(a, b); }
+__forceinline PacketF PMul  (PacketF a, PacketF b)    { return _mm256_mul_ps(a, b); }
+__forceinline PacketF PDiv  (PacketF a, PacketF b)    { return _mm256_div_ps(a, b); }
+__forceinline PacketF PMin  (PacketF a, PacketF b)    { return _mm256_min_ps(a, b); }
+__forceinline PacketF PMax  (PacketF a, PacketF b)    { return _mm256_max_ps(a, b); }
+__forceinline PacketM PCmpLE (PacketF a, PacketF b)   { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+__forceinline PacketM PCmpLT (PacketF a, PacketF b)   { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+__forceinline PacketM PCmpGE (PacketF a, PacketF b)   { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+__forceinline PacketM PCmpNEQ(PacketF a, PacketF b)   { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+__forceinline PacketM PAnd  (PacketM a, PacketM b)    { return _mm256_and_ps(a, b); }
+__forceinline int     PBits (PacketM a)               { return _mm256_movemask_ps(a); }
+__forceinline PacketF PSelect(PacketM m, PacketF a, PacketF b) { return _mm256_blendv_ps(b, a, m); }
+
+__forceinline PacketM PMask(int bits)
+{
+    const auto lane = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), lane), lane));
+}
+#else
+using PacketF = __m128;
+using PacketM = __m128;
+constexpr uint32_t kLaneCount = 4;
+
+__forceinline PacketF PLoad (const float* p)          { return _mm_load_ps(p); }
+__forceinline void    PStore(float* p, PacketF a)     { _mm_store_ps(p, a); }
+__forceinline PacketF PSet1 (float a)                 { return _mm_set1_ps(a); }
+__forceinline PacketF PSet1i(int32_t a)               { return _mm_castsi128_ps(_mm_set1_epi32(a)); }
+__forceinline PacketF PZero ()                        { return _mm_setzero_ps(); }
+__forceinline PacketF PAdd  (PacketF a, PacketF b)    { return _mm_add_ps(a, b); }
+__forceinline PacketF PSub  (PacketF a, PacketF b)    { return _mm_sub_ps(a, b); }
+__forceinline PacketF PMul  (PacketF a, PacketF b)    { return _mm_mul_ps(a, b); }
+__forceinline PacketF PDiv  (PacketF a, PacketF b)    { return _mm_div_ps(a, b); }
+__forceinline PacketF PMin  (PacketF a, PacketF b)    { return _mm_min_ps(a, b); }
+__forceinline PacketF PMax  (PacketF a, PacketF b)    { return _mm_max_ps(a, b); }
+__forceinline PacketM PCmpLE (PacketF a, PacketF b)   { return _mm_cmple_ps(a, b); }
+__forceinline PacketM PCmpLT (PacketF a, PacketF b)   { return _mm_cmplt_ps(a, b); }
+__forceinline PacketM PCmpGE (PacketF a, PacketF b)   { return _mm_cmpge_ps(a, b); }
+__forceinline PacketM PCmpNEQ(PacketF a, PacketF b)   { return _mm_cmpneq_ps(a, b); }
+__forceinline PacketM PAnd  (PacketM a, PacketM b)    { return _mm_and_ps(a, b); }
+__forceinline int     PBits (PacketM a)               { return _mm_movemask_ps(a); }
+__forceinline PacketF PSelect(PacketM m, PacketF a, PacketF b) { return Select(m, a, b); }
+
+__forceinline PacketM PMask(int bits)
+{
+    const auto lane = _mm_setr_epi32(1, 2, 4, 8);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(bits), lane), lane));
+}
+#endif
+
+static_assert(kLaneCount <= s3d::kMaxPacketSize, "Packet lanes exceed RayPacket.");
+
+// パケットのレイをレーンに読み込んだもの.
+struct PacketRays
+{
+    PacketF     dir[3];     //!< レイ方向.
+    PacketF     inv_dir[3]; //!< レイ方向の逆数.
+    PacketF     tmin;       //!< 交差判定を開始する距離.
+    PacketF     tmax;       //!< 交差判定を終了する距離.
+
+    __forceinline explicit PacketRays(const s3d::RayPacket& packet) noexcept
+    {
+        for(auto i=0; i<3; ++i)
+        {
+            dir    [i] = PLoad(packet.dir    [i]);
+            inv_dir[i] = PLoad(packet.inv_dir[i]);
+        }
+        tmin = PLoad(packet.tmin);
+        tmax = PLoad(packet.tmax);
+    }
+};
+
+// 原点を共有するレイのパケットとボックスの交差判定. 当たるレーンのビットマスクを返す.
+// lanes は判定するレーン(親のボックスに当たったレーン), far_sq は全レーンで最も遠い交差距離の2乗.
+__forceinline int IntersectBoxPacket
+(
+    const s3d::RayPacket&   packet,
+    const PacketRays&       rays,
+    const s3d::AABB&        box,
+    PacketF                 dist,
+    float                   far_sq,
+    int                     lanes
+)
+{
+    // 原点からの相対位置はパケットで共通なので1回だけ求める.
+    const auto lo = box.mini - packet.pos;
+    const auto hi = box.maxi - packet.pos;
+
+    // 原点を含むボックスは全レーンが通過するのでスラブ判定を省略.
+    if (lo.x < 0.0f && lo.y < 0.0f && lo.z < 0.0f
+     && hi.x > 0.0f && hi.y > 0.0f && hi.z > 0.0f)
+    { return lanes; }
+
+    // ボックスまでの最短距離が全レーンの交差距離より遠ければスキップ.
+    const auto gap = s3d::Vector3f::Max(s3d::Vector3f::Max(lo, -hi), s3d::Vector3f(0.0f, 0.0f, 0.0f));
+    if (gap.LengthSq() > far_sq)
+    { return 0; }
+
+    // パケット内でレイの向きが揃っているので, 近い面と遠い面はパケットで共通.
+    const auto nx = packet.sign[0];
+    const auto ny = packet.sign[1];
+    const auto nz = packet.sign[2];
+
+    const auto tx0 = PMul(PSet1(nx ? hi.x : lo.x), rays.inv_dir[0]);
+    const auto tx1 = PMul(PSet1(nx ? lo.x : hi.x), rays.inv_dir[0]);
+    const auto ty0 = PMul(PSet1(ny ? hi.y : lo.y), rays.inv_dir[1]);
+    const auto ty1 = PMul(PSet1(ny ? lo.y : hi.y), rays.inv_dir[1]);
+    const auto tz0 = PMul(PSet1(nz ? hi.z : lo.z), rays.inv_dir[2]);
+    const auto tz1 = PMul(PSet1(nz ? lo.z : hi.z), rays.inv_dir[2]);
+
+    // NaN の軸を無視するように, 各軸の値を第1引数にする.
+    auto tmin = PMax(tz0, PMax(ty0, PMax(tx0, rays.tmin)));
+    auto tmax = PMin(tz1, PMin(ty1, PMin(tx1, dist)));
+    tmax = PMul(tmax, PSet1(s3d::kSlabScale));
+
+    return PBits(PCmpLE(tmin, tmax)) & lanes;
+}
+
+// マスクが立っているレーンの最大値を求める.
+__forceinline float MaxLane(PacketF value, int bits)
+{
+    alignas(64) float lane[kLaneCount];
+    PStore(lane, value);
+
+    auto result = 0.0f;
+    for(uint32_t i=0; i<kLaneCount; ++i)
+    {
+        if (bits & (1 << i))
+        { result = s3d::Max(result, lane[i]); }
+    }
+    return result;
+}
+
+// 原点を共有するレイのパケットと1つの三角形の交差判定(Moller-Trumbore).
+// 原点に依存する T, Q, dot(e2, Q) はスカラーで1回だけ計算する.
+__forceinline PacketM IntersectTrianglePacket
+(
+    const s3d::RayPacket&   packet,
+    const PacketRays&       rays,
+    const s3d::Vector3f&    v0,
+    const s3d::Vector3f&    v1,
+    const s3d::Vector3f&    v2,
+    PacketF                 dist,
+    PacketF&                t,
+    PacketF&                u,
+    PacketF&                v
+)
+{
+    const auto e1 = v1 - v0;
+    const auto e2 = v2 - v0;
+    const auto T  = packet.pos - v0;
+    const auto Q  = s3d::Vector3f::Cross(T, e1);
+    const auto tq = s3d::Vector3f::Dot(e2, Q);
+
+    const auto e1x = PSet1(e1.x);
+    const auto e1y = PSet1(e1.y);
+    const auto e1z = PSet1(e1.z);
+    const auto e2x = PSet1(e2.x);
+    const auto e2y = PSet1(e2.y);
+    const auto e2z = PSet1(e2.z);
+
+    const auto& dx = rays.dir[0];
+    const auto& dy = rays.dir[1];
+    const auto& dz = rays.dir[2];
+
+    // P = cross(dir, e2).
+    const auto px = PSub(PMul(dy, e2z), PMul(dz, e2y));
+    const auto py = PSub(PMul(dz, e2x), PMul(dx, e2z));
+    const auto pz = PSub(PMul(dx, e2y), PMul(dy, e2x));
+
+    const auto det = PAdd(PAdd(PMul(e1x, px), PMul(e1y, py)), PMul(e1z, pz));
+    const auto inv_det = PDiv(PSet1(1.0f), det);
+
+    const auto tx = PSet1(T.x);
+    const auto ty = PSet1(T.y);
+    const auto tz = PSet1(T.z);
+    const auto qx = PSet1(Q.x);
+    const auto qy = PSet1(Q.y);
+    const auto qz = PSet1(Q.z);
+
+    u = PMul(PAdd(PAdd(PMul(tx, px), PMul(ty, py)), PMul(tz, pz)), inv_det);
+    v = PMul(PAdd(PAdd(PMul(dx, qx), PMul(dy, qy)), PMul(dz, qz)), inv_det);
+    t = PMul(PSet1(tq), inv_det);
+
+    const auto zero = PZero();
+    const auto one  = PSet1(1.0f);
+
+    // スカラー版の IntersectTriangle() と同じ条件で判定.
+    auto mask = PCmpNEQ(det, zero);
+    mask = PAnd(mask, PCmpGE(u, zero));
+    mask = PAnd(mask, PCmpLE(u, one));
+    mask = PAnd(mask, PCmpGE(v, zero));
+    mask = PAnd(mask, PCmpLE(PAdd(u, v), one));
+    mask = PAnd(mask, PCmpGE(t, rays.tmin));
+    mask = PAnd(mask, PCmpLT(t, rays.tmax));
+    mask = PAnd(mask, PCmpLE(t, dist));
+    return mask;
+}
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+//      ノードを巡回し交差判定を取ります.
+//      子のボックスは親ノードに入っているので, 当たると分かった子だけを読み込みます.
+//      ショートスタックが溢れた場合は親リンクを辿って残りのノードに復帰します.
+//      Stackless が true の場合はスタックを使わず, 部分木が終わるたびに親リンクを辿って
+//      未処理の左の子を探します(ボックスは辿る時に判定し直す).
+//-----------------------------------------------------------------------------
+template<bool Stackless>
+void TraverseBinary(const LBVH& bvh, const Ray& ray, HitRecord& record, bool hitAny)
+{
+    const __m128 pos[3] = {
+        _mm_set1_ps(ray.pos.x),
+        _mm_set1_ps(ray.pos.y),
+        _mm_set1_ps(ray.pos.z)
+    };
+    const __m128 inv_dir[3] = {
+        _mm_set1_ps(ray.inv_dir.x),
+        _mm_set1_ps(ray.inv_dir.y),
+        _mm_set1_ps(ray.inv_dir.z)
+    };
+
+    ShortStack visit_stack;
+
+    // ルートノードから開始.
+    auto idx = bvh.Root;
+
+    // 巡回するノードがなくなるまで処理.
+    while(idx != kInvalid)
+    {
+        const auto& node = bvh.ChildBoxNodes[idx];
+        const auto  mask = IntersectChildren(node, pos, inv_dir, ray.tmin, record.dist);
+        auto next = kInvalid;
+
+        const auto hitL   = (mask & 0x1) && (node.L & 0x1);
+        const auto hitR   = (mask & 0x2) && (node.R & 0x1);
+        const auto visitL = (mask & 0x1) && !(node.L & 0x1);
+        const auto visitR = (mask & 0x2) && !(node.R & 0x1);
+
+        // 右の子を先に辿り, 左の子は後回し.
+        if (visitR)
+        {
+            next = node.R >> 1;
+            if (visitL && !Stackless)
+            { visit_stack.Push(node.L >> 1); } // push.
+        }
+        else if (visitL)
+        { next = node.L >> 1; }
+        else if (visit_stack.Count > 0)
+        { next = visit_stack.Pop(); } // pop.
+
+        // 三角形の判定中に次のノードが届くように先に読んでおく.
+        bvh.PrefetchNodes(next, visit_stack);
+
+        if (hitL)
+        {
+            if (hitR)
+            { bvh.PrefetchTriangle(node.R >> 1); }
+            bvh.IsHit(ray, record, node.L >> 1);
+        }
+
+        if (hitR)
+        { bvh.IsHit(ray, record, node.R >> 1); }
+
+        // 交差が確定したら終了.
+        if (hitAny && record.hit)
+        { return; }
+
+        // 溢れて捨てたノードへは親を辿って戻る. スタックレスでは常に親を辿る.
+        if (next == kInvalid && (Stackless || visit_stack.Overflow))
+        { next = bvh.NextSibling(idx, ray, record.dist); }
+
+        idx = next;
+    }
+}
+
+//-----------------------------------------------------------------------------
+//      ショートスタックを使ってノードを巡回し交差判定を取ります.
+//-----------------------------------------------------------------------------
+void TraverseIterative(const LBVH& bvh, const Ray& ray, HitRecord& record, bool hitAny)
+{ TraverseBinary<false>(bvh, ray, record, hitAny); }
+
+//-----------------------------------------------------------------------------
+//      スタックを使わずに親リンクだけでノードを巡回し交差判定を取ります.
+//-----------------------------------------------------------------------------
+void TraverseStackless(const LBVH& bvh, const Ray& ray, HitRecord& record, bool hitAny)
+{ TraverseBinary<true>(bvh, ray, record, hitAny); }
+
+//-----------------------------------------------------------------------------
+//      パケット単位でノードを巡回し交差判定を取ります.
+//-----------------------------------------------------------------------------
+void TraversePacket(const LBVH& bvh, const RayPacket& packet, HitRecord* records, bool hitAny)
+{
+    const PacketRays rays(packet);
+
+    // 面番号はビット列のままレーンに入れておく.
+    auto dist = rays.tmax;
+    auto u    = PZero();
+    auto v    = PZero();
+    auto face = PSet1i(-1);
+
+    auto active   = packet.mask;
+    auto hit_mask = 0;
+
+    // 有効なレーンの中で最も遠い交差距離をワールド空間の長さにした2乗. これより遠いボックスは全レーンで不要.
+    // dist はレイのパラメータなので, 正規化されていない方向ではレーンで最長の方向の長さを掛ける.
+    const auto len_sq = packet.dir_len * packet.dir_len;
+    auto far_dist = MaxLane(dist, active);
+    auto far_sq   = far_dist * far_dist * len_sq;
+
+    // 今のノードのボックスに当たったレーン.
+    auto lanes = active;
+
+    // 積んだノードには, そのボックスに当たったレーンを一緒に覚えておく.
+    // 取り出すまでに全て終了したレーンのノードは読まずに飛ばす.
+    ShortStack visit_stack;
+    int        lane_stack[kShortStackSize];
+
+    // ルートノードから開始.
+    auto idx = bvh.Root;
+
+    // 巡回するノードがなくなるまで処理.
+    while(idx != kInvalid)
+    {
+        const auto& node = bvh.ChildBoxNodes[idx];
+        auto next = kInvalid;
+
+        // 内部ノードの子はボックスに当たるレーンを求める.
+        // 葉の子は三角形1つなので, ボックスを判定せずにこのノードに当たったレーンで三角形と判定する.
+        const auto lanesL = (node.L & 0x1) ? lanes : IntersectBoxPacket(packet, rays, node.GetBox(0), dist, far_sq, lanes);
+        const auto lanesR = (node.R & 0x1) ? lanes : IntersectBoxPacket(packet, rays, node.GetBox(1), dist, far_sq, lanes);
+
+        const auto is_hit = [&](uint32_t face_id, int face_lanes)
+        {
+            const auto id = face_id * 3;
+
+            PacketF t, fu, fv;
+            auto mask = IntersectTrianglePacket(
+                packet,
+                rays,
+                bvh.Positions[bvh.Indices[id + 0].P],
+                bvh.Positions[bvh.Indices[id + 1].P],
+                bvh.Positions[bvh.Indices[id + 2].P],
+                dist, t, fu, fv);
+            mask = PAnd(mask, PMask(face_lanes));
+
+            const auto bits = PBits(mask);
+            if (bits == 0)
+            { return; }
+
+            dist = PSelect(mask, t,  dist);
+            u    = PSelect(mask, fu, u);
+            v    = PSelect(mask, fv, v);
+            face = PSelect(mask, PSet1i(int32_t(face_id)), face);
+            hit_mask |= bits;
+
+            far_dist = MaxLane(dist, active);
+            far_sq   = far_dist * far_dist * len_sq;
+        };
+
+        if (lanesL != 0 && (node.L & 0x1))
+        { is_hit(node.L >> 1, lanesL); }
+
+        if (lanesR != 0 && (node.R & 0x1))
+        { is_hit(node.R >> 1, lanesR); }
+
+        const auto visitL = (lanesL != 0) && !(node.L & 0x1);
+        const auto visitR = (lanesR != 0) && !(node.R & 0x1);
+
+        // 右の子を先に辿り, 左の子は後回し.
+        auto next_lanes = 0;
+        if (visitR)
+        {
+            next       = node.R >> 1;
+            next_lanes = lanesR;
+            if (visitL)
+            {
+                lane_stack[visit_stack.Top] = lanesL;
+                visit_stack.Push(node.L >> 1); // push.
+            }
+        }
+        else if (visitL)
+        {
+            next       = node.L >> 1;
+            next_lanes = lanesL;
+        }
+
+        // 1つでも交差が見つかったレーンは終了.
+        if (hitAny && (active & hit_mask))
+        {
+            active &= ~hit_mask;
+            if (active == 0)
+            { break; }
+
+            far_dist = MaxLane(dist, active);
+            far_sq   = far_dist * far_dist * len_sq;
+        }
+
+        // 部分木が終わったら後回しにしたノードへ.
+        // 親リンクで復帰したノードは当たったレーンが分からないので, 残っている全レーンで判定する.
+        while(next == kInvalid || (next_lanes & active) == 0)
+        {
+            if (visit_stack.Count > 0)
+            {
+                next       = visit_stack.Pop(); // pop.
+                next_lanes = lane_stack[visit_stack.Top];
+            }
+            else if (visit_stack.Overflow)
+            {
+                next       = bvh.NextSibling(idx);
+                next_lanes = active;
+                break;
+            }
+            else
+            {
+                next = kInvalid;
+                break;
+            }
+        }
+
+        idx   = next;
+        lanes = next_lanes & active;
+    }
+
+    alignas(64) float   dist_lane[kLaneCount];
+    alignas(64) float   u_lane   [kLaneCount];
+    alignas(64) float   v_lane   [kLaneCount];
+    alignas(64) int32_t face_lane[kLaneCount];
+    PStore(dist_lane, dist);
+    PStore(u_lane,    u);
+    PStore(v_lane,    v);
+    PStore(reinterpret_cast<float*>(face_lane), face);
+
+    for(uint32_t i=0; i<kLaneCount; ++i)
+    {
+        if (!(hit_mask & (1 << i)))
+        { continue; }
+
+        records[i].hit     = true;
+        records[i].dist    = dist_lane[i];
+        records[i].u       = u_lane[i];
+        records[i].v       = v_lane[i];
+        records[i].face_id = face_lane[i];
+    }
+}
+
+//-----------------------------------------------------------------------------
+//      複数のレイを1ステップずつ交互に進めながらノードを巡回し交差判定を取ります.
+//      次に読むノードをプリフェッチしてから他のレイに切り替え, メモリ待ちを重ねて隠します.
+//-----------------------------------------------------------------------------
+void TraverseInterleaved(const LBVH& bvh, const Ray* rays, HitRecord* records, size_t count, bool hitAny)
+{
+    struct Slot
+    {
+        uint32_t    RayId;      //!< 担当しているレイ番号.
+        uint32_t    Node;       //!< 次に子を判定するノード(kInvalidなら空き).
+        ShortStack  Stack;      //!< 巡回スタック.
+    };
+
+    Slot    slots[kInterleaveSize];
+    size_t  next_ray = 0;
+    auto    busy     = 0;
+
+    // 次のレイをスロットに割り当てる.
+    const auto assign = [&](Slot& slot)
+    {
+        if (next_ray < count)
+        {
+            slot.RayId = uint32_t(next_ray++);
+            slot.Node  = bvh.Root;
+            slot.Stack = ShortStack();
+            return true;
+        }
+
+        slot.RayId = kInvalid;
+        slot.Node  = kInvalid;
+        return false;
+    };
+
+    for(auto& slot : slots)
+    {
+        if (assign(slot))
+        { busy++; }
+    }
+
+    // 全スロットが空くまで処理.
+    while(busy > 0)
+    {
+        for(auto& slot : slots)
+        {
+            if (slot.Node == kInvalid)
+            { continue; }
+
+            const auto& ray    = rays[slot.RayId];
+            auto&       record = records[slot.RayId];
+
+            const __m128 pos[3] = {
+                _mm_set1_ps(ray.pos.x),
+                _mm_set1_ps(ray.pos.y),
+                _mm_set1_ps(ray.pos.z)
+            };
+            const __m128 inv_dir[3] = {
+                _mm_set1_ps(ray.inv_dir.x),
+                _mm_set1_ps(ray.inv_dir.y),
+                _mm_set1_ps(ray.inv_dir.z)
+            };
+
+            const auto& node = bvh.ChildBoxNodes[slot.Node];
+            const auto  mask = IntersectChildren(node, pos, inv_dir, ray.tmin, record.dist);
+            auto next = kInvalid;
+
+            const auto hitL = (mask & 0x1) && (node.L & 0x1);
+            const auto hitR = (mask & 0x2) && (node.R & 0x1);
+
+            if (hitL)
+            {
+                if (hitR)
+                { bvh.PrefetchTriangle(node.R >> 1); }
+                bvh.IsHit(ray, record, node.L >> 1);
+            }
+
+            if (hitR)
+            { bvh.IsHit(ray, record, node.R >> 1); }
+
+            const auto visitL = (mask & 0x1) && !(node.L & 0x1);
+            const auto visitR = (mask & 0x2) && !(node.R & 0x1);
+
+            // 右の子を先に辿り, 左の子は後回し.
+            if (visitR)
+            {
+                next = node.R >> 1;
+                if (visitL)
+                { slot.Stack.Push(node.L >> 1); } // push.
+            }
+            else if (visitL)
+            { next = node.L >> 1; }
+
+            // 交差が確定したらこのレイは終了.
+            const auto done = hitAny && record.hit;
+            if (done)
+            { next = kInvalid; }
+
+            // 部分木が終わったら後回しにしたノードへ.
+            if (next == kInvalid && !done)
+            {
+                if (slot.Stack.Count > 0)
+                { next = slot.Stack.Pop(); } // pop.
+                else if (slot.Stack.Overflow)
+                { next = bvh.NextSibling(slot.Node, ray, record.dist); }
+            }
+
+            // 次に読むノードを先読みして, 他のレイに切り替える.
+            slot.Node = next;
+            if (next != kInvalid)
+            {
+                bvh.PrefetchNodes(next, slot.Stack);
+                continue;
+            }
+
+            // 終了したスロットには次のレイを割り当てる.
+            if (!assign(slot))
+            { busy--; }
+        }
+    }
+}
+
+#if SALSA_KERNEL_AVX512
+//-----------------------------------------------------------------------------
+//      多分木のノードを巡回し交差判定を取ります.
+//      8つの子のスラブ判定をマスク付き比較でまとめて行い,
+//      当たった内部ノードは圧縮ストアでスタックに詰めて積みます.
+//-----------------------------------------------------------------------------
+void TraverseWide(const LBVH& bvh, const Ray& ray, HitRecord& record, bool hitAny)
+{
+    // 近い面と遠い面は方向の符号で選ぶ. 前半8つがmin, 後半8つがmax.
+    const auto near_x = (ray.inv_dir.x < 0.0f) ? kWideNodeSize : 0;
+    const auto near_y = (ray.inv_dir.y < 0.0f) ? kWideNodeSize : 0;
+    const auto near_z = (ray.inv_dir.z < 0.0f) ? kWideNodeSize : 0;
+    const auto far_x  = kWideNodeSize - near_x;
+    const auto far_y  = kWideNodeSize - near_y;
+    const auto far_z  = kWideNodeSize - near_z;
+
+    const auto pos_x = _mm256_set1_ps(ray.pos.x);
+    const auto pos_y = _mm256_set1_ps(ray.pos.y);
+    const auto pos_z = _mm256_set1_ps(ray.pos.z);
+    const auto inv_x = _mm256_set1_ps(ray.inv_dir.x);
+    const auto inv_y = _mm256_set1_ps(ray.inv_dir.y);
+    const auto inv_z = _mm256_set1_ps(ray.inv_dir.z);
+    const auto start = _mm256_set1_ps(ray.tmin);
+    const auto scale = _mm256_set1_ps(kSlabScale);
+    const auto leaf  = _mm256_set1_epi32(1);
+
+    // 積んだノードと, そのボックスに入る距離.
+    alignas(32) uint32_t stack_node[kWideStackSize + kWideNodeSize];
+    alignas(32) float    stack_dist[kWideStackSize + kWideNodeSize];
+    uint32_t top = 0;
+
+    // ルートノードから開始.
+    uint32_t idx = 0;
+
+    // 巡回するノードがなくなるまで処理.
+    while(idx != kInvalid)
+    {
+        const auto& node = bvh.WideNodes[idx];
+
+        // NaN の軸を無視するように, 各軸の値を第1引数にする.
+        const auto tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.BoxX + near_x), pos_x), inv_x);
+        const auto ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.BoxY + near_y), pos_y), inv_y);
+        const auto tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.BoxZ + near_z), pos_z), inv_z);
+        const auto tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.BoxX + far_x ), pos_x), inv_x);
+        const auto ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.BoxY + far_y ), pos_y), inv_y);
+        const auto tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.BoxZ + far_z ), pos_z), inv_z);
+
+        const auto tmin = _mm256_max_ps(tz0, _mm256_max_ps(ty0, _mm256_max_ps(tx0, start)));
+        auto       tmax = _mm256_min_ps(tz1, _mm256_min_ps(ty1, _mm256_min_ps(tx1, _mm256_set1_ps(record.dist))));
+        tmax = _mm256_mul_ps(tmax, scale);
+
+        // 当たらなかった子と空きスロットはマスクで落とす.
+        const auto hit      = __mmask8(_mm256_cmp_ps_mask(tmin, tmax, _CMP_LE_OQ) & node.Mask);
+        const auto child    = _mm256_load_si256(reinterpret_cast<const __m256i*>(node.Child));
+        const auto is_leaf  = _mm256_test_epi32_mask(child, leaf);
+        const auto hit_leaf = __mmask8(hit & is_leaf);
+        const auto visit    = __mmask8(hit & ~is_leaf);
+
+        // 当たった内部ノードを詰めて積む.
+        _mm256_mask_compressstoreu_epi32(stack_node + top, visit, child);
+        _mm256_mask_compressstoreu_ps   (stack_dist + top, visit, tmin);
+        const auto count = uint32_t(_mm_popcnt_u32(visit));
+
+        // 一番近い子を最後に積んで, 先に取り出す.
+        if (count > 1)
+        {
+            auto nearest = top;
+            for(auto i = top + 1; i < top + count; ++i)
+            {
+                if (stack_dist[i] < stack_dist[nearest])
+                { nearest = i; }
+            }
+            const auto last      = top + count - 1;
+            const auto near_node = stack_node[nearest];
+            const auto near_dist = stack_dist[nearest];
+            stack_node[nearest]  = stack_node[last];
+            stack_dist[nearest]  = stack_dist[last];
+            stack_node[last]     = near_node;
+            stack_dist[last]     = near_dist;
+        }
+        top += count;
+
+        // 三角形の判定中に次に取り出すノードが届くように先に読んでおく.
+        bvh.PrefetchWideNodes(stack_node, top);
+
+        if (hit_leaf)
+        {
+            for(uint32_t i=0; i<kWideNodeSize; ++i)
+            {
+                if (hit_leaf & (1u << i))
+                { bvh.PrefetchTriangle(node.Child[i] >> 1); }
+            }
+
+            for(uint32_t i=0; i<kWideNodeSize; ++i)
+            {
+                if (hit_leaf & (1u << i))
+                { bvh.IsHit(ray, record, node.Child[i] >> 1); }
+            }
+
+            if (hitAny && record.hit)
+            { return; }
+        }
+
+        // 交差距離が縮んで不要になったノードは飛ばして取り出す.
+        idx = kInvalid;
+        while(top > 0)
+        {
+            top--;
+            if (stack_dist[top] <= record.dist * kSlabScale)
+            {
+                idx = stack_node[top] >> 1;
+                break;
+            }
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+//      パケット単位で多分木のノードを巡回し交差判定を取ります.
+//      16レーンのパケットで8つの子をそれぞれ判定し, 当たったレーンと一緒に近い子が上になるように積みます.
+//-----------------------------------------------------------------------------
+void TraversePacketWide(const LBVH& bvh, const RayPacket& packet, HitRecord* records, bool hitAny)
+{
+    const PacketRays rays(packet);
+
+    // 面番号はビット列のままレーンに入れておく.
+    auto dist = rays.tmax;
+    auto u    = PZero();
+    auto v    = PZero();
+    auto face = PSet1i(-1);
+
+    auto active   = packet.mask;
+    auto hit_mask = 0;
+
+    // 有効なレーンの中で最も遠い交差距離をワールド空間の長さにした2乗. これより遠いボックスは全レーンで不要.
+    const auto len_sq = packet.dir_len * packet.dir_len;
+    auto far_dist = MaxLane(dist, active);
+    auto far_sq   = far_dist * far_dist * len_sq;
+
+    // パケット内でレイの向きが揃っているので, 近い面と遠い面はパケットで共通.
+    const auto nx = packet.sign[0];
+    const auto ny = packet.sign[1];
+    const auto nz = packet.sign[2];
+
+    const auto org_x = _mm256_set1_ps(packet.pos.x);
+    const auto org_y = _mm256_set1_ps(packet.pos.y);
+    const auto org_z = _mm256_set1_ps(packet.pos.z);
+    const auto zero8 = _mm256_setzero_ps();
+
+    // 積んだノードと, そのボックスに当たったレーン, 原点からボックスまでの距離の2乗.
+    uint32_t stack_node [kWideStackSize + kWideNodeSize];
+    int      stack_lanes[kWideStackSize + kWideNodeSize];
+    float    stack_gap  [kWideStackSize + kWideNodeSize];
+    uint32_t top = 0;
+
+    // ルートノードから開始.
+    uint32_t idx   = 0;
+    auto     lanes = active;
+
+    // 巡回するノードがなくなるまで処理.
+    while(idx != kInvalid)
+    {
+        const auto& node = bvh.WideNodes[idx];
+
+        // 原点からの相対位置と, 原点から子のボックスまでの最短距離の2乗を8つの子でまとめて求める.
+        const auto lo_x = _mm256_sub_ps(_mm256_load_ps(node.BoxX), org_x);
+        const auto lo_y = _mm256_sub_ps(_mm256_load_ps(node.BoxY), org_y);
+        const auto lo_z = _mm256_sub_ps(_mm256_load_ps(node.BoxZ), org_z);
+        const auto hi_x = _mm256_sub_ps(_mm256_load_ps(node.BoxX + kWideNodeSize), org_x);
+        const auto hi_y = _mm256_sub_ps(_mm256_load_ps(node.BoxY + kWideNodeSize), org_y);
+        const auto hi_z = _mm256_sub_ps(_mm256_load_ps(node.BoxZ + kWideNodeSize), org_z);
+
+        const auto gap_x = _mm256_max_ps(_mm256_max_ps(lo_x, _mm256_sub_ps(zero8, hi_x)), zero8);
+        const auto gap_y = _mm256_max_ps(_mm256_max_ps(lo_y, _mm256_sub_ps(zero8, hi_y)), zero8);
+        const auto gap_z = _mm256_max_ps(_mm256_max_ps(lo_z, _mm256_sub_ps(zero8, hi_z)), zero8);
+        const auto gap   = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(gap_x, gap_x), _mm256_mul_ps(gap_y, gap_y)), _mm256_mul_ps(gap_z, gap_z));
+
+        // 全レーンの交差距離より遠い子は判定しない. 原点を含む子はスラブ判定を省略する.
+        const auto near   = _mm256_cmp_ps_mask(gap, _mm256_set1_ps(far_sq), _CMP_LE_OQ) & node.Mask;
+        const auto inside = _mm256_cmp_ps_mask(gap, zero8, _CMP_EQ_OQ)
+                          & _mm256_cmp_ps_mask(lo_x, zero8, _CMP_LT_OQ) & _mm256_cmp_ps_mask(hi_x, zero8, _CMP_GT_OQ)
+                          & _mm256_cmp_ps_mask(lo_y, zero8, _CMP_LT_OQ) & _mm256_cmp_ps_mask(hi_y, zero8, _CMP_GT_OQ)
+                          & _mm256_cmp_ps_mask(lo_z, zero8, _CMP_LT_OQ) & _mm256_cmp_ps_mask(hi_z, zero8, _CMP_GT_OQ);
+
+        alignas(32) float lo_lane [3][kWideNodeSize];
+        alignas(32) float hi_lane [3][kWideNodeSize];
+        alignas(32) float gap_lane[kWideNodeSize];
+        _mm256_store_ps(lo_lane[0], lo_x); _mm256_store_ps(hi_lane[0], hi_x);
+        _mm256_store_ps(lo_lane[1], lo_y); _mm256_store_ps(hi_lane[1], hi_y);
+        _mm256_store_ps(lo_lane[2], lo_z); _mm256_store_ps(hi_lane[2], hi_z);
+        _mm256_store_ps(gap_lane, gap);
+
+        // このノードの子を積み始める位置. 並び替えはこれより上だけで行う.
+        const auto base = top;
+
+        for(uint32_t i=0; i<kWideNodeSize; ++i)
+        {
+            if (!(near & (1u << i)))
+            { continue; }
+
+            // 近い面と遠い面はパケットで共通なので, 原点からの相対位置を符号で選ぶ.
+            auto child_lanes = lanes;
+            if (!(inside & (1u << i)))
+            {
+                const auto tx0 = PMul(PSet1(nx ? hi_lane[0][i] : lo_lane[0][i]), rays.inv_dir[0]);
+                const auto tx1 = PMul(PSet1(nx ? lo_lane[0][i] : hi_lane[0][i]), rays.inv_dir[0]);
+                const auto ty0 = PMul(PSet1(ny ? hi_lane[1][i] : lo_lane[1][i]), rays.inv_dir[1]);
+                const auto ty1 = PMul(PSet1(ny ? lo_lane[1][i] : hi_lane[1][i]), rays.inv_dir[1]);
+                const auto tz0 = PMul(PSet1(nz ? hi_lane[2][i] : lo_lane[2][i]), rays.inv_dir[2]);
+                const auto tz1 = PMul(PSet1(nz ? lo_lane[2][i] : hi_lane[2][i]), rays.inv_dir[2]);
+
+                // NaN の軸を無視するように, 各軸の値を第1引数にする.
+                auto tmin = PMax(tz0, PMax(ty0, PMax(tx0, rays.tmin)));
+                auto tmax = PMin(tz1, PMin(ty1, PMin(tx1, dist)));
+                tmax = PMul(tmax, PSet1(kSlabScale));
+
+                child_lanes &= PBits(PCmpLE(tmin, tmax));
+                if (child_lanes == 0)
+                { continue; }
+            }
+
+            const auto child = node.Child[i];
+            if (child & 0x1)
+            {
+                const auto face_id = child >> 1;
+                const auto id      = face_id * 3;
+
+                PacketF t, fu, fv;
+                auto mask = IntersectTrianglePacket(
+                    packet,
+                    rays,
+                    bvh.Positions[bvh.Indices[id + 0].P],
+                    bvh.Positions[bvh.Indices[id + 1].P],
+                    bvh.Positions[bvh.Indices[id + 2].P],
+                    dist, t, fu, fv);
+                mask = PAnd(mask, PMask(child_lanes));
+
+                const auto bits = PBits(mask);
+                if (bits == 0)
+                { continue; }
+
+                dist = PSelect(mask, t,  dist);
+                u    = PSelect(mask, fu, u);
+                v    = PSelect(mask, fv, v);
+                face = PSelect(mask, PSet1i(int32_t(face_id)), face);
+                hit_mask |= bits;
+
+                far_dist = MaxLane(dist, active);
+                far_sq   = far_dist * far_dist * len_sq;
+                continue;
+            }
+
+            // 原点からボックスまでの距離が遠い順に並ぶように挿入して, 近い子を先に取り出す.
+            auto pos = top;
+            while(pos > base && stack_gap[pos - 1] < gap_lane[i])
+            {
+                stack_node [pos] = stack_node [pos - 1];
+                stack_lanes[pos] = stack_lanes[pos - 1];
+                stack_gap  [pos] = stack_gap  [pos - 1];
+                pos--;
+            }
+            stack_node [pos] = child;
+            stack_lanes[pos] = child_lanes;
+            stack_gap  [pos] = gap_lane[i];
+            top++;
+        }
+
+        // 1つでも交差が見つかったレーンは終了.
+        if (hitAny && (active & hit_mask))
+        {
+            active &= ~hit_mask;
+            if (active == 0)
+            { break; }
+
+            far_dist = MaxLane(dist, active);
+            far_sq   = far_dist * far_dist * len_sq;
+        }
+
+        // 三角形の判定中に次に取り出すノードが届くように先に読んでおく.
+        bvh.PrefetchWideNodes(stack_node, top);
+
+        // 残っているレーンが無いノードと, 交差距離が縮んで不要になったノードは飛ばして取り出す.
+        idx = kInvalid;
+        while(top > 0)
+        {
+            top--;
+            lanes = stack_lanes[top] & active;
+            if (lanes != 0 && stack_gap[top] <= far_sq)
+            {
+                idx = stack_node[top] >> 1;
+                break;
+            }
+        }
+    }
+
+    alignas(64) float   dist_lane[kLaneCount];
+    alignas(64) float   u_lane   [kLaneCount];
+    alignas(64) float   v_lane   [kLaneCount];
+    alignas(64) int32_t face_lane[kLaneCount];
+    PStore(dist_lane, dist);
+    PStore(u_lane,    u);
+    PStore(v_lane,    v);
+    PStore(reinterpret_cast<float*>(face_lane), face);
+
+    for(uint32_t i=0; i<kLaneCount; ++i)
+    {
+        if (!(hit_mask & (1 << i)))
+        { continue; }
+
+        records[i].hit     = true;
+        records[i].dist    = dist_lane[i];
+        records[i].u       = u_lane[i];
+        records[i].v       = v_lane[i];
+        records[i].face_id = face_lane[i];
+    }
+}
+#endif
+
+//-----------------------------------------------------------------------------
+//      交差位置の法線をレーン数ずつまとめて補間します.
+//-----------------------------------------------------------------------------
+void InterpolateNormals
+(
+    const LBVH&     bvh,
+    const uint32_t* face_ids,
+    const float*    u,
+    const float*    v,
+    float* const*   targets,
+    size_t          count
+)
+{
+    static_assert(sizeof(s3d::Vector3f)    == sizeof(float)    * 3, "Vector3f must be packed.");
+    static_assert(sizeof(s3d::VertexIndex) == sizeof(uint32_t) * 2, "VertexIndex must be packed.");
+
+#if SALSA_KERNEL_AVX2
+    // 添字は int32 のオフセットで集めるので, 面数は 2^31/6, 法線数は 2^31/3 まで.
+    const auto index  = reinterpret_cast<const int*>(bvh.Indices);
+    const auto normal = reinterpret_cast<const float*>(bvh.Normals);
+#endif
+
+    for(size_t head=0; head<count; head+=kLaneCount)
+    {
+        alignas(64) uint32_t face_lane[kLaneCount];
+        alignas(64) float    u_lane   [kLaneCount];
+        alignas(64) float    v_lane   [kLaneCount];
+
+        // 端数のレーンは最後の交差で埋めておく.
+        for(uint32_t i=0; i<kLaneCount; ++i)
+        {
+            const auto src = s3d::Min<size_t>(head + i, count - 1);
+            face_lane[i] = face_ids[src];
+            u_lane   [i] = u[src];
+            v_lane   [i] = v[src];
+        }
+
+        const auto fu = PLoad(u_lane);
+        const auto fv = PLoad(v_lane);
+        const auto fw = PSub(PSub(PSet1(1.0f), fu), fv);
+        const PacketF weight[3] = { fw, fu, fv };
+
+        PacketF ns[3] = { PZero(), PZero(), PZero() };
+        for(auto j=0; j<3; ++j)
+        {
+            PacketF n[3];
+
+#if SALSA_KERNEL_AVX512
+            // 面番号 -> 頂点の法線番号 -> 法線の成分 の2段をギャザーで引く.
+            // マスクなしのギャザーは PMin と同じく GCC bug 105593 の警告が出るので, 0 を元にしたマスク付きで書く.
+            const auto face = _mm512_load_si512(face_lane);
+            const auto slot = _mm512_add_epi32(_mm512_mullo_epi32(face, _mm512_set1_epi32(6)), _mm512_set1_epi32(j * 2 + 1));
+            const auto nid  = _mm512_mullo_epi32(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, slot, index, 4), _mm512_set1_epi32(3));
+            n[0] = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, nid, normal + 0, 4);
+            n[1] = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, nid, normal + 1, 4);
+            n[2] = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, nid, normal + 2, 4);
+#elif SALSA_KERNEL_AVX2
+            const auto face = _mm256_load_si256(reinterpret_cast<const __m256i*>(face_lane));
+            const auto slot = _mm256_add_epi32(_mm256_mullo_epi32(face, _mm256_set1_epi32(6)), _mm256_set1_epi32(j * 2 + 1));
+            const auto nid  = _mm256_mullo_epi32(_mm256_i32gather_epi32(index, slot, 4), _mm256_set1_epi32(3));
+            n[0] = _mm256_i32gather_ps(normal + 0, nid, 4);
+            n[1] = _mm256_i32gather_ps(normal + 1, nid, 4);
+            n[2] = _mm256_i32gather_ps(normal + 2, nid, 4);
+#else
+            // ギャザー命令が無いので読み込みだけスカラーで行い, 補間はベクトルで行う.
+            alignas(16) float lane[3][kLaneCount];
+            for(uint32_t i=0; i<kLaneCount; ++i)
+            {
+                const auto& src = bvh.Normals[bvh.Indices[face_lane[i] * 3 + j].N];
+                lane[0][i] = src.x;
+                lane[1][i] = src.y;
+                lane[2][i] = src.z;
+            }
+            n[0] = PLoad(lane[0]);
+            n[1] = PLoad(lane[1]);
+            n[2] = PLoad(lane[2]);
+#endif
+
+            for(auto k=0; k<3; ++k)
+            { ns[k] = PAdd(ns[k], PMul(n[k], weight[j])); }
+        }
+
+        alignas(64) float out[3][kLaneCount];
+        PStore(out[0], ns[0]);
+        PStore(out[1], ns[1]);
+        PStore(out[2], ns[2]);
+
+        // 書き込み先はレイごとにばらばらなのでスカラーで書き戻す.
+        const auto lanes = s3d::Min<size_t>(kLaneCount, count - head);
+        for(size_t i=0; i<lanes; ++i)
+        {
+            targets[head + i][0] = out[0][i];
+            targets[head + i][1] = out[1][i];
+            targets[head + i][2] = out[2][i];
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+//      カーネルテーブルです.
+//-----------------------------------------------------------------------------
+extern const KernelTable Kernel = {
+    SALSA_KERNEL_NAME,
+    kLaneCount,
+    TraverseIterative,
+    TraverseStackless,
+    TraversePacket,
+    TraverseInterleaved,
+#if SALSA_KERNEL_AVX512
+    TraverseWide,
+    TraversePacketWide,
+#else
+    nullptr,
+    nullptr,
+#endif
+    InterpolateNormals,
+};
+
+} // namespace SALSA_KERNEL_NAMESPACE
+} // namespace s3d
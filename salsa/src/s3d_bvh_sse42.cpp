@@ -0,0 +1,31 @@
+﻿//-----------------------------------------------------------------------------
+// File : s3d_bvh_sse42.cpp
+// Desc : Bounding Volume Hierarchy Traversal Kernels (SSE4.2).
+// Copyright(c) Project Asura. All right reserved.
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+#include <s3d_bvh.h>
+#include <immintrin.h>
+
+
+//-----------------------------------------------------------------------------
+// Macros.
+//-----------------------------------------------------------------------------
+#define SALSA_KERNEL_NAMESPACE  sse42
+#define SALSA_KERNEL_NAME       "SSE4.2"
+#define SALSA_KERNEL_SSE41      (1)
+
+
+#if !defined(_MSC_VER)
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#endif
+
+#include "s3d_bvh_kernel.inl"
+
+#if !defined(_MSC_VER)
+#pragma GCC pop_options
+#endif
@@ -0,0 +1,448 @@
+﻿//-----------------------------------------------------------------------------
+// File : s3d_bvh_test.cpp
+// Desc : Traversal Tests against Brute Force Intersection.
+// Copyright(c) Project Asura. All right reserved.
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+#include "../../src/rayrun.hpp"
+#include <s3d_bvh.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+//-----------------------------------------------------------------------------
+// Gloval Variables.
+//-----------------------------------------------------------------------------
+extern s3d::LBVH gLBVH;     // dll_main.cpp の Linear BVH.
+
+
+namespace {
+
+///////////////////////////////////////////////////////////////////////////////
+// Mesh structure
+///////////////////////////////////////////////////////////////////////////////
+struct Mesh
+{
+    const char*             Name;
+    std::vector<float>      Positions;
+    std::vector<float>      Normals;
+    std::vector<uint32_t>   Indices;    // v0, n0, v1, n1, v2, n2...
+
+    uint32_t AddVertex(const s3d::Vector3f& p)
+    {
+        Positions.push_back(p.x);
+        Positions.push_back(p.y);
+        Positions.push_back(p.z);
+        // 法線に位置をそのまま入れておくと, 補間した法線は交差位置と一致する.
+        Normals.push_back(p.x);
+        Normals.push_back(p.y);
+        Normals.push_back(p.z);
+        return uint32_t(Positions.size() / 3 - 1);
+    }
+
+    void AddTriangle(const s3d::Vector3f& a, const s3d::Vector3f& b, const s3d::Vector3f& c)
+    {
+        const uint32_t id[3] = { AddVertex(a), AddVertex(b), AddVertex(c) };
+        for(auto i : id)
+        {
+            Indices.push_back(i);
+            Indices.push_back(i);
+        }
+    }
+
+    size_t FaceCount() const
+    { return Indices.size() / 6; }
+
+    s3d::Vector3f Position(size_t face, int corner) const
+    {
+        const auto id = Indices[face * 6 + corner * 2];
+        return s3d::Vector3f(Positions[id * 3 + 0], Positions[id * 3 + 1], Positions[id * 3 + 2]);
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Expected structure
+///////////////////////////////////////////////////////////////////////////////
+struct Expected
+{
+    bool    Hit;
+    float   Dist;
+};
+
+//-----------------------------------------------------------------------------
+//      [-1, 1) の乱数.
+//-----------------------------------------------------------------------------
+float Signed(s3d::PCG& random)
+{ return random.GetAsF32() * 2.0f - 1.0f; }
+
+//-----------------------------------------------------------------------------
+//      小さな三角形をばらまいたメッシュ.
+//-----------------------------------------------------------------------------
+Mesh CreateSoup(uint32_t count)
+{
+    Mesh mesh = { "soup" };
+    s3d::PCG random(1);
+    for(uint32_t i=0; i<count; ++i)
+    {
+        const s3d::Vector3f c(Signed(random) * 4.0f, Signed(random) * 4.0f, Signed(random) * 4.0f);
+        mesh.AddTriangle(
+            c + s3d::Vector3f(Signed(random), Signed(random), Signed(random)) * 0.3f,
+            c + s3d::Vector3f(Signed(random), Signed(random), Signed(random)) * 0.3f,
+            c + s3d::Vector3f(Signed(random), Signed(random), Signed(random)) * 0.3f);
+    }
+    return mesh;
+}
+
+//-----------------------------------------------------------------------------
+//      軸に揃った格子状の床と壁. 軸に平行なレイが面の上を通る場合を作る.
+//-----------------------------------------------------------------------------
+Mesh CreateGrid(uint32_t size)
+{
+    Mesh mesh = { "grid" };
+    for(uint32_t y=0; y<size; ++y)
+    {
+        for(uint32_t x=0; x<size; ++x)
+        {
+            const auto fx = float(x);
+            const auto fy = float(y);
+            mesh.AddTriangle(s3d::Vector3f(fx, fy, 0.0f), s3d::Vector3f(fx + 1.0f, fy, 0.0f), s3d::Vector3f(fx + 1.0f, fy + 1.0f, 0.0f));
+            mesh.AddTriangle(s3d::Vector3f(fx, fy, 0.0f), s3d::Vector3f(fx + 1.0f, fy + 1.0f, 0.0f), s3d::Vector3f(fx, fy + 1.0f, 0.0f));
+
+            // 1マスおきに高さの違う壁を立てる.
+            if ((x + y) % 2 == 0)
+            {
+                const auto h = 0.5f + float((x * 7 + y * 3) % 5) * 0.25f;
+                mesh.AddTriangle(s3d::Vector3f(fx, fy, 0.0f), s3d::Vector3f(fx, fy + 1.0f, 0.0f), s3d::Vector3f(fx, fy + 1.0f, h));
+                mesh.AddTriangle(s3d::Vector3f(fx, fy, 0.0f), s3d::Vector3f(fx, fy + 1.0f, h), s3d::Vector3f(fx, fy, h));
+            }
+        }
+    }
+    return mesh;
+}
+
+//-----------------------------------------------------------------------------
+//      モートンコードが同じ三角形を大量に含むメッシュ.
+//      LBVH は1列に繋がった深い木になり, ショートスタックが溢れる.
+//-----------------------------------------------------------------------------
+Mesh CreateDeep(uint32_t count)
+{
+    Mesh mesh = CreateSoup(count);
+    mesh.Name = "deep";
+
+    // シーン全体に対して十分に小さい範囲に詰め込む.
+    s3d::PCG random(2);
+    for(uint32_t i=0; i<count; ++i)
+    {
+        const s3d::Vector3f c(0.001f * Signed(random), 0.001f * Signed(random), 0.001f * Signed(random));
+        mesh.AddTriangle(
+            c + s3d::Vector3f(-1.0f, -1.0f, float(i) * 1e-3f),
+            c + s3d::Vector3f( 1.0f, -1.0f, float(i) * 1e-3f),
+            c + s3d::Vector3f( 0.0f,  1.0f, float(i) * 1e-3f));
+    }
+    return mesh;
+}
+
+//-----------------------------------------------------------------------------
+//      レイを設定します.
+//-----------------------------------------------------------------------------
+void SetRay(Ray& ray, const s3d::Vector3f& pos, const s3d::Vector3f& dir, float tnear, float tfar)
+{
+    memset(&ray, 0, sizeof(ray));
+    ray.valid  = true;
+    ray.pos[0] = pos.x;
+    ray.pos[1] = pos.y;
+    ray.pos[2] = pos.z;
+    ray.dir[0] = dir.x;
+    ray.dir[1] = dir.y;
+    ray.dir[2] = dir.z;
+    ray.tnear  = tnear;
+    ray.tfar   = tfar;
+}
+
+//-----------------------------------------------------------------------------
+//      ランダムな方向. 正規化せず, 一部は軸に平行にする.
+//-----------------------------------------------------------------------------
+s3d::Vector3f RandomDir(s3d::PCG& random)
+{
+    s3d::Vector3f dir(Signed(random), Signed(random), Signed(random));
+    switch(random.GetAsU32() % 8)
+    {
+    case 0: dir.x = 0.0f; break;
+    case 1: dir.y = 0.0f; dir.z = 0.0f; break;
+    case 2: dir.x = -0.0f; dir.y = 0.0f; break;
+    default: break;
+    }
+
+    if (dir.LengthSq() == 0.0f)
+    { dir.z = 1.0f; }
+
+    // 方向の長さは 0.25 ～ 4 にばらつかせる.
+    return dir * (0.25f + random.GetAsF32() * 3.75f);
+}
+
+//-----------------------------------------------------------------------------
+//      メッシュの周りのランダムな位置. 一部は格子の座標に揃える.
+//-----------------------------------------------------------------------------
+s3d::Vector3f RandomPos(s3d::PCG& random, const s3d::AABB& box)
+{
+    const auto size = box.maxi - box.mini;
+    s3d::Vector3f pos(
+        box.mini.x + size.x * (random.GetAsF32() * 1.4f - 0.2f),
+        box.mini.y + size.y * (random.GetAsF32() * 1.4f - 0.2f),
+        box.mini.z + size.z * (random.GetAsF32() * 1.4f - 0.2f));
+
+    if (random.GetAsU32() % 4 == 0)
+    {
+        pos.x = floor(pos.x);
+        pos.y = floor(pos.y);
+    }
+    return pos;
+}
+
+//-----------------------------------------------------------------------------
+//      レイの範囲. tfar は無限大と有限の値を混ぜる.
+//-----------------------------------------------------------------------------
+void RandomRange(s3d::PCG& random, float& tnear, float& tfar)
+{
+    tnear = (random.GetAsU32() % 2 == 0) ? 0.0f : random.GetAsF32() * 0.5f;
+    tfar  = (random.GetAsU32() % 3 == 0) ? tnear + random.GetAsF32() * 4.0f : std::numeric_limits<float>::infinity();
+}
+
+//-----------------------------------------------------------------------------
+//      全ての三角形と判定して正解を求めます.
+//-----------------------------------------------------------------------------
+Expected BruteForce(const Mesh& mesh, const Ray& ray)
+{
+    const s3d::Vector3f pos(ray.pos[0], ray.pos[1], ray.pos[2]);
+    const s3d::Vector3f dir(ray.dir[0], ray.dir[1], ray.dir[2]);
+
+    Expected result = { false, ray.tfar };
+    for(size_t i=0; i<mesh.FaceCount(); ++i)
+    {
+        float u, v;
+        if (s3d::IntersectTriangle(pos, dir, mesh.Position(i, 0), mesh.Position(i, 1), mesh.Position(i, 2),
+            ray.tnear, ray.tfar, result.Dist, u, v))
+        { result.Hit = true; }
+    }
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Batch structure
+///////////////////////////////////////////////////////////////////////////////
+struct Batch
+{
+    const char*             Name;
+    std::vector<Ray>        Rays;
+    std::vector<Expected>   Expect;     // 交差の有無は hitAny でも同じ.
+};
+
+//-----------------------------------------------------------------------------
+//      intersect() の各経路に振り分けられるバッチを作ります.
+//-----------------------------------------------------------------------------
+std::vector<Batch> CreateBatches(const Mesh& mesh)
+{
+    s3d::AABB box;
+    box.Clear();
+    for(size_t i=0; i<mesh.Positions.size(); i+=3)
+    { box.Merge(s3d::Vector3f(mesh.Positions[i + 0], mesh.Positions[i + 1], mesh.Positions[i + 2])); }
+
+    s3d::PCG random(3);
+    std::vector<Batch> batches;
+
+    // ばらばらなレイ. 本数で 1本ずつ / 交互 / ストリーム / 並列 に分かれる.
+    const struct { const char* name; size_t count; } scattered[] = {
+        { "single",     7     },
+        { "interleave", 300   },
+        { "stream",     3000  },
+        { "parallel",   70000 },
+    };
+    for(const auto& item : scattered)
+    {
+        Batch batch = { item.name };
+        batch.Rays.resize(item.count);
+        for(auto& ray : batch.Rays)
+        {
+            float tnear, tfar;
+            RandomRange(random, tnear, tfar);
+            SetRay(ray, RandomPos(random, box), RandomDir(random), tnear, tfar);
+        }
+        batches.push_back(std::move(batch));
+    }
+
+    // 原点を共有するレイ. 本数で パケット / ストリーム に分かれる.
+    const struct { const char* name; size_t count; } shared[] = {
+        { "packet",        64   },
+        { "packet_stream", 2048 },
+    };
+    for(const auto& item : shared)
+    {
+        Batch batch = { item.name };
+        batch.Rays.resize(item.count);
+        const auto pos = RandomPos(random, box);
+        for(auto& ray : batch.Rays)
+        {
+            float tnear, tfar;
+            RandomRange(random, tnear, tfar);
+            SetRay(ray, pos, RandomDir(random), tnear, tfar);
+        }
+        batches.push_back(std::move(batch));
+    }
+
+    // 原点が同じ区間が並ぶレイ(タイル単位のAO). 短い区間も混ぜる.
+    {
+        Batch batch = { "origin_runs" };
+        while(batch.Rays.size() < 1500)
+        {
+            const auto pos   = RandomPos(random, box);
+            const auto count = (random.GetAsU32() % 4 == 0) ? 3 : 16;
+            for(auto i=0; i<count; ++i)
+            {
+                float tnear, tfar;
+                RandomRange(random, tnear, tfar);
+                batch.Rays.emplace_back();
+                SetRay(batch.Rays.back(), pos, RandomDir(random), tnear, tfar);
+            }
+        }
+        batches.push_back(std::move(batch));
+    }
+
+    // 無効なレイも混ぜる.
+    for(auto& batch : batches)
+    {
+        for(size_t i=0; i<batch.Rays.size(); i+=97)
+        { batch.Rays[i].valid = false; }
+    }
+
+    for(auto& batch : batches)
+    {
+        batch.Expect.resize(batch.Rays.size());
+        for(size_t i=0; i<batch.Rays.size(); ++i)
+        {
+            batch.Expect[i] = batch.Rays[i].valid
+                ? BruteForce(mesh, batch.Rays[i])
+                : Expected{ false, 0.0f };
+        }
+    }
+
+    return batches;
+}
+
+//-----------------------------------------------------------------------------
+//      intersect() の結果を正解と比べ, 一致しなかったレイ数を返します.
+//-----------------------------------------------------------------------------
+size_t Check(const Batch& batch, bool hitAny)
+{
+    auto rays = batch.Rays;
+    intersect(rays.data(), rays.size(), hitAny);
+
+    size_t errors = 0;
+    for(size_t i=0; i<rays.size(); ++i)
+    {
+        const auto& ray      = rays[i];
+        const auto& expected = batch.Expect[i];
+        if (ray.isisect != expected.Hit)
+        {
+            errors++;
+            continue;
+        }
+
+        if (!ray.isisect || hitAny)
+        { continue; }
+
+        // 面の境界では別の面を返すことがあるので, 面番号ではなく交差位置で比べる.
+        // 法線は頂点位置と同じ値にしてあるので, 補間結果も交差位置と比べられる.
+        auto diff  = 0.0f;
+        auto scale = 1.0f;
+        for(auto k=0; k<3; ++k)
+        {
+            const auto p = ray.pos[k] + ray.dir[k] * expected.Dist;
+            diff  += fabs(ray.isect[k] - p);
+            diff  += fabs(ray.ns[k] - p);
+            scale += fabs(p);
+        }
+
+        if (diff > 1e-4f * scale || ray.faceid < 0 || size_t(ray.faceid) * 3 >= gLBVH.IndexCount)
+        { errors++; }
+    }
+    return errors;
+}
+
+//-----------------------------------------------------------------------------
+//      走査カーネルの上限や巡回方法を環境変数で指定します.
+//-----------------------------------------------------------------------------
+void SetOption(const char* name, const char* value)
+{
+#if defined(_WIN32)
+    _putenv_s(name, value);
+#else
+    setenv(name, value, 1);
+#endif
+}
+
+} // namespace
+
+
+//-----------------------------------------------------------------------------
+//      メインエントリーポイントです.
+//-----------------------------------------------------------------------------
+int main(int, char**)
+{
+    const Mesh meshes[] = {
+        CreateSoup(2000),
+        CreateGrid(24),
+        CreateDeep(300),
+    };
+
+    const char* kernels[]    = { "sse2", "sse42", "avx2", "avx512" };
+    const char* traversals[] = { "shortstack", "stackless" };
+
+    size_t failures = 0;
+    for(const auto& mesh : meshes)
+    {
+        const auto batches = CreateBatches(mesh);
+
+        for(auto traversal : traversals)
+        {
+            SetOption("SALSA_TRAVERSAL", traversal);
+
+            std::string previous;
+            for(auto kernel : kernels)
+            {
+                SetOption("SALSA_KERNEL", kernel);
+                preprocess(
+                    mesh.Positions.data(), mesh.Positions.size() / 3,
+                    mesh.Normals.data(),   mesh.Normals.size() / 3,
+                    mesh.Indices.data(),   mesh.FaceCount());
+
+                // CPUが対応していないカーネルは1つ下のカーネルになるので飛ばす.
+                const std::string name = gLBVH.Kernel->Name;
+                if (name == previous)
+                { continue; }
+                previous = name;
+
+                for(const auto& batch : batches)
+                {
+                    for(auto hitAny : { false, true })
+                    {
+                        const auto errors = Check(batch, hitAny);
+                        printf("%-5s %-8s %-14s %-7s %zu/%zu %s %s\n",
+                            errors ? "FAIL" : "ok",
+                            mesh.Name, batch.Name, hitAny ? "any" : "closest",
+                            errors, batch.Rays.size(), name.c_str(), traversal);
+                        failures += errors ? 1 : 0;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%zu failure(s)\n", failures);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,344 @@
+﻿//
+#define _USE_MATH_DEFINES
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+//
+#include "rayrun.hpp"
+#include "harness.hpp"
+#include "meshcache.hpp"
+#include "plugin.hpp"
+#include "perfcounter.hpp"
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <array>
+#include <filesystem>
+#include <algorithm>
+#include <thread>
+
+// ウィンドウを作らずにpreprocess + AOレンダリングを行い、計測結果をJSONで出力する
+// -p 1でpreprocessと描画それぞれのハードウェアカウンタ(Linuxのみ)も出力する
+// -cでintersect()に渡した全てのレイと結果を記録する(rayrun_replayで再生できる)
+// rayrun_bench <plugin> <scene.json> [-o result.json] [-w width] [-h height] [-t threads] [-s tileSize] [-p 1] [-c trace.rrtrace]
+
+//
+int main(int argc, char** argv)
+{
+    // 標準出力にはJSONだけを出す。経過や診断は標準エラーに出す
+    const auto usage = [&]()
+    {
+        fprintf(stderr, "usage: %s <plugin> <scene.json> [-o result.json] [-w width] [-h height] [-t threads] [-s tileSize] [-p 1] [-c trace.rrtrace]\n", argv[0]);
+        return 1;
+    };
+    if (argc < 3)
+    {
+        return usage();
+    }
+    const std::string pluginName = argv[1];
+    const std::string jsonName = argv[2];
+    std::string outputName;
+    int32_t width = 1280;
+    int32_t height = 720;
+    RenderOption option;
+    bool usePerf = false;
+    std::string traceName;
+    for (int32_t ai = 3; ai < argc; ai += 2)
+    {
+        if (ai + 1 >= argc)
+        {
+            fprintf(stderr, "missing value for %s\n", argv[ai]);
+            return usage();
+        }
+        if (strcmp(argv[ai], "-o") == 0)
+        {
+            outputName = argv[ai + 1];
+        }
+        else if (strcmp(argv[ai], "-w") == 0)
+        {
+            width = atoi(argv[ai + 1]);
+        }
+        else if (strcmp(argv[ai], "-h") == 0)
+        {
+            height = atoi(argv[ai + 1]);
+        }
+        else if (strcmp(argv[ai], "-t") == 0)
+        {
+            option.numThread = atoi(argv[ai + 1]);
+        }
+        else if (strcmp(argv[ai], "-s") == 0)
+        {
+            option.tileSize = atoi(argv[ai + 1]);
+        }
+        else if (strcmp(argv[ai], "-p") == 0)
+        {
+            usePerf = (atoi(argv[ai + 1]) != 0);
+        }
+        else if (strcmp(argv[ai], "-c") == 0)
+        {
+            traceName = argv[ai + 1];
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[ai]);
+            return usage();
+        }
+    }
+    //
+    Plugin plugin;
+    if (!plugin.load(pluginName))
+    {
+        fprintf(stderr, "failed to load %s (%s)\n", pluginName.c_str(), plugin.error().c_str());
+        return 1;
+    }
+    const neverUseOpenMPFun neverUseOpenMP = plugin.find<neverUseOpenMPFun>("neverUseOpenMP");
+    const PreprocessFun preprocess = plugin.find<PreprocessFun>("preprocess");
+    const IsectFun intersect = plugin.find<IsectFun>("intersect");
+    const KernelNameFun kernelName = plugin.find<KernelNameFun>("kernelName");
+    if (preprocess == nullptr || intersect == nullptr)
+    {
+        fprintf(stderr, "%s does not export preprocess/intersect\n", pluginName.c_str());
+        return 1;
+    }
+    const bool useOpenMP = (neverUseOpenMP != nullptr) ? !neverUseOpenMP() : true;
+    if (!useOpenMP)
+    {
+        option.numThread = 1;
+    }
+    // 描画に使うワーカーを先に作ってから開き、スレッドごとに数える。
+    // プラグインが読み込み時に作ったスレッドはそれぞれ数え、後から作るスレッドは作ったスレッドの分に含まれる
+    PerfCounters perf;
+    if (usePerf)
+    {
+        WorkerThreads::instance().reserve((option.numThread > 0) ? option.numThread : std::max(1u, std::thread::hardware_concurrency()));
+        if (!perf.open())
+        {
+            fprintf(stderr, "hardware counters are not available\n");
+            usePerf = false;
+        }
+    }
+    //
+    const std::filesystem::path jsonpath = jsonName;
+    SceneSetting setting;
+    setting.load(jsonpath.string());
+    // objをロード
+    Stopwatch swLoad;
+    swLoad.start();
+    auto objpath = jsonpath.parent_path();
+    objpath.append(setting.model);
+    // 2回目以降は<obj>.rrmeshをマップしてそのままpreprocess()に渡す
+    MeshCache mesh;
+    mesh.load(objpath.string());
+    swLoad.stop();
+    swLoad.print("Load");
+    if (mesh.numFace() == 0)
+    {
+        fprintf(stderr, "failed to load %s\n", objpath.string().c_str());
+        return 1;
+    }
+    //
+    Stopwatch swPreprocess;
+    const PerfCounters::Sample perfBegin = perf.read();
+    swPreprocess.start();
+    preprocess(mesh.vertices(), mesh.numVerts(), mesh.normals(), mesh.numNormals(), mesh.indices(), mesh.numFace());
+    swPreprocess.stop();
+    const PerfCounters::Sample perfPreprocess = perf.read();
+    swPreprocess.print("preprocess");
+    const std::string kernel = (kernelName != nullptr) ? kernelName() : "";
+    if (!kernel.empty())
+    {
+        fprintf(stderr, "kernel %s\n", kernel.c_str());
+    }
+    //
+    RayTraceWriter trace;
+    if (!traceName.empty())
+    {
+        if (!trace.open(traceName, mesh.numVerts(), mesh.numFace()))
+        {
+            fprintf(stderr, "failed to open %s\n", traceName.c_str());
+            return 1;
+        }
+        option.trace = &trace;
+    }
+    //
+    std::vector<std::array<float, 4>> pixels(width * height);
+    int32_t renderingPercent = 0;
+    Stopwatch swIsect;
+    swIsect.start();
+    const RenderResult result = renderAo(setting, option, width, height, intersect, pixels, swIsect, renderingPercent);
+    swIsect.stop();
+    const PerfCounters::Sample perfRender = perf.read();
+    swIsect.print("isect");
+    const double mrays = double(result.rayCount) / (swIsect.elapsed() * 1000.0);
+    fprintf(stderr, "%.2fMRays/sec\n", mrays);
+    if (option.trace != nullptr && !trace.close())
+    {
+        fprintf(stderr, "failed to write %s\n", traceName.c_str());
+    }
+    //
+    plugin.unload();
+    // 計測結果
+    picojson::object stats;
+    stats["plugin"] = picojson::value(pluginName);
+    stats["scene"] = picojson::value(jsonName);
+    stats["kernel"] = picojson::value(kernel);
+    stats["width"] = picojson::value(double(width));
+    stats["height"] = picojson::value(double(height));
+    stats["threads"] = picojson::value(double(result.numThread));
+    stats["tile_size"] = picojson::value(double(option.tileSize));
+    stats["load_ms"] = picojson::value(swLoad.elapsed());
+    stats["mesh_cache"] = picojson::value(mesh.cached());
+    stats["preprocess_ms"] = picojson::value(swPreprocess.elapsed());
+    stats["isect_ms"] = picojson::value(swIsect.elapsed());
+    stats["rays"] = picojson::value(double(result.rayCount));
+    stats["mrays_per_sec"] = picojson::value(mrays);
+    stats["timeout"] = picojson::value(result.timeout);
+    if (!traceName.empty())
+    {
+        stats["trace"] = picojson::value(traceName);
+    }
+    // スレッドごとの稼働/アイドル時間と処理したタイルの区間[tile, begin_us, end_us]
+    int64_t finish = 0;
+    for (const auto& timeline : result.timeline)
+    {
+        finish = std::max(finish, timeline.finish);
+    }
+    picojson::array threads;
+    for (size_t ti = 0; ti < result.timeline.size(); ++ti)
+    {
+        const ThreadTimeline& timeline = result.timeline[ti];
+        picojson::array spans;
+        for (const TileSpan& span : timeline.spans)
+        {
+            picojson::array s;
+            s.push_back(picojson::value(double(span.tile)));
+            s.push_back(picojson::value(double(span.begin)));
+            s.push_back(picojson::value(double(span.end)));
+            spans.push_back(picojson::value(s));
+        }
+        picojson::object thread;
+        thread["thread"] = picojson::value(double(ti));
+        thread["tiles"] = picojson::value(double(timeline.spans.size()));
+        thread["steals"] = picojson::value(double(timeline.steals));
+        thread["busy_ms"] = picojson::value(double(timeline.busy) / 1000.0);
+        thread["idle_ms"] = picojson::value(double(finish - timeline.busy) / 1000.0);
+        thread["spans"] = picojson::value(spans);
+        threads.push_back(picojson::value(thread));
+    }
+    stats["timeline"] = picojson::value(threads);
+    // intersect()の所要時間。スレッドごとに、呼び出しのあったhit_anyとバッチサイズの組だけを出力する
+    // histogram_us[i]は所要時間が[2^(i-1), 2^i)マイクロ秒の呼び出し数(0番は1マイクロ秒未満)
+    picojson::array latency;
+    picojson::object summary;
+    for (int32_t hitAny = 0; hitAny < 2; ++hitAny)
+    {
+        LatencyHistogram::Bucket total;
+        for (const auto& histogram : result.latency)
+        {
+            for (const auto& bucket : histogram.buckets[hitAny])
+            {
+                total.calls += bucket.calls;
+                total.rays += bucket.rays;
+                total.totalNs += bucket.totalNs;
+            }
+        }
+        picojson::object kind;
+        kind["calls"] = picojson::value(double(total.calls));
+        kind["rays"] = picojson::value(double(total.rays));
+        kind["total_ms"] = picojson::value(double(total.totalNs) / 1e6);
+        summary[hitAny ? "ao" : "primary"] = picojson::value(kind);
+    }
+    for (size_t ti = 0; ti < result.latency.size(); ++ti)
+    {
+        picojson::array buckets;
+        for (int32_t hitAny = 0; hitAny < 2; ++hitAny)
+        {
+            for (int32_t si = 0; si < LatencyHistogram::kNumSizeBucket; ++si)
+            {
+                const auto& bucket = result.latency[ti].buckets[hitAny][si];
+                if (bucket.calls == 0)
+                {
+                    continue;
+                }
+                picojson::array counts;
+                for (const uint64_t count : bucket.counts)
+                {
+                    counts.push_back(picojson::value(double(count)));
+                }
+                picojson::object entry;
+                entry["hit_any"] = picojson::value(hitAny != 0);
+                entry["batch_min"] = picojson::value(double(size_t(1) << si));
+                entry["calls"] = picojson::value(double(bucket.calls));
+                entry["rays"] = picojson::value(double(bucket.rays));
+                entry["total_us"] = picojson::value(double(bucket.totalNs) / 1000.0);
+                entry["mean_us"] = picojson::value(double(bucket.totalNs) / 1000.0 / double(bucket.calls));
+                entry["histogram_us"] = picojson::value(counts);
+                buckets.push_back(picojson::value(entry));
+            }
+        }
+        picojson::object thread;
+        thread["thread"] = picojson::value(double(ti));
+        thread["buckets"] = picojson::value(buckets);
+        latency.push_back(picojson::value(thread));
+    }
+    stats["latency"] = picojson::value(latency);
+    stats["latency_summary"] = picojson::value(summary);
+    // ハードウェアカウンタ。per_rayは描画の値を描画したレイ数で割った値。
+    // threadsはスレッドごとの値(mainはこのスレッド、workerは描画のワーカーかプラグインが読み込み時に作ったスレッド)
+    if (usePerf)
+    {
+        const auto toJson = [&](const PerfCounters::Counts& counts)
+        {
+            picojson::object counters;
+            for (int32_t ei = 0; ei < PerfCounters::kNumEvent; ++ei)
+            {
+                if (counts.valid[ei])
+                {
+                    counters[PerfCounters::name(ei)] = picojson::value(double(counts.values[ei]));
+                }
+            }
+            return counters;
+        };
+        const PerfCounters::Sample preprocessCounts = perfPreprocess - perfBegin;
+        const PerfCounters::Sample renderCounts = perfRender - perfPreprocess;
+        picojson::object perRay;
+        for (int32_t ei = 0; ei < PerfCounters::kNumEvent; ++ei)
+        {
+            if (renderCounts.total.valid[ei])
+            {
+                perRay[PerfCounters::name(ei)] = picojson::value(double(renderCounts.total.values[ei]) / double(std::max<size_t>(result.rayCount, 1)));
+            }
+        }
+        picojson::object render = toJson(renderCounts.total);
+        render["per_ray"] = picojson::value(perRay);
+        picojson::array threads;
+        const std::vector<PerfCounters::Thread> perfThreads = perf.threads();
+        for (size_t ti = 0; ti < perfThreads.size(); ++ti)
+        {
+            picojson::object thread;
+            thread["tid"] = picojson::value(double(perfThreads[ti].tid));
+            thread["role"] = picojson::value(perfThreads[ti].main ? "main" : "worker");
+            thread["preprocess"] = picojson::value(toJson(preprocessCounts.threads[ti]));
+            thread["render"] = picojson::value(toJson(renderCounts.threads[ti]));
+            threads.push_back(picojson::value(thread));
+        }
+        picojson::object counters;
+        counters["preprocess"] = picojson::value(toJson(preprocessCounts.total));
+        counters["render"] = picojson::value(render);
+        counters["threads"] = picojson::value(threads);
+        stats["perf"] = picojson::value(counters);
+    }
+    const std::string json = picojson::value(stats).serialize(true);
+    if (outputName.empty())
+    {
+        printf("%s", json.c_str());
+    }
+    else
+    {
+        std::ofstream file(outputName, std::ios::out);
+        file << json;
+    }
+    return result.timeout ? 2 : 0;
+}
@@ -0,0 +1,670 @@
+﻿//
+#pragma once
+//
+#include "rayrun.hpp"
+#include "scheduler.hpp"
+#include "objparser.hpp"
+#include "raytrace.hpp"
+//
+#include "picojson.h"
+#include "glm/glm.hpp"
+//
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <array>
+#include <tuple>
+#include <fstream>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+//
+typedef bool(*neverUseOpenMPFun)();
+
+// 統計表示用に使用している走査カーネルの名前を返す(実装ごとの任意の関数)
+// 関数が存在しない場合は表示しないとします
+typedef const char*(*KernelNameFun)();
+
+//
+typedef void(*PreprocessFun)(
+    const float* vertices,
+    size_t numVerts,
+    const float* normals,
+    size_t numNormals,
+    const uint32_t* indices,
+    size_t numFace);
+
+typedef void(*IsectFun)(
+    Ray* rays,
+    size_t numRay,
+    bool hitany);
+
+//
+class OrthonormalBasis
+{
+public:
+    OrthonormalBasis() = default;
+    OrthonormalBasis(glm::vec3 n)
+    {
+        if (fabsf(n.x) < 0.99f)
+        {
+            s_ = glm::cross(n, glm::vec3(1.0f, 0.0f, 0.0));
+        }
+        else
+        {
+            s_ = glm::cross(n, glm::vec3(0.0f, 1.0f, 0.0f));
+        }
+        s_ = glm::normalize(s_);
+        t_ = glm::cross(s_, n);
+        n_ = n;
+
+        //
+        is_ = glm::vec3(s_.x, t_.x, n_.x);
+        it_ = glm::vec3(s_.y, t_.y, n_.y);
+        in_ = glm::vec3(s_.z, t_.z, n_.z);
+
+    }
+    glm::vec3 world2local(glm::vec3 world) const
+    {
+        return glm::vec3(
+            glm::dot(world, s_),
+            glm::dot(world, t_),
+            glm::dot(world, n_));
+    }
+    glm::vec3 local2world(glm::vec3 local) const
+    {
+        return glm::vec3(
+            glm::dot(local, is_),
+            glm::dot(local, it_),
+            glm::dot(local, in_));
+    }
+
+private:
+    glm::vec3 s_;
+    glm::vec3 t_;
+    glm::vec3 n_;
+    glm::vec3 is_;
+    glm::vec3 it_;
+    glm::vec3 in_;
+};
+
+//
+inline glm::vec3 getHemisphere(float x, float y)
+{
+    const float phi = 2.0f * float(M_PI) * x;
+    const float sinPhi = std::sin(phi);
+    const float cosPhi = std::cos(phi);
+    const float cosTheta = 1.0f - y;
+    const float sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+    return glm::vec3(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta);
+
+}
+
+// 頂点法線を面法線の和から生成し、法線のインデックスを頂点のインデックスに揃える。
+// numThreadは頂点を分ける範囲の数で、0の場合はハードウェアのスレッド数。範囲の数によらず結果は同じ
+inline void generateNormals(
+    const std::vector<float>& vertices,
+    std::vector<uint32_t>& indices,
+    std::vector<float>& normals,
+    int32_t numThread = 0)
+{
+    const size_t numVerts = vertices.size() / 3;
+    const size_t numFace = indices.size() / 6;
+    normals.resize(numVerts * 3);
+    if (numVerts == 0)
+    {
+        return;
+    }
+    // 面法線(正規化しない)
+    std::vector<glm::vec3> faceNormals(numFace);
+    parallelFor(numFace, [&](size_t begin, size_t end)
+    {
+        for (size_t fi = begin; fi < end; ++fi)
+        {
+            const uint32_t vi0 = indices[fi * 6 + 0];
+            const uint32_t vi1 = indices[fi * 6 + 2];
+            const uint32_t vi2 = indices[fi * 6 + 4];
+            const glm::vec3 v0(vertices[vi0 * 3 + 0], vertices[vi0 * 3 + 1], vertices[vi0 * 3 + 2]);
+            const glm::vec3 v1(vertices[vi1 * 3 + 0], vertices[vi1 * 3 + 1], vertices[vi1 * 3 + 2]);
+            const glm::vec3 v2(vertices[vi2 * 3 + 0], vertices[vi2 * 3 + 1], vertices[vi2 * 3 + 2]);
+            const glm::vec3 e01 = v1 - v0;
+            const glm::vec3 e02 = v2 - v0;
+            faceNormals[fi] = glm::cross(e01, e02);
+            indices[fi * 6 + 1] = vi0;
+            indices[fi * 6 + 3] = vi1;
+            indices[fi * 6 + 5] = vi2;
+        }
+    }, numThread);
+    // 面の角(面番号*3+k)を頂点の範囲ごとのバケットに振り分ける。面の区間ごと、頂点の範囲ごとに数えて
+    // 累積和で書き込み位置を決めるので、atomicが要らず、バケット内は面の順に並ぶ
+    if (numThread <= 0)
+    {
+        numThread = int32_t(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    const size_t numRange = std::max<size_t>(1, std::min<size_t>(numThread, numVerts));
+    const auto rangeOf = [&](uint32_t vi)
+    {
+        return size_t(uint64_t(vi) * numRange / numVerts);
+    };
+    // rangeOf()と一致するように切り上げる
+    const auto firstVertex = [&](size_t r)
+    {
+        return (numVerts * r + numRange - 1) / numRange;
+    };
+    std::vector<size_t> offsets(numRange * numRange, 0);
+    parallelFor(numRange, [&](size_t cb, size_t ce)
+    {
+        for (size_t c = cb; c < ce; ++c)
+        {
+            size_t* count = &offsets[c * numRange];
+            for (size_t fi = numFace * c / numRange; fi < numFace * (c + 1) / numRange; ++fi)
+            {
+                ++count[rangeOf(indices[fi * 6 + 0])];
+                ++count[rangeOf(indices[fi * 6 + 2])];
+                ++count[rangeOf(indices[fi * 6 + 4])];
+            }
+        }
+    }, int32_t(numRange));
+    std::vector<size_t> rangeBegin(numRange + 1, 0);
+    size_t sum = 0;
+    for (size_t r = 0; r < numRange; ++r)
+    {
+        rangeBegin[r] = sum;
+        for (size_t c = 0; c < numRange; ++c)
+        {
+            const size_t count = offsets[c * numRange + r];
+            offsets[c * numRange + r] = sum;
+            sum += count;
+        }
+    }
+    rangeBegin[numRange] = sum;
+    std::vector<uint32_t> corners(sum);
+    parallelFor(numRange, [&](size_t cb, size_t ce)
+    {
+        for (size_t c = cb; c < ce; ++c)
+        {
+            size_t* offset = &offsets[c * numRange];
+            for (size_t fi = numFace * c / numRange; fi < numFace * (c + 1) / numRange; ++fi)
+            {
+                for (uint32_t k = 0; k < 3; ++k)
+                {
+                    corners[offset[rangeOf(indices[fi * 6 + k * 2])]++] = uint32_t(fi * 3 + k);
+                }
+            }
+        }
+    }, int32_t(numRange));
+    // 範囲ごとに面法線を足して正規化する。加算の順序は逐次処理と同じ
+    parallelFor(numRange, [&](size_t rb, size_t re)
+    {
+        for (size_t r = rb; r < re; ++r)
+        {
+            const size_t begin = firstVertex(r);
+            const size_t end = firstVertex(r + 1);
+            std::vector<glm::vec3> sums(end - begin, glm::vec3(0.0f, 0.0f, 0.0f));
+            for (size_t ci = rangeBegin[r]; ci < rangeBegin[r + 1]; ++ci)
+            {
+                const uint32_t corner = corners[ci];
+                sums[indices[(corner / 3) * 6 + (corner % 3) * 2] - begin] += faceNormals[corner / 3];
+            }
+            for (size_t vi = begin; vi < end; ++vi)
+            {
+                const glm::vec3 n = glm::normalize(sums[vi - begin]);
+                normals[vi * 3 + 0] = n.x;
+                normals[vi * 3 + 1] = n.y;
+                normals[vi * 3 + 2] = n.z;
+            }
+        }
+    }, int32_t(numRange));
+}
+
+// vnを指定していない角(ObjParser::kMissingNormal)にだけ法線を補う。ファイルにある法線はそのまま残し、
+// 補う法線は頂点ごとに1つ、その頂点を使う全ての面の面法線の和を正規化したものを末尾に追加する
+inline void fillMissingNormals(
+    const std::vector<float>& vertices,
+    std::vector<uint32_t>& indices,
+    std::vector<float>& normals)
+{
+    const size_t numVerts = vertices.size() / 3;
+    const size_t numFace = indices.size() / 6;
+    // 法線を補う頂点に、追加する法線の番号を割り当てる
+    std::vector<uint32_t> slots(numVerts, ObjParser::kMissingNormal);
+    uint32_t numAdded = 0;
+    const uint32_t firstAdded = uint32_t(normals.size() / 3);
+    for (size_t ci = 0; ci < numFace * 3; ++ci)
+    {
+        uint32_t& slot = slots[indices[ci * 2 + 0]];
+        if (indices[ci * 2 + 1] == ObjParser::kMissingNormal && slot == ObjParser::kMissingNormal)
+        {
+            slot = firstAdded + numAdded++;
+        }
+    }
+    // 面法線(正規化しない)を足し込む
+    std::vector<glm::vec3> sums(numAdded, glm::vec3(0.0f, 0.0f, 0.0f));
+    for (size_t fi = 0; fi < numFace; ++fi)
+    {
+        const uint32_t vi0 = indices[fi * 6 + 0];
+        const uint32_t vi1 = indices[fi * 6 + 2];
+        const uint32_t vi2 = indices[fi * 6 + 4];
+        if (slots[vi0] == ObjParser::kMissingNormal &&
+            slots[vi1] == ObjParser::kMissingNormal &&
+            slots[vi2] == ObjParser::kMissingNormal)
+        {
+            continue;
+        }
+        const glm::vec3 v0(vertices[vi0 * 3 + 0], vertices[vi0 * 3 + 1], vertices[vi0 * 3 + 2]);
+        const glm::vec3 v1(vertices[vi1 * 3 + 0], vertices[vi1 * 3 + 1], vertices[vi1 * 3 + 2]);
+        const glm::vec3 v2(vertices[vi2 * 3 + 0], vertices[vi2 * 3 + 1], vertices[vi2 * 3 + 2]);
+        const glm::vec3 n = glm::cross(v1 - v0, v2 - v0);
+        for (const uint32_t vi : { vi0, vi1, vi2 })
+        {
+            if (slots[vi] != ObjParser::kMissingNormal)
+            {
+                sums[slots[vi] - firstAdded] += n;
+            }
+        }
+    }
+    normals.reserve(normals.size() + size_t(numAdded) * 3);
+    for (const auto& sum : sums)
+    {
+        const glm::vec3 n = glm::normalize(sum);
+        normals.push_back(n.x);
+        normals.push_back(n.y);
+        normals.push_back(n.z);
+    }
+    for (size_t ci = 0; ci < numFace * 3; ++ci)
+    {
+        if (indices[ci * 2 + 1] == ObjParser::kMissingNormal)
+        {
+            indices[ci * 2 + 1] = slots[indices[ci * 2 + 0]];
+        }
+    }
+}
+
+//
+inline std::tuple<
+    std::vector<float>,
+    std::vector<float>,
+    std::vector<uint32_t>>
+    loadMesh(const std::string& filename)
+{
+    std::vector<float> vertices;
+    std::vector<float> normals;
+    std::vector<uint32_t> indices;
+    ObjParser parser;
+    if (!parser.parse(filename, vertices, normals, indices))
+    {
+        fprintf(stderr, "failed to load %s\n", parser.error.c_str());
+        return {};
+    }
+
+    // 法線がない場合は生成する(元のローダーと同じ)。
+    // 一部の角だけvnが無い場合は、ファイルの法線を残してその角の頂点にだけ法線を補う
+    if (normals.empty())
+    {
+        generateNormals(vertices, indices, normals);
+    }
+    else if (!parser.hasNormals)
+    {
+        fillMissingNormals(vertices, indices, normals);
+    }
+    return { std::move(vertices), std::move(normals), std::move(indices) };
+}
+
+//
+struct SceneSetting
+{
+public:
+    std::string model;
+    glm::vec3 pos;
+    glm::vec3 dir;
+    glm::vec3 up;
+    float fovy;
+    int32_t samplePerPixel;
+    int32_t sampleAo;
+
+public:
+    void load(const std::string& filename)
+    {
+        // JSONデータの読み込み。
+        std::ifstream file(filename, std::ios::in);
+        const std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+        picojson::value root;
+        const std::string err = picojson::parse(root, json);
+        if (err != "")
+        {
+            fprintf(stderr, "%s\n", err.c_str());
+            return;
+        }
+        //
+        const auto getV3 = [](picojson::value& obj)->glm::vec3
+        {
+            picojson::array& posArr = obj.get<picojson::array>();
+            return glm::vec3(
+                float(posArr[0].get<double>()),
+                float(posArr[1].get<double>()),
+                float(posArr[2].get<double>()) );
+        };
+        //
+        SceneSetting& SceneSetting = *this;
+        picojson::object& obj = root.get<picojson::object>();
+        SceneSetting.model = obj["model"].get<std::string>();
+        SceneSetting.pos = getV3(obj["pos"]);
+        SceneSetting.dir = glm::normalize(getV3(obj["dir"]));
+        SceneSetting.up = getV3(obj["up"]);
+        SceneSetting.fovy = float(obj["fovy"].get<double>());
+        SceneSetting.samplePerPixel = int32_t(obj["samplePerPixel"].get<double>());
+        SceneSetting.sampleAo = int32_t(obj["sampleAo"].get<double>());
+    }
+};
+
+// steady_clockで計る。elapsed()はミリ秒だが分解能はマイクロ秒
+class Stopwatch
+{
+    using clock = std::chrono::steady_clock;
+public:
+    void start()
+    {
+        start_ = clock::now();
+    }
+    void stop()
+    {
+        end_ = clock::now();
+    }
+    double elapsed()
+    {
+        return toMs(end_ - start_);
+    }
+    double elapsedNow()
+    {
+        return toMs(clock::now() - start_);
+    }
+    // 標準出力は計測結果のJSONに使うので、標準エラーに出す
+    void print(const char* tag)
+    {
+        fprintf(stderr, "%s %4.3fms\n", tag, elapsed());
+    }
+private:
+    static double toMs(clock::duration d)
+    {
+        return double(std::chrono::duration_cast<std::chrono::microseconds>(d).count()) / 1000.0;
+    }
+    clock::time_point start_;
+    clock::time_point end_;
+};
+
+// intersect()1回の所要時間の分布。hitAnyとバッチのレイ数(2のべきで区切る)ごとに、
+// 所要時間を2のべき(マイクロ秒)で区切って数える
+struct LatencyHistogram
+{
+    static constexpr int32_t kNumSizeBucket = 20;
+    static constexpr int32_t kNumTimeBucket = 24;
+    //
+    struct Bucket
+    {
+        uint64_t calls = 0;
+        uint64_t rays = 0;
+        uint64_t totalNs = 0;
+        std::array<uint64_t, kNumTimeBucket> counts = {};
+    };
+    Bucket buckets[2][kNumSizeBucket];
+    // バッチのレイ数が[2^(i-1), 2^i)なら i (1本なら0)
+    static int32_t sizeBucket(size_t rayCount)
+    {
+        int32_t i = 0;
+        while (i + 1 < kNumSizeBucket && (size_t(1) << i) <= rayCount)
+        {
+            ++i;
+        }
+        return std::max(i - 1, 0);
+    }
+    // 所要時間が[2^(i-1), 2^i)マイクロ秒なら i (1マイクロ秒未満なら0)
+    static int32_t timeBucket(uint64_t ns)
+    {
+        uint64_t us = ns / 1000;
+        int32_t i = 0;
+        while (us > 0 && i + 1 < kNumTimeBucket)
+        {
+            us >>= 1;
+            ++i;
+        }
+        return i;
+    }
+    //
+    void add(bool hitAny, size_t rayCount, uint64_t ns)
+    {
+        Bucket& bucket = buckets[hitAny ? 1 : 0][sizeBucket(rayCount)];
+        ++bucket.calls;
+        bucket.rays += rayCount;
+        bucket.totalNs += ns;
+        ++bucket.counts[timeBucket(ns)];
+    }
+};
+
+// 一次レイとAOレイをまとめて交差判定するタイルの一辺のピクセル数
+constexpr int32_t kTileSize = 8;
+
+//
+struct RenderOption
+{
+    int32_t tileSize = kTileSize;
+    // 0の場合はハードウェアのスレッド数
+    int32_t numThread = 0;
+    // nullptrでない場合はintersect()に渡した全てのバッチと結果を記録する
+    RayTraceWriter* trace = nullptr;
+};
+
+//
+struct RenderResult
+{
+    size_t rayCount = 0;
+    bool timeout = false;
+    int32_t numThread = 0;
+    std::vector<ThreadTimeline> timeline;
+    // スレッドごとのintersect()の所要時間
+    std::vector<LatencyHistogram> latency;
+};
+
+// AOのレンダリング。GUI版とヘッドレス版で共通
+inline RenderResult renderAo(
+    const SceneSetting& setting,
+    const RenderOption& option,
+    int32_t width,
+    int32_t height,
+    IsectFun intersect,
+    std::vector<std::array<float, 4>>& pixels,
+    Stopwatch& swIsect,
+    int32_t& renderingPercent)
+{
+    //
+    const int32_t hw = width / 2;
+    const float iw = 1.0f / float(width);
+    const int32_t hh = height / 2;
+    const float ih = 1.0f / float(height);
+    const glm::vec3 dir = glm::normalize(setting.dir);
+    const glm::vec3 pos = glm::vec3(setting.pos);
+    const glm::vec3 right = glm::cross(dir, glm::normalize(setting.up));
+    const glm::vec3 up = glm::normalize(glm::cross(right, dir));
+    const float hfovy = setting.fovy * 0.5f;
+    const int32_t numPrimRay = setting.samplePerPixel;
+    const int32_t numAoSample = setting.sampleAo;
+    const float invNumSample = 1.0f / float(numAoSample*numPrimRay);
+    //
+    std::uniform_real_distribution<float> dist01(0.0f, 1.0f);
+    //
+    // タイル単位でまとめて交差判定する
+    const int32_t tileSize = std::max(option.tileSize, 1);
+    const int32_t numTileX = (width + tileSize - 1) / tileSize;
+    const int32_t numTileY = (height + tileSize - 1) / tileSize;
+    const int32_t numTile = numTileX * numTileY;
+    //
+    std::atomic<size_t> rayCountTotal(0);
+    std::atomic<int32_t> doneTile(0);
+    std::atomic<bool> timeout(false);
+    TileScheduler scheduler(numTileX, numTileY, option.numThread);
+    // タイル間で使い回すスレッドごとのバッファ
+    struct Buffer
+    {
+        std::vector<Ray> primRays;
+        std::vector<Ray> aoRays;
+        std::vector<float> coss;
+        std::vector<int32_t> hitPixels;
+        std::vector<float> aos;
+    };
+    std::vector<Buffer> buffers(scheduler.numThread());
+    // 記録用のスレッドごとのバッファ
+    std::vector<std::vector<RRTraceRay>> traceRays(scheduler.numThread());
+    std::vector<std::vector<RRTraceHit>> traceHits(scheduler.numThread());
+    std::vector<LatencyHistogram> latency(scheduler.numThread());
+    const auto timedIntersect = [&](int32_t thread, Ray* rays, size_t rayCount, bool hitAny)
+    {
+        if (option.trace != nullptr)
+        {
+            RayTraceWriter::capture(rays, rayCount, traceRays[thread]);
+        }
+        const auto begin = std::chrono::steady_clock::now();
+        intersect(rays, rayCount, hitAny);
+        const auto end = std::chrono::steady_clock::now();
+        latency[thread].add(hitAny, rayCount, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count()));
+        if (option.trace != nullptr)
+        {
+            option.trace->write(uint32_t(thread), hitAny, traceRays[thread], rays, traceHits[thread]);
+        }
+    };
+    scheduler.run([&](int32_t thread, int32_t ti)
+    {
+        auto& [primRays, aoRays, coss, hitPixels, aos] = buffers[thread];
+        // 60秒でタイムアウト(残りのタイルは飛ばす)
+        if (timeout || swIsect.elapsedNow() > 60000)
+        {
+            timeout = true;
+            return;
+        }
+        //
+        std::mt19937 rng(uint32_t(std::hash<int32_t>{}(ti)));
+        const int32_t x0 = (ti % numTileX) * tileSize;
+        const int32_t y0 = (ti / numTileX) * tileSize;
+        const int32_t x1 = std::min(x0 + tileSize, width);
+        const int32_t y1 = std::min(y0 + tileSize, height);
+        const int32_t tw = x1 - x0;
+        const int32_t numPixel = tw * (y1 - y0);
+        // タイル内の全ての一次レイを1回で交差判定
+        primRays.resize(numPixel * numPrimRay);
+        for (int32_t pi = 0; pi < numPixel; ++pi)
+        {
+            const int32_t x = x0 + pi % tw;
+            const int32_t y = y0 + pi / tw;
+            for (int32_t np = 0; np < numPrimRay; ++np)
+            {
+                //
+                const float px = float(x - hw) + dist01(rng);
+                const float py = float(y - hh) + dist01(rng);
+                const float xs = px * iw * std::tan(hfovy * float(width) / float(height));
+                const float ys = py * ih * std::tan(hfovy);
+                const glm::vec3 rd = glm::normalize(glm::vec3(ys) * up + glm::vec3(xs) * right + dir);
+                Ray& primRay = primRays[pi * numPrimRay + np];
+                primRay.pos[0] = pos.x;
+                primRay.pos[1] = pos.y;
+                primRay.pos[2] = pos.z;
+                primRay.dir[0] = rd.x;
+                primRay.dir[1] = rd.y;
+                primRay.dir[2] = rd.z;
+                primRay.tnear = 0.000f;
+                primRay.tfar = std::numeric_limits<float>::infinity();
+                primRay.valid = true;
+            }
+        }
+        timedIntersect(thread, primRays.data(), primRays.size(), false);
+        size_t rayCount = primRays.size();
+        // 交差した一次レイのAOレイをまとめて1回で交差判定
+        // 同じ交差点のAOレイは連続して並べる。プラグインは原点が同じ区間ごとにパケットにできる
+        aoRays.clear();
+        coss.clear();
+        hitPixels.clear();
+        for (size_t ri = 0; ri < primRays.size(); ++ri)
+        {
+            const Ray& primRay = primRays[ri];
+            if (!primRay.isisect)
+            {
+                continue;
+            }
+            hitPixels.push_back(int32_t(ri / numPrimRay));
+            glm::vec3 isectPos =
+                glm::vec3(
+                    primRay.isect[0],
+                    primRay.isect[1],
+                    primRay.isect[2]);
+            const glm::vec3 ns = glm::normalize(glm::vec3(
+                primRay.ns[0],
+                primRay.ns[1],
+                primRay.ns[2]));
+            const OrthonormalBasis onb(ns);
+            //
+            for (int32_t sn = 0; sn < numAoSample; ++sn)
+            {
+                const glm::vec3 wiLocal = getHemisphere(dist01(rng), dist01(rng));
+                const glm::vec3 woWorld = onb.local2world(wiLocal);
+                coss.push_back(wiLocal.z);
+                aoRays.emplace_back();
+                auto& ray = aoRays.back();
+                ray.pos[0] = isectPos.x;
+                ray.pos[1] = isectPos.y;
+                ray.pos[2] = isectPos.z;
+                ray.dir[0] = woWorld.x;
+                ray.dir[1] = woWorld.y;
+                ray.dir[2] = woWorld.z;
+                ray.tnear = 0.001f;
+                ray.tfar = std::numeric_limits<float>::infinity();
+                ray.valid = true;
+            }
+        }
+        rayCount += aoRays.size();
+        // isect
+        if (!aoRays.empty())
+        {
+            timedIntersect(thread, aoRays.data(), aoRays.size(), true);
+        }
+        //
+        aos.assign(numPixel, 0.0f);
+        for (size_t ri = 0; ri < aoRays.size(); ++ri)
+        {
+            auto& ray = aoRays[ri];
+            aos[hitPixels[ri / numAoSample]] += (!ray.isisect) ? invNumSample * coss[ri] : 0.0f;
+        }
+        for (int32_t pi = 0; pi < numPixel; ++pi)
+        {
+            const float ao = aos[pi];
+            const size_t idx = (x0 + pi % tw) + (y0 + pi / tw) * width;
+            pixels[idx][0] = ao;
+            pixels[idx][1] = ao;
+            pixels[idx][2] = ao;
+            pixels[idx][3] = 1.0f;
+        }
+        //
+        rayCountTotal += rayCount;
+        //
+        const int32_t done = doneTile.fetch_add(1) + 1;
+        const int32_t t0 = ((done - 1) * 100 / numTile);
+        const int32_t t1 = (done * 100 / numTile);
+        if (t0 != t1)
+        {
+            fprintf(stderr, "%d%% done\n", t1);
+            renderingPercent = t1;
+        }
+    });
+    renderingPercent = 100;
+    //
+    RenderResult result;
+    result.rayCount = rayCountTotal;
+    result.timeout = timeout;
+    result.numThread = scheduler.numThread();
+    result.timeline = scheduler.timeline();
+    result.latency = std::move(latency);
+    return result;
+}
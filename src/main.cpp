@@ -4,13 +4,14 @@
 #define NOMINMAX
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
-#define TINYOBJLOADER_IMPLEMENTATION
 //
 #include "rayrun.hpp"
+#include "harness.hpp"
+#include "meshcache.hpp"
+#include "plugin.hpp"
 //
 #include "stb_image.h"
 #include "stb_image_write.h"
-#include "tiny_obj_loader.h"
 #include "picojson.h"
 #include "glm/glm.hpp"
 #include "imgui.h"
@@ -22,7 +23,6 @@
 #include <concurrent_vector.h>
 #include <d3d11.h>
 #include <tchar.h>
-#include <omp.h>
 //
 #include <cmath>
 #include <vector>
@@ -37,228 +37,6 @@
 #include <thread>
 #include <array>
 
-//
-typedef bool(*neverUseOpenMPFun)();
-
-//
-typedef void(*PreprocessFun)(
-    const float* vertices,
-    size_t numVerts,
-    const float* normals,
-    size_t numNormals,
-    const uint32_t* indices,
-    size_t numFace);
-
-typedef void(*IsectFun)(
-    Ray* rays,
-    size_t numRay,
-    bool hitany);
-
-//
-class OrthonormalBasis
-{
-public:
-    OrthonormalBasis() = default;
-    OrthonormalBasis(glm::vec3 n)
-    {
-        if (fabsf(n.x) < 0.99f)
-        {
-            s_ = glm::cross(n, glm::vec3(1.0f, 0.0f, 0.0));
-        }
-        else
-        {
-            s_ = glm::cross(n, glm::vec3(0.0f, 1.0f, 0.0f));
-        }
-        s_ = glm::normalize(s_);
-        t_ = glm::cross(s_, n);
-        n_ = n;
-
-        //
-        is_ = glm::vec3(s_.x, t_.x, n_.x);
-        it_ = glm::vec3(s_.y, t_.y, n_.y);
-        in_ = glm::vec3(s_.z, t_.z, n_.z);
-
-    }
-    glm::vec3 world2local(glm::vec3 world) const
-    {
-        return glm::vec3(
-            glm::dot(world, s_),
-            glm::dot(world, t_),
-            glm::dot(world, n_));
-    }
-    glm::vec3 local2world(glm::vec3 local) const
-    {
-        return glm::vec3(
-            glm::dot(local, is_),
-            glm::dot(local, it_),
-            glm::dot(local, in_));
-    }
-
-private:
-    glm::vec3 s_;
-    glm::vec3 t_;
-    glm::vec3 n_;
-    glm::vec3 is_;
-    glm::vec3 it_;
-    glm::vec3 in_;
-};
-
-//
-static glm::vec3 getHemisphere(float x, float y)
-{
-    const float phi = 2.0f * float(M_PI) * x;
-    const float sinPhi = std::sinf(phi);
-    const float cosPhi = std::cosf(phi);
-    const float cosTheta = 1.0f - y;
-    const float sinTheta = std::sqrtf(1 - cosTheta * cosTheta);
-    return glm::vec3(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta);
-
-}
-
-//
-static std::tuple<
-    std::vector<float>,
-    std::vector<float>,
-    std::vector<uint32_t>>
-    loadMesh(const std::string& filename)
-{
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string warn;
-    std::string err;
-    std::vector<uint32_t> indices;
-    tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename.c_str(), nullptr, true);
-
-    // 法線がない場合は生成する
-    if (attrib.normals.empty())
-    {
-        const auto& verts = attrib.vertices;
-        const int32_t numVerts = verts.size() / 3;
-        std::vector<glm::vec3> normals(numVerts, glm::vec3(0.0f, 0.0f, 0.0f));
-        for (auto& shape : shapes)
-        {
-            const auto& indices = shape.mesh.indices;
-            const int32_t numFace = indices.size() / 3;
-            for(int32_t fi=0;fi< numFace;++fi)
-            {
-                const int32_t vi0 = indices[fi * 3 + 0].vertex_index;
-                const int32_t vi1 = indices[fi * 3 + 1].vertex_index;
-                const int32_t vi2 = indices[fi * 3 + 2].vertex_index;
-                const glm::vec3 v0(verts[vi0 * 3 + 0], verts[vi0 * 3 + 1], verts[vi0 * 3 + 2]);
-                const glm::vec3 v1(verts[vi1 * 3 + 0], verts[vi1 * 3 + 1], verts[vi1 * 3 + 2]);
-                const glm::vec3 v2(verts[vi2 * 3 + 0], verts[vi2 * 3 + 1], verts[vi2 * 3 + 2]);
-                const glm::vec3 e01 = v1 - v0;
-                const glm::vec3 e02 = v2 - v0;
-                const glm::vec3 n = glm::cross(e01, e02);
-                normals[vi0] += n;
-                normals[vi1] += n;
-                normals[vi2] += n;
-            }
-            for (auto& index : shape.mesh.indices)
-            {
-                index.normal_index = index.vertex_index;
-            }
-        }
-        attrib.normals.resize(attrib.vertices.size());
-        for (int32_t ni = 0; ni < normals.size(); ++ni)
-        {
-            const glm::vec3 n = glm::normalize(normals[ni]);
-            attrib.normals[ni * 3 + 0] = n.x;
-            attrib.normals[ni * 3 + 1] = n.y;
-            attrib.normals[ni * 3 + 2] = n.z;
-        }
-    }
-
-    //
-    for (auto& shape : shapes)
-    {
-        for (auto& index : shape.mesh.indices)
-        {
-            indices.push_back(index.vertex_index);
-            indices.push_back(index.normal_index);
-        }
-    }
-    return { attrib.vertices , attrib.normals, indices };
-}
-
-//
-struct SceneSetting
-{
-public:
-    std::string model;
-    glm::vec3 pos;
-    glm::vec3 dir;
-    glm::vec3 up;
-    float fovy;
-    int32_t samplePerPixel;
-    int32_t sampleAo;
-
-public:
-    void load(const std::string& filename)
-    {
-        // JSONデータの読み込み。
-        std::ifstream file(filename, std::ios::in);
-        const std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-        file.close();
-        picojson::value root;
-        const std::string err = picojson::parse(root, json);
-        if (err != "")
-        {
-            printf("%s\n", err.c_str());
-            return;
-        }
-        //
-        const auto getV3 = [](picojson::value& obj)->glm::vec3
-        {
-            picojson::array& posArr = obj.get<picojson::array>();
-            return glm::vec3(
-                float(posArr[0].get<double>()),
-                float(posArr[1].get<double>()),
-                float(posArr[2].get<double>()) );
-        };
-        //
-        SceneSetting& SceneSetting = *this;
-        picojson::object& obj = root.get<picojson::object>();
-        SceneSetting.model = obj["model"].get<std::string>();
-        SceneSetting.pos = getV3(obj["pos"]);
-        SceneSetting.dir = glm::normalize(getV3(obj["dir"]));
-        SceneSetting.up = getV3(obj["up"]);
-        SceneSetting.fovy = float(obj["fovy"].get<double>());
-        SceneSetting.samplePerPixel = int32_t(obj["samplePerPixel"].get<double>());
-        SceneSetting.sampleAo = int32_t(obj["sampleAo"].get<double>());
-    }
-};
-
-//
-class Stopwatch
-{
-    using clock = std::chrono::system_clock;
-public:
-    void start()
-    {
-        start_ = std::chrono::system_clock::now();
-    }
-    void stop()
-    {
-        end_ = std::chrono::system_clock::now();
-    }
-    double elapsed()
-    {
-        return (double)std::chrono::duration_cast<std::chrono::milliseconds>(end_ - start_).count();
-    }
-    double elapsedNow()
-    {
-        return (double)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start_).count();
-    }
-    void print(const char* tag)
-    {
-        printf("%s %4.1fms\n", tag, elapsed());
-    }
-private:
-    clock::time_point start_;
-    clock::time_point end_;
-};
 //
 void renderingMain(
     int32_t width,
@@ -282,165 +60,58 @@ void renderingMain(
     //
     std::filesystem::path jsonpath = jsonName;
     //
-    HMODULE dll = LoadLibrary(dllName.c_str());
-    const neverUseOpenMPFun neverUseOpenMP = (neverUseOpenMPFun)GetProcAddress(dll, "neverUseOpenMP");
-    const PreprocessFun preprocess = (PreprocessFun)GetProcAddress(dll, "preprocess");
-    const IsectFun intersect = (IsectFun)GetProcAddress(dll, "intersect");
+    Plugin dll;
+    dll.load(dllName);
+    const neverUseOpenMPFun neverUseOpenMP = dll.find<neverUseOpenMPFun>("neverUseOpenMP");
+    const PreprocessFun preprocess = dll.find<PreprocessFun>("preprocess");
+    const IsectFun intersect = dll.find<IsectFun>("intersect");
+    const KernelNameFun kernelName = dll.find<KernelNameFun>("kernelName");
     const bool useOpenMP = (neverUseOpenMP != nullptr) ? !neverUseOpenMP() : true;
+    RenderOption option;
     if (!useOpenMP)
     {
-        omp_set_num_threads(1);
+        option.numThread = 1;
     }
     //
     SceneSetting setting;
     setting.load(jsonpath.string());
     //
-    const int32_t hw = width / 2;
-    const float iw = 1.0f / float(width);
-    const int32_t hh = height / 2;
-    const float ih = 1.0f / float(height);
-    const glm::vec3 dir = glm::normalize(setting.dir);
-    const glm::vec3 pos = glm::vec3(setting.pos);
-    const glm::vec3 right = glm::cross(dir, glm::normalize(setting.up));
-    const glm::vec3 up = glm::normalize(glm::cross(right, dir));
-    const float hfovy = setting.fovy * 0.5f;
-    const int32_t numPrimRay = setting.samplePerPixel;
-    const int32_t numAoSample = setting.sampleAo;
-    const float invNumSample = 1.0f / float(numAoSample*numPrimRay);
-    //
-    std::uniform_real_distribution<float> dist01(0.0f, 1.0f);
     // objをロード
     renderingState = "LOAD OBJ";
     Stopwatch swLoad;
     swLoad.start();
     auto objpath = jsonpath.parent_path();
     objpath.append(setting.model);
-    auto[vertices, normals, indices] = loadMesh(objpath.string());
+    // 2回目以降は<obj>.rrmeshをマップしてそのままpreprocess()に渡す
+    MeshCache mesh;
+    mesh.load(objpath.string());
     swLoad.stop();
     swLoad.print("Load");
     //
     renderingState = "CONSTRUCT BVH";
     Stopwatch swPreprocess;
     swPreprocess.start();
-    preprocess(vertices.data(), vertices.size() / 3, normals.data(), normals.size() / 3, indices.data(), indices.size() / 6);
+    preprocess(mesh.vertices(), mesh.numVerts(), mesh.normals(), mesh.numNormals(), mesh.indices(), mesh.numFace());
     swPreprocess.stop();
     swPreprocess.print("preprocess");
-    //
-    std::atomic<size_t> rayCountTotal = 0;
+    if (kernelName != nullptr)
+    {
+        printf("kernel %s\n", kernelName());
+    }
     //
     renderingState = "RENDERING";
     Stopwatch swIsect;
     swIsect.start();
-    std::atomic<int32_t> doneLine = 0;
-    bool timeout = false;
-#pragma omp parallel for schedule(dynamic, 16)
-    for (int32_t y = 0; y < height; ++y)
-    {
-        std::mt19937 rng(uint32_t(std::hash<int32_t>{}(y)));
-        size_t rayCount = 0;
-        //
-        std::vector<Ray> rays(setting.sampleAo);
-        std::vector<float> coss(setting.sampleAo);
-
-        // 60秒でタイムアウト
-        if (swIsect.elapsedNow() > 60000)
-        {
-            timeout = true;
-            break;
-        }
-
-        //
-        for (int32_t x = 0; x < width; ++x)
-        {
-            float ao = 0.0f;
-            for (int32_t np = 0; np < numPrimRay; ++np)
-            {
-                //
-                const float px = float(x - hw) + dist01(rng);
-                const float py = float(y - hh) + dist01(rng);
-                const float xs = px * iw * std::tanf(hfovy * float(width) / float(height));
-                const float ys = py * ih * std::tanf(hfovy);
-                const glm::vec3 rd = glm::normalize(glm::vec3(ys) * up + glm::vec3(xs) * right + dir);
-                Ray primRay;
-                primRay.pos[0] = pos.x;
-                primRay.pos[1] = pos.y;
-                primRay.pos[2] = pos.z;
-                primRay.dir[0] = rd.x;
-                primRay.dir[1] = rd.y;
-                primRay.dir[2] = rd.z;
-                primRay.tnear = 0.000f;
-                primRay.tfar = std::numeric_limits<float>::infinity();
-                primRay.valid = true;
-                intersect(&primRay, 1, false);
-                ++rayCount;
-                //
-                if (!primRay.isisect)
-                {
-                    continue;
-                }
-                glm::vec3 isectPos =
-                    glm::vec3(
-                        primRay.isect[0],
-                        primRay.isect[1],
-                        primRay.isect[2]);
-                const glm::vec3 ns = glm::normalize(glm::vec3(
-                    primRay.ns[0],
-                    primRay.ns[1],
-                    primRay.ns[2]));
-                const OrthonormalBasis onb(ns);
-                //
-                for (int32_t sn = 0; sn < numAoSample; ++sn)
-                {
-                    const glm::vec3 wiLocal = getHemisphere(dist01(rng), dist01(rng));
-                    const glm::vec3 woWorld = onb.local2world(wiLocal);
-                    coss[sn] = wiLocal.z;
-                    auto& ray = rays[sn];
-                    ray.pos[0] = isectPos.x;
-                    ray.pos[1] = isectPos.y;
-                    ray.pos[2] = isectPos.z;
-                    ray.dir[0] = woWorld.x;
-                    ray.dir[1] = woWorld.y;
-                    ray.dir[2] = woWorld.z;
-                    ray.tnear = 0.001f;
-                    ray.tfar = std::numeric_limits<float>::infinity();
-                    ray.valid = true;
-                }
-                rayCount += numAoSample;
-                // isect
-                intersect(rays.data(), numAoSample, true);
-                //
-                for (int32_t ri = 0; ri < numAoSample; ++ri)
-                {
-                    auto& ray = rays[ri];
-                    ao += (!ray.isisect) ? invNumSample * coss[ri] : 0.0f;
-                }
-            }
-            const size_t pi = (x + y * width);
-            pixels[pi][0] = ao;
-            pixels[pi][1] = ao;
-            pixels[pi][2] = ao;
-            pixels[pi][3] = 1.0f;
-        }
-        // OMPはreductionに参照型を渡せないのでここでコピー
-        rayCountTotal += rayCount;
-        //
-        const int32_t done = doneLine.fetch_add(1);
-        const int32_t t0 = ((done - 1) * 100 / height);
-        const int32_t t1 = (done * 100 / height);
-        if (t0 != t1)
-        {
-            printf("%d%% done\n", t1);
-            renderingPercent = t1;
-        }
-    }
+    const RenderResult result = renderAo(setting, option, width, height, intersect, pixels, swIsect, renderingPercent);
+    const size_t rayCountTotal = result.rayCount;
+    const bool timeout = result.timeout;
     swIsect.stop();
-    renderingPercent = 100;
     //
     swIsect.print("isect");
     const float mrays = float(double(rayCountTotal) / double(swIsect.elapsed() * 1000.0));
     printf("%.2fMRays/sec\n", mrays);
     //
-    FreeLibrary(dll);
+    dll.unload();
     //
     if (timeout)
     {
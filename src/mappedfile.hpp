@@ -0,0 +1,117 @@
+﻿//
+#pragma once
+//
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+//
+#include <cstdint>
+#include <string>
+
+// 読み込み専用でファイル全体をメモリにマップする
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile()
+    {
+        close();
+    }
+    //
+    bool open(const std::string& path)
+    {
+        close();
+#if defined(_WIN32)
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE)
+        {
+            file_ = nullptr;
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+        size_ = size_t(size.QuadPart);
+        mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        data_ = (mapping_ != nullptr) ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        size_ = size_t(st.st_size);
+        data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data_ == MAP_FAILED)
+        {
+            data_ = nullptr;
+        }
+#endif
+        if (data_ == nullptr)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+    //
+    void close()
+    {
+#if defined(_WIN32)
+        if (data_ != nullptr)
+        {
+            UnmapViewOfFile(data_);
+        }
+        if (mapping_ != nullptr)
+        {
+            CloseHandle(mapping_);
+        }
+        if (file_ != nullptr)
+        {
+            CloseHandle(file_);
+        }
+        mapping_ = nullptr;
+        file_ = nullptr;
+#else
+        if (data_ != nullptr)
+        {
+            munmap(data_, size_);
+        }
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+    //
+    const void* data() const
+    {
+        return data_;
+    }
+    size_t size() const
+    {
+        return size_;
+    }
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    HANDLE file_ = nullptr;
+    HANDLE mapping_ = nullptr;
+#endif
+};
@@ -0,0 +1,227 @@
+﻿//
+#pragma once
+//
+#include "harness.hpp"
+#include "mappedfile.hpp"
+//
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <random>
+
+// .rrmeshのヘッダ。直後に頂点座標、法線、インデックス(v0, n0, v1, n1, v2, n2...)が
+// preprocess()に渡す形式のまま続く。各区間の先頭はファイルの先頭から16バイト境界に揃え、隙間は0で埋める
+struct RRMeshHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    // 元のobjのサイズと更新時刻。一致しない場合はキャッシュを作り直す
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    uint64_t numVerts;
+    uint64_t numNormals;
+    uint64_t numFace;
+    uint64_t reserved;
+};
+static_assert(sizeof(RRMeshHeader) == 64, "RRMeshHeader must be 64 bytes");
+
+// objの隣に置いた<obj>.rrmeshをマップして使い、無いか古い場合はobjを読んで書き出す
+class MeshCache
+{
+public:
+    // objの読み方やファイルの配置を変えた場合は上げて、古いキャッシュを作り直させる
+    static constexpr uint32_t kVersion = 4;
+    // 区間の境界。交差判定の実装はインデックスを8バイト境界の構造体として読むことがあり、
+    // 頂点数と法線数の和が奇数だと4バイト境界にしかならないので、SIMDのロードにも足りる16バイトに揃える
+    static constexpr size_t kAlignment = 16;
+    //
+    bool load(const std::string& objPath)
+    {
+        vertexBuffer_.clear();
+        normalBuffer_.clear();
+        indexBuffer_.clear();
+        file_.close();
+        //
+        std::error_code ec;
+        RRMeshHeader source = {};
+        memcpy(source.magic, "RRMESH\0\0", sizeof(source.magic));
+        source.version = kVersion;
+        source.headerSize = sizeof(RRMeshHeader);
+        source.sourceSize = uint64_t(std::filesystem::file_size(objPath, ec));
+        if (ec)
+        {
+            return false;
+        }
+        source.sourceTime = int64_t(std::filesystem::last_write_time(objPath, ec).time_since_epoch().count());
+        //
+        const std::string cachePath = objPath + ".rrmesh";
+        if (map(cachePath, source))
+        {
+            cached_ = true;
+            return true;
+        }
+        //
+        cached_ = false;
+        auto[vertices, normals, indices] = loadMesh(objPath);
+        if (indices.empty())
+        {
+            return false;
+        }
+        vertexBuffer_ = std::move(vertices);
+        normalBuffer_ = std::move(normals);
+        indexBuffer_ = std::move(indices);
+        source.numVerts = vertexBuffer_.size() / 3;
+        source.numNormals = normalBuffer_.size() / 3;
+        source.numFace = indexBuffer_.size() / 6;
+        setView(vertexBuffer_.data(), source.numVerts, normalBuffer_.data(), source.numNormals, indexBuffer_.data(), source.numFace);
+        write(cachePath, source);
+        return true;
+    }
+    // キャッシュから読み込んだ場合はtrue
+    bool cached() const
+    {
+        return cached_;
+    }
+    //
+    const float* vertices() const
+    {
+        return vertices_;
+    }
+    size_t numVerts() const
+    {
+        return numVerts_;
+    }
+    const float* normals() const
+    {
+        return normals_;
+    }
+    size_t numNormals() const
+    {
+        return numNormals_;
+    }
+    const uint32_t* indices() const
+    {
+        return indices_;
+    }
+    size_t numFace() const
+    {
+        return numFace_;
+    }
+private:
+    // 区間の大きさをkAlignmentの倍数に切り上げる
+    static size_t padded(size_t size)
+    {
+        return (size + kAlignment - 1) / kAlignment * kAlignment;
+    }
+    //
+    bool map(const std::string& cachePath, const RRMeshHeader& source)
+    {
+        if (!file_.open(cachePath) || file_.size() < sizeof(RRMeshHeader))
+        {
+            file_.close();
+            return false;
+        }
+        const RRMeshHeader& header = *static_cast<const RRMeshHeader*>(file_.data());
+        // 壊れたファイルや途中で切れたファイルで掛け算があふれないように、先に個数をファイルサイズで抑える
+        const size_t fileSize = file_.size();
+        if (header.numVerts > fileSize / (3 * sizeof(float)) ||
+            header.numNormals > fileSize / (3 * sizeof(float)) ||
+            header.numFace > fileSize / (6 * sizeof(uint32_t)))
+        {
+            file_.close();
+            return false;
+        }
+        const size_t vertexOffset = sizeof(RRMeshHeader);
+        const size_t normalOffset = vertexOffset + padded(size_t(header.numVerts) * 3 * sizeof(float));
+        const size_t indexOffset = normalOffset + padded(size_t(header.numNormals) * 3 * sizeof(float));
+        const size_t expected = indexOffset + padded(size_t(header.numFace) * 6 * sizeof(uint32_t));
+        if (memcmp(header.magic, source.magic, sizeof(header.magic)) != 0 ||
+            header.version != source.version ||
+            header.headerSize != source.headerSize ||
+            header.sourceSize != source.sourceSize ||
+            header.sourceTime != source.sourceTime ||
+            fileSize != expected)
+        {
+            file_.close();
+            return false;
+        }
+        const char* base = static_cast<const char*>(file_.data());
+        const float* vertices = reinterpret_cast<const float*>(base + vertexOffset);
+        const float* normals = reinterpret_cast<const float*>(base + normalOffset);
+        const uint32_t* indices = reinterpret_cast<const uint32_t*>(base + indexOffset);
+        setView(vertices, size_t(header.numVerts), normals, size_t(header.numNormals), indices, size_t(header.numFace));
+        return true;
+    }
+    // 一時ファイルに書いてから置き換える。書けない場合はキャッシュなしで続行する
+    // 同じobjを複数のプロセスが同時に読むことがあるので、一時ファイルの名前はプロセスごとに変える
+    void write(const std::string& cachePath, const RRMeshHeader& header) const
+    {
+#if defined(_WIN32)
+        const uint64_t pid = GetCurrentProcessId();
+#else
+        const uint64_t pid = uint64_t(getpid());
+#endif
+        // 別のマシンから同じディレクトリに書く場合に備えて乱数も付ける
+        std::random_device random;
+        const std::string tmpPath = cachePath + "." + std::to_string(pid) + "." + std::to_string(random()) + ".tmp";
+        {
+            std::ofstream file(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!file)
+            {
+                return;
+            }
+            const auto writeSection = [&](const void* data, size_t size)
+            {
+                static const char zeros[kAlignment] = {};
+                file.write(static_cast<const char*>(data), size);
+                file.write(zeros, padded(size) - size);
+            };
+            writeSection(&header, sizeof(header));
+            writeSection(vertexBuffer_.data(), vertexBuffer_.size() * sizeof(float));
+            writeSection(normalBuffer_.data(), normalBuffer_.size() * sizeof(float));
+            writeSection(indexBuffer_.data(), indexBuffer_.size() * sizeof(uint32_t));
+            if (!file)
+            {
+                file.close();
+                std::error_code ec;
+                std::filesystem::remove(tmpPath, ec);
+                return;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmpPath, cachePath, ec);
+        if (ec)
+        {
+            std::filesystem::remove(tmpPath, ec);
+        }
+    }
+    //
+    void setView(
+        const float* vertices, size_t numVerts,
+        const float* normals, size_t numNormals,
+        const uint32_t* indices, size_t numFace)
+    {
+        vertices_ = vertices;
+        numVerts_ = numVerts;
+        normals_ = normals;
+        numNormals_ = numNormals;
+        indices_ = indices;
+        numFace_ = numFace;
+    }
+    //
+    MappedFile file_;
+    std::vector<float> vertexBuffer_;
+    std::vector<float> normalBuffer_;
+    std::vector<uint32_t> indexBuffer_;
+    const float* vertices_ = nullptr;
+    size_t numVerts_ = 0;
+    const float* normals_ = nullptr;
+    size_t numNormals_ = 0;
+    const uint32_t* indices_ = nullptr;
+    size_t numFace_ = 0;
+    bool cached_ = false;
+};
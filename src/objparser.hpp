@@ -0,0 +1,423 @@
+﻿//
+#pragma once
+//
+#include "mappedfile.hpp"
+#include "scheduler.hpp"
+//
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <limits>
+
+// objのv/vn/fだけを読む並列パーサ。ファイルをマップして行の境界で分割し、
+// 1パス目で各区間のレコード数を数え、その累積和の位置へ2パス目で直接書き込む。
+// インデックスはpreprocess()に渡す(v0, n0, v1, n1, v2, n2...)の形式で出力し、多角形は扇状に三角形化する
+class ObjParser
+{
+public:
+    // vnを指定していない角の法線インデックス。呼び出し側で法線を補う
+    static constexpr uint32_t kMissingNormal = ~0u;
+    // 法線を持たない角が1つでもあった場合はfalseになる
+    bool hasNormals = true;
+    // parse()が失敗した理由
+    std::string error;
+    //
+    bool parse(
+        const std::string& filename,
+        std::vector<float>& vertices,
+        std::vector<float>& normals,
+        std::vector<uint32_t>& indices,
+        int32_t numThread = 0)
+    {
+        error.clear();
+        MappedFile file;
+        if (!file.open(filename))
+        {
+            error = "cannot open " + filename;
+            return false;
+        }
+        const char* data = static_cast<const char*>(file.data());
+        const size_t size = file.size();
+        // 行の境界で区間に分割する。小さいファイルは分割しない
+        const size_t kMinChunkSize = 1 << 20;
+        if (numThread <= 0)
+        {
+            numThread = int32_t(std::max(1u, std::thread::hardware_concurrency()));
+        }
+        const size_t numChunk = std::max<size_t>(1, std::min<size_t>(numThread, size / kMinChunkSize));
+        std::vector<Chunk> chunks(numChunk);
+        for (size_t ci = 0; ci < numChunk; ++ci)
+        {
+            size_t begin = (ci == 0) ? 0 : chunks[ci - 1].end;
+            size_t end = (ci + 1 == numChunk) ? size : std::max(begin, size * (ci + 1) / numChunk);
+            while (end < size && data[end - 1] != '\n')
+            {
+                ++end;
+            }
+            chunks[ci].begin = begin;
+            chunks[ci].end = end;
+        }
+        // 1パス目: 数える。区間ごとに1スレッドを割り当てる
+        parallelFor(chunks.size(), [&](size_t begin, size_t end)
+        {
+            for (size_t ci = begin; ci < end; ++ci)
+            {
+                count(data, chunks[ci]);
+            }
+        }, int32_t(numChunk));
+        // 累積和で各区間の書き込み位置を決める
+        Chunk total;
+        for (auto& chunk : chunks)
+        {
+            const Chunk local = chunk;
+            chunk.numVerts = total.numVerts;
+            chunk.numNormals = total.numNormals;
+            chunk.numFace = total.numFace;
+            total.numVerts += local.numVerts;
+            total.numNormals += local.numNormals;
+            total.numFace += local.numFace;
+        }
+        vertices.resize(total.numVerts * 3);
+        normals.resize(total.numNormals * 3);
+        indices.resize(total.numFace * 6);
+        // 2パス目: 書き込む
+        parallelFor(chunks.size(), [&](size_t begin, size_t end)
+        {
+            for (size_t ci = begin; ci < end; ++ci)
+            {
+                fill(data, chunks[ci], vertices.data(), normals.data(), indices.data(), total.numVerts, total.numNormals);
+            }
+        }, int32_t(numChunk));
+        // 範囲外のインデックスは黙って直さずにファイルごと失敗にする。行番号はファイルの先頭から数える
+        for (const auto& chunk : chunks)
+        {
+            if (chunk.badIndex != kNoError)
+            {
+                const size_t line = size_t(std::count(data, data + chunk.badIndex, '\n')) + 1;
+                error = filename + ":" + std::to_string(line) + ": face index out of range";
+                vertices.clear();
+                normals.clear();
+                indices.clear();
+                return false;
+            }
+        }
+        hasNormals = (total.numNormals > 0);
+        for (const auto& chunk : chunks)
+        {
+            hasNormals &= !chunk.missingNormal;
+        }
+        return true;
+    }
+private:
+    //
+    struct Chunk
+    {
+        size_t begin = 0;
+        size_t end = 0;
+        // 1パス目の後はこの区間のレコード数、累積和の後は書き込み開始位置
+        size_t numVerts = 0;
+        size_t numNormals = 0;
+        size_t numFace = 0;
+        bool missingNormal = false;
+        // 範囲外のインデックスがあった最初の行の先頭位置
+        size_t badIndex = kNoError;
+    };
+    static constexpr size_t kNoError = ~size_t(0);
+    //
+    static bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+    static bool isEndOfLine(char c)
+    {
+        return c == '\n' || c == '\r';
+    }
+    //
+    static const char* skipSpace(const char* p, const char* end)
+    {
+        while (p < end && isSpace(*p))
+        {
+            ++p;
+        }
+        return p;
+    }
+    //
+    static const char* nextLine(const char* p, const char* end)
+    {
+        while (p < end && *p != '\n')
+        {
+            ++p;
+        }
+        return (p < end) ? p + 1 : end;
+    }
+    // 行の種類
+    enum Record
+    {
+        kOther,
+        kVertex,
+        kNormal,
+        kFace,
+    };
+    static Record record(const char*& p, const char* end)
+    {
+        p = skipSpace(p, end);
+        if (end - p >= 2 && p[0] == 'v' && isSpace(p[1]))
+        {
+            p += 2;
+            return kVertex;
+        }
+        if (end - p >= 3 && p[0] == 'v' && p[1] == 'n' && isSpace(p[2]))
+        {
+            p += 3;
+            return kNormal;
+        }
+        if (end - p >= 2 && p[0] == 'f' && isSpace(p[1]))
+        {
+            p += 2;
+            return kFace;
+        }
+        return kOther;
+    }
+    // fの頂点数
+    static size_t countFaceVertex(const char* p, const char* end)
+    {
+        size_t count = 0;
+        while (true)
+        {
+            p = skipSpace(p, end);
+            if (p >= end || isEndOfLine(*p) || *p == '#')
+            {
+                return count;
+            }
+            ++count;
+            while (p < end && !isSpace(*p) && !isEndOfLine(*p))
+            {
+                ++p;
+            }
+        }
+    }
+    //
+    static void count(const char* data, Chunk& chunk)
+    {
+        const char* end = data + chunk.end;
+        for (const char* p = data + chunk.begin; p < end; p = nextLine(p, end))
+        {
+            switch (record(p, end))
+            {
+            case kVertex:
+                ++chunk.numVerts;
+                break;
+            case kNormal:
+                ++chunk.numNormals;
+                break;
+            case kFace:
+                chunk.numFace += std::max<size_t>(countFaceVertex(p, end), 2) - 2;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    // 符号、整数部、小数部、指数部だけを扱う。それ以外(nan, inf, 桁数が多すぎる場合)はstrtofに任せる
+    static float parseFloat(const char*& p, const char* end)
+    {
+        static const double kPow10[] =
+        {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+            1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        p = skipSpace(p, end);
+        const char* start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negative = (*p == '-');
+            ++p;
+        }
+        uint64_t mantissa = 0;
+        int32_t digits = 0;
+        int32_t exponent = 0;
+        for (; p < end && uint32_t(*p - '0') < 10; ++p, ++digits)
+        {
+            mantissa = mantissa * 10 + uint32_t(*p - '0');
+        }
+        if (p < end && *p == '.')
+        {
+            for (++p; p < end && uint32_t(*p - '0') < 10; ++p, ++digits)
+            {
+                mantissa = mantissa * 10 + uint32_t(*p - '0');
+                --exponent;
+            }
+        }
+        if (p < end && (*p == 'e' || *p == 'E'))
+        {
+            ++p;
+            bool negativeExp = false;
+            if (p < end && (*p == '-' || *p == '+'))
+            {
+                negativeExp = (*p == '-');
+                ++p;
+            }
+            int32_t e = 0;
+            for (; p < end && uint32_t(*p - '0') < 10; ++p)
+            {
+                e = std::min(e * 10 + int32_t(*p - '0'), 9999);
+            }
+            exponent += negativeExp ? -e : e;
+        }
+        if (digits == 0 || digits > 18 || exponent < -22 || exponent > 22 ||
+            (p < end && !isSpace(*p) && !isEndOfLine(*p)))
+        {
+            // マップしたファイルは終端文字を持たないので、トークンを複写してからstrtofに渡す
+            char token[64];
+            size_t length = 0;
+            for (p = start; p < end && !isSpace(*p) && !isEndOfLine(*p); ++p)
+            {
+                if (length + 1 < sizeof(token))
+                {
+                    token[length++] = *p;
+                }
+            }
+            token[length] = '\0';
+            return strtof(token, nullptr);
+        }
+        const double value = (exponent < 0) ? double(mantissa) / kPow10[-exponent] : double(mantissa) * kPow10[exponent];
+        return float(negative ? -value : value);
+    }
+    //
+    static int64_t parseInt(const char*& p, const char* end)
+    {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negative = (*p == '-');
+            ++p;
+        }
+        // 桁が多すぎる値はあふれないように頭打ちにする(どのみち範囲外になる)
+        const int64_t kMaxValue = std::numeric_limits<int64_t>::max() / 10 - 9;
+        int64_t value = 0;
+        for (; p < end && uint32_t(*p - '0') < 10; ++p)
+        {
+            if (value < kMaxValue)
+            {
+                value = value * 10 + int64_t(*p - '0');
+            }
+        }
+        return negative ? -value : value;
+    }
+    // 1始まりのインデックスと負の相対インデックスを0始まりに直す。
+    // 32bitに切り詰める前に範囲を調べ、[0, count)に入らない場合はfalseを返す
+    static bool resolve(int64_t index, size_t current, size_t count, uint32_t& result)
+    {
+        const int64_t resolved = (index < 0) ? int64_t(current) + index : index - 1;
+        if (resolved < 0 || uint64_t(resolved) >= count || uint64_t(resolved) >= kMissingNormal)
+        {
+            return false;
+        }
+        result = uint32_t(resolved);
+        return true;
+    }
+    //
+    static void fill(
+        const char* data,
+        Chunk& chunk,
+        float* vertices,
+        float* normals,
+        uint32_t* indices,
+        size_t numVerts,
+        size_t numNormals)
+    {
+        const char* end = data + chunk.end;
+        float* v = vertices + chunk.numVerts * 3;
+        float* n = normals + chunk.numNormals * 3;
+        uint32_t* index = indices + chunk.numFace * 6;
+        size_t currentVerts = chunk.numVerts;
+        size_t currentNormals = chunk.numNormals;
+        for (const char* p = data + chunk.begin; p < end; p = nextLine(p, end))
+        {
+            const char* line = p;
+            switch (record(p, end))
+            {
+            case kVertex:
+                v[0] = parseFloat(p, end);
+                v[1] = parseFloat(p, end);
+                v[2] = parseFloat(p, end);
+                v += 3;
+                ++currentVerts;
+                break;
+            case kNormal:
+                n[0] = parseFloat(p, end);
+                n[1] = parseFloat(p, end);
+                n[2] = parseFloat(p, end);
+                n += 3;
+                ++currentNormals;
+                break;
+            case kFace:
+            {
+                // v, v/vt, v//vn, v/vt/vn
+                uint32_t first[2] = {};
+                uint32_t prev[2] = {};
+                for (size_t fv = 0;; ++fv)
+                {
+                    p = skipSpace(p, end);
+                    if (p >= end || isEndOfLine(*p) || *p == '#')
+                    {
+                        break;
+                    }
+                    uint32_t vn[2] = { 0, kMissingNormal };
+                    bool inRange = resolve(parseInt(p, end), currentVerts, numVerts, vn[0]);
+                    bool hasNormal = false;
+                    if (p < end && *p == '/')
+                    {
+                        ++p;
+                        parseInt(p, end);
+                        if (p < end && *p == '/')
+                        {
+                            ++p;
+                            hasNormal = true;
+                            const bool normalInRange = resolve(parseInt(p, end), currentNormals, numNormals, vn[1]);
+                            inRange = inRange && normalInRange;
+                        }
+                    }
+                    while (p < end && !isSpace(*p) && !isEndOfLine(*p))
+                    {
+                        ++p;
+                    }
+                    if (!inRange)
+                    {
+                        chunk.badIndex = std::min(chunk.badIndex, size_t(line - data));
+                    }
+                    if (!hasNormal)
+                    {
+                        chunk.missingNormal = true;
+                    }
+                    if (fv == 0)
+                    {
+                        first[0] = vn[0];
+                        first[1] = vn[1];
+                    }
+                    else if (fv >= 2)
+                    {
+                        index[0] = first[0];
+                        index[1] = first[1];
+                        index[2] = prev[0];
+                        index[3] = prev[1];
+                        index[4] = vn[0];
+                        index[5] = vn[1];
+                        index += 6;
+                    }
+                    prev[0] = vn[0];
+                    prev[1] = vn[1];
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+};
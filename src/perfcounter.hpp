@@ -0,0 +1,273 @@
+﻿//
+#pragma once
+//
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <unistd.h>
+#endif
+//
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <vector>
+
+// ハードウェアカウンタ(Linuxのperf_event_open)。開いた時点で/proc/self/taskにある全てのスレッドに
+// それぞれカウンタを開き、スレッドごとの値と合計を返す。スレッドごとの5つのカウンタはcyclesを先頭にした
+// 1つのグループとして開くので、多重化されても同じ時間で数えられ、比(IPCなど)が意味を持つ。
+// inheritを指定するので、開いた後に作られたスレッド(プラグインのスレッドプールなど)は作ったスレッドの
+// カウンタに含まれる。スレッドごとに分けて数えたいスレッドは開く前に作っておくこと。
+// Linux以外、または権限がない場合は何も数えない
+class PerfCounters
+{
+public:
+    enum Event
+    {
+        kCycles,
+        kInstructions,
+        kLLCMisses,
+        kBranchMisses,
+        kDTLBMisses,
+        kNumEvent,
+    };
+    //
+    struct Counts
+    {
+        std::array<uint64_t, kNumEvent> values = {};
+        // 開けなかった、または一度も動かなかったカウンタはfalse
+        std::array<bool, kNumEvent> valid = {};
+        //
+        Counts operator-(const Counts& rhs) const
+        {
+            Counts result;
+            for (int32_t ei = 0; ei < kNumEvent; ++ei)
+            {
+                result.valid[ei] = valid[ei] && rhs.valid[ei];
+                result.values[ei] = result.valid[ei] ? values[ei] - rhs.values[ei] : 0;
+            }
+            return result;
+        }
+        //
+        Counts& operator+=(const Counts& rhs)
+        {
+            for (int32_t ei = 0; ei < kNumEvent; ++ei)
+            {
+                values[ei] += rhs.values[ei];
+                valid[ei] = valid[ei] || rhs.valid[ei];
+            }
+            return *this;
+        }
+    };
+    //
+    struct Sample
+    {
+        // 全スレッドの合計
+        Counts total;
+        // threads()と同じ順のスレッドごとの値
+        std::vector<Counts> threads;
+        //
+        Sample operator-(const Sample& rhs) const
+        {
+            Sample result;
+            result.total = total - rhs.total;
+            result.threads.resize(std::min(threads.size(), rhs.threads.size()));
+            for (size_t ti = 0; ti < result.threads.size(); ++ti)
+            {
+                result.threads[ti] = threads[ti] - rhs.threads[ti];
+            }
+            return result;
+        }
+    };
+    //
+    PerfCounters() = default;
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    ~PerfCounters()
+    {
+        close();
+    }
+    //
+    static const char* name(int32_t event)
+    {
+        static const char* kNames[kNumEvent] =
+        {
+            "cycles",
+            "instructions",
+            "llc_misses",
+            "branch_misses",
+            "dtlb_misses",
+        };
+        return kNames[event];
+    }
+    // 1つでも開けた場合はtrue
+    bool open()
+    {
+        close();
+        bool opened = false;
+#if defined(__linux__)
+        // 開く前から生きているスレッドはinheritでは数えられないので、スレッドごとに開く
+        std::vector<int32_t> tids;
+        if (DIR* dir = opendir("/proc/self/task"))
+        {
+            while (const dirent* entry = readdir(dir))
+            {
+                const int32_t tid = atoi(entry->d_name);
+                if (tid > 0)
+                {
+                    tids.push_back(tid);
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(tids.begin(), tids.end());
+        if (tids.empty())
+        {
+            tids.push_back(0);
+        }
+        const uint32_t types[kNumEvent] =
+        {
+            PERF_TYPE_HARDWARE,
+            PERF_TYPE_HARDWARE,
+            PERF_TYPE_HW_CACHE,
+            PERF_TYPE_HARDWARE,
+            PERF_TYPE_HW_CACHE,
+        };
+        const uint64_t configs[kNumEvent] =
+        {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            // PERF_COUNT_HW_CACHE_MISSESは数えるキャッシュがCPUによって異なるので、LLCの読み込みミスを明示する
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        };
+        for (const int32_t tid : tids)
+        {
+            // 最初に開けたカウンタ(通常はcycles)をリーダーにし、残りは同じグループに入れる。
+            // 同時に載せられないカウンタは開くときに失敗するので、そのカウンタだけ無効にする
+            Task task;
+            task.tid = tid;
+            task.main = (tid == 0 || tid == int32_t(getpid()));
+            int32_t leader = -1;
+            for (int32_t ei = 0; ei < kNumEvent; ++ei)
+            {
+                perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = types[ei];
+                attr.config = configs[ei];
+                attr.inherit = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                const int32_t fd = int32_t(syscall(SYS_perf_event_open, &attr, tid, -1, leader, 0));
+                if (fd < 0)
+                {
+                    continue;
+                }
+                if (leader < 0)
+                {
+                    leader = fd;
+                }
+                else
+                {
+                    task.fds.push_back(fd);
+                }
+                task.slots[ei] = task.numMember++;
+            }
+            // 一覧を読んだ後に終了したスレッドは開けないので飛ばす
+            if (leader >= 0)
+            {
+                task.fds.insert(task.fds.begin(), leader);
+                tasks_.push_back(task);
+                opened = true;
+            }
+        }
+#endif
+        return opened;
+    }
+    //
+    void close()
+    {
+#if defined(__linux__)
+        for (auto& task : tasks_)
+        {
+            // リーダーは最後に閉じる
+            for (auto fd = task.fds.rbegin(); fd != task.fds.rend(); ++fd)
+            {
+                ::close(*fd);
+            }
+        }
+#endif
+        tasks_.clear();
+    }
+    // カウンタを開いたスレッド。Sample::threadsと同じ順
+    struct Thread
+    {
+        int32_t tid = 0;
+        // プロセスの最初のスレッド(mainを実行しているスレッド)ならtrue
+        bool main = false;
+    };
+    std::vector<Thread> threads() const
+    {
+        std::vector<Thread> result;
+        for (const auto& task : tasks_)
+        {
+            Thread thread;
+            thread.tid = task.tid;
+            thread.main = task.main;
+            result.push_back(thread);
+        }
+        return result;
+    }
+    // スレッドごとの現在までの累積値と合計。多重化されていた場合はグループが有効だった時間の割合で補正する。
+    // 終了したスレッドのカウンタも最後の値を返すので、合計が減ることはない
+    Sample read() const
+    {
+        Sample sample;
+        sample.threads.resize(tasks_.size());
+#if defined(__linux__)
+        for (size_t ti = 0; ti < tasks_.size(); ++ti)
+        {
+            const Task& task = tasks_[ti];
+            // nr, time_enabled, time_running, value[nr]
+            uint64_t data[3 + kNumEvent] = {};
+            const ssize_t size = ssize_t((3 + task.numMember) * sizeof(uint64_t));
+            // 一度も動いていないスレッド(enabledが0)は0回と数え、動いたのにカウンタが一度も載らなかった場合だけ無効にする
+            if (::read(task.fds[0], data, size) != size || data[0] != uint64_t(task.numMember) || (data[1] != 0 && data[2] == 0))
+            {
+                continue;
+            }
+            const double scale = (data[2] != 0) ? double(data[1]) / double(data[2]) : 0.0;
+            Counts& counts = sample.threads[ti];
+            for (int32_t ei = 0; ei < kNumEvent; ++ei)
+            {
+                if (task.slots[ei] < 0)
+                {
+                    continue;
+                }
+                counts.values[ei] = uint64_t(double(data[3 + task.slots[ei]]) * scale);
+                counts.valid[ei] = true;
+            }
+            sample.total += counts;
+        }
+#endif
+        return sample;
+    }
+private:
+    struct Task
+    {
+        int32_t tid = 0;
+        bool main = false;
+        // 先頭がグループのリーダー
+        std::vector<int32_t> fds;
+        // イベントごとのグループ内の位置(開けなかった場合は-1)
+        std::array<int32_t, kNumEvent> slots = { -1, -1, -1, -1, -1 };
+        int32_t numMember = 0;
+    };
+    std::vector<Task> tasks_;
+};
@@ -0,0 +1,81 @@
+﻿//
+#pragma once
+//
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+//
+#include <string>
+
+// 交差判定の実装(dll/so)の読み込み。WindowsではLoadLibrary、それ以外ではdlopenを使う
+class Plugin
+{
+public:
+    Plugin() = default;
+    Plugin(const Plugin&) = delete;
+    Plugin& operator=(const Plugin&) = delete;
+    ~Plugin()
+    {
+        unload();
+    }
+    //
+    bool load(const std::string& path)
+    {
+        unload();
+        // 解放してもアンマップされないように固定する。交差判定の実装が常駐スレッドやthread_localを
+        // 持っていても、それらが実行中のコードを消さずに済む。後始末はプロセス終了時の静的デストラクタに任せる
+#if defined(_WIN32)
+        handle_ = (void*)LoadLibrary(path.c_str());
+        HMODULE pinned = nullptr;
+        if (handle_ != nullptr)
+        {
+            GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_PIN, path.c_str(), &pinned);
+        }
+#else
+        handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL | RTLD_NODELETE);
+#endif
+        return handle_ != nullptr;
+    }
+    // ハンドルを手放す。読み込んだものはプロセス終了までメモリに残る
+    void unload()
+    {
+        if (handle_ == nullptr)
+        {
+            return;
+        }
+#if defined(_WIN32)
+        FreeLibrary((HMODULE)handle_);
+#else
+        dlclose(handle_);
+#endif
+        handle_ = nullptr;
+    }
+    // 関数が存在しない場合はnullptrを返す
+    template<typename Fun>
+    Fun find(const char* name) const
+    {
+        if (handle_ == nullptr)
+        {
+            return nullptr;
+        }
+#if defined(_WIN32)
+        return (Fun)GetProcAddress((HMODULE)handle_, name);
+#else
+        return (Fun)dlsym(handle_, name);
+#endif
+    }
+    //
+    std::string error() const
+    {
+#if defined(_WIN32)
+        return "error " + std::to_string(GetLastError());
+#else
+        const char* err = dlerror();
+        return (err != nullptr) ? err : "";
+#endif
+    }
+private:
+    void* handle_ = nullptr;
+};
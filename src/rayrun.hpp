@@ -1,6 +1,7 @@
 ﻿#pragma once
 //
 #include <cstdint>
+#include <cstddef>
 //　レイ
 struct alignas(16) Ray
 {
@@ -29,12 +30,19 @@ public:
 };
 static_assert(sizeof(Ray) == 144);
 
+// 公開する関数。Windows以外ではsoとしてビルドする
+#if defined(_WIN32)
+#define RAYRUN_EXPORT extern "C" __declspec(dllexport)
+#else
+#define RAYRUN_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
 // 呼び出し側でOpenMPを使わないように要請する場合はtrueを返す
 // 関数が存在しない場合はfalseを返したとします
-extern "C" __declspec(dllexport) bool neverUseOpenMP();
+RAYRUN_EXPORT bool neverUseOpenMP();
 
 // メッシュの生成
-extern "C" __declspec(dllexport) void preprocess(
+RAYRUN_EXPORT void preprocess(
     // 頂点座標配列
     const float* vertices,
     // 頂点数
@@ -50,7 +58,7 @@ extern "C" __declspec(dllexport) void preprocess(
     size_t numFace);
 
 // 交差判定
-extern "C" __declspec(dllexport) void intersect(
+RAYRUN_EXPORT void intersect(
     // レイ配列
     Ray* rays,
     // レイ数
@@ -0,0 +1,217 @@
+﻿//
+#pragma once
+//
+#include "rayrun.hpp"
+#include "mappedfile.hpp"
+//
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+
+// intersect()に渡したレイのバッチと、その時の結果を記録したファイル(.rrtrace)の形式。
+// ヘッダの後に、バッチごとにRRTraceBatch、入力(RRTraceRay)の配列、結果(RRTraceHit)の配列が続く
+struct RRTraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    // 記録したメッシュの頂点数と面数。再生時に同じメッシュかを確かめる
+    uint64_t numVerts;
+    uint64_t numFace;
+    uint64_t numBatch;
+    uint64_t numRay;
+    uint64_t reserved[2];
+};
+static_assert(sizeof(RRTraceHeader) == 64, "RRTraceHeader must be 64 bytes");
+
+//
+struct RRTraceBatch
+{
+    uint32_t thread;
+    uint32_t hitAny;
+    uint64_t rayCount;
+};
+static_assert(sizeof(RRTraceBatch) == 16, "RRTraceBatch must be 16 bytes");
+
+//
+struct RRTraceRay
+{
+    float pos[3];
+    float dir[3];
+    float tnear;
+    float tfar;
+    uint32_t valid;
+};
+static_assert(sizeof(RRTraceRay) == 36, "RRTraceRay must be 36 bytes");
+
+//
+struct RRTraceHit
+{
+    uint32_t isisect;
+    int32_t faceid;
+    float isect[3];
+};
+static_assert(sizeof(RRTraceHit) == 20, "RRTraceHit must be 20 bytes");
+
+//
+static constexpr uint32_t kRRTraceVersion = 1;
+
+// 複数のスレッドから呼ばれるので、バッチ単位で排他して書き込む
+class RayTraceWriter
+{
+public:
+    bool open(const std::string& path, size_t numVerts, size_t numFace)
+    {
+        memset(&header_, 0, sizeof(header_));
+        memcpy(header_.magic, "RRTRACE\0", sizeof(header_.magic));
+        header_.version = kRRTraceVersion;
+        header_.headerSize = sizeof(RRTraceHeader);
+        header_.numVerts = numVerts;
+        header_.numFace = numFace;
+        file_.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+        return bool(file_);
+    }
+    // 交差判定の前にレイを写しておく
+    static void capture(const Ray* rays, size_t rayCount, std::vector<RRTraceRay>& inputs)
+    {
+        inputs.resize(rayCount);
+        for (size_t ri = 0; ri < rayCount; ++ri)
+        {
+            const Ray& ray = rays[ri];
+            RRTraceRay& input = inputs[ri];
+            memcpy(input.pos, ray.pos, sizeof(input.pos));
+            memcpy(input.dir, ray.dir, sizeof(input.dir));
+            input.tnear = ray.tnear;
+            input.tfar = ray.tfar;
+            input.valid = ray.valid ? 1 : 0;
+        }
+    }
+    // 交差判定の後に入力と結果を書き込む
+    void write(uint32_t thread, bool hitAny, const std::vector<RRTraceRay>& inputs, const Ray* rays, std::vector<RRTraceHit>& hits)
+    {
+        const size_t rayCount = inputs.size();
+        hits.resize(rayCount);
+        for (size_t ri = 0; ri < rayCount; ++ri)
+        {
+            const Ray& ray = rays[ri];
+            RRTraceHit& hit = hits[ri];
+            hit.isisect = ray.isisect ? 1 : 0;
+            hit.faceid = ray.isisect ? ray.faceid : -1;
+            for (int32_t k = 0; k < 3; ++k)
+            {
+                hit.isect[k] = ray.isisect ? ray.isect[k] : 0.0f;
+            }
+        }
+        RRTraceBatch batch;
+        batch.thread = thread;
+        batch.hitAny = hitAny ? 1 : 0;
+        batch.rayCount = rayCount;
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_.write(reinterpret_cast<const char*>(&batch), sizeof(batch));
+        file_.write(reinterpret_cast<const char*>(inputs.data()), rayCount * sizeof(RRTraceRay));
+        file_.write(reinterpret_cast<const char*>(hits.data()), rayCount * sizeof(RRTraceHit));
+        ++header_.numBatch;
+        header_.numRay += rayCount;
+    }
+    // ヘッダのバッチ数とレイ数を書き直して閉じる
+    bool close()
+    {
+        file_.seekp(0);
+        file_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+        file_.close();
+        return !file_.fail();
+    }
+private:
+    std::ofstream file_;
+    std::mutex mutex_;
+    RRTraceHeader header_ = {};
+};
+
+// .rrtraceをマップしてバッチの位置を引けるようにする
+class RayTraceReader
+{
+public:
+    struct Batch
+    {
+        uint32_t thread;
+        bool hitAny;
+        size_t rayCount;
+        const RRTraceRay* rays;
+        const RRTraceHit* hits;
+    };
+    //
+    bool open(const std::string& path)
+    {
+        batches_.clear();
+        if (!file_.open(path) || file_.size() < sizeof(RRTraceHeader))
+        {
+            return false;
+        }
+        const char* data = static_cast<const char*>(file_.data());
+        memcpy(&header_, data, sizeof(header_));
+        if (memcmp(header_.magic, "RRTRACE\0", sizeof(header_.magic)) != 0 ||
+            header_.version != kRRTraceVersion ||
+            header_.headerSize != sizeof(RRTraceHeader))
+        {
+            return false;
+        }
+        size_t offset = sizeof(RRTraceHeader);
+        for (uint64_t bi = 0; bi < header_.numBatch; ++bi)
+        {
+            if (offset + sizeof(RRTraceBatch) > file_.size())
+            {
+                return false;
+            }
+            RRTraceBatch record;
+            memcpy(&record, data + offset, sizeof(record));
+            offset += sizeof(RRTraceBatch);
+            const size_t size = size_t(record.rayCount) * (sizeof(RRTraceRay) + sizeof(RRTraceHit));
+            if (offset + size > file_.size())
+            {
+                return false;
+            }
+            Batch batch;
+            batch.thread = record.thread;
+            batch.hitAny = (record.hitAny != 0);
+            batch.rayCount = size_t(record.rayCount);
+            batch.rays = reinterpret_cast<const RRTraceRay*>(data + offset);
+            batch.hits = reinterpret_cast<const RRTraceHit*>(data + offset + batch.rayCount * sizeof(RRTraceRay));
+            batches_.push_back(batch);
+            offset += size;
+        }
+        return true;
+    }
+    //
+    const RRTraceHeader& header() const
+    {
+        return header_;
+    }
+    const std::vector<Batch>& batches() const
+    {
+        return batches_;
+    }
+    // 記録したレイをRayに戻す
+    static void restore(const Batch& batch, std::vector<Ray>& rays)
+    {
+        rays.resize(batch.rayCount);
+        for (size_t ri = 0; ri < batch.rayCount; ++ri)
+        {
+            const RRTraceRay& input = batch.rays[ri];
+            Ray& ray = rays[ri];
+            memset(&ray, 0, sizeof(ray));
+            memcpy(ray.pos, input.pos, sizeof(ray.pos));
+            memcpy(ray.dir, input.dir, sizeof(ray.dir));
+            ray.tnear = input.tnear;
+            ray.tfar = input.tfar;
+            ray.valid = (input.valid != 0);
+        }
+    }
+private:
+    MappedFile file_;
+    RRTraceHeader header_ = {};
+    std::vector<Batch> batches_;
+};
@@ -1,9 +1,13 @@
 ﻿//
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
+#if defined(_WIN32)
 #include <windows.h>
+#endif
 //
 #include <cstdint>
+#include <cmath>
+#include <algorithm>
 #include <cstdio>
 #include <limits>
 #include <vector>
@@ -11,6 +15,7 @@
 //
 #include "rayrun.hpp"
 
+#if defined(_WIN32)
 //
 BOOL APIENTRY DllMain(HMODULE hModule,
     DWORD  ul_reason_for_call,
@@ -27,6 +32,7 @@ BOOL APIENTRY DllMain(HMODULE hModule,
     }
     return TRUE;
 }
+#endif
 
 //
 bool neverUseOpenMP()
@@ -216,7 +222,7 @@ public:
         mn = Vec3::min(aabb.mn, mn);
         mx = Vec3::max(aabb.mx, mx);
     }
-    const Vec3& AABB::operator[](int32_t index) const
+    const Vec3& operator[](int32_t index) const
     {
         return *(&mn + index);
     }
@@ -0,0 +1,233 @@
+﻿//
+#define _USE_MATH_DEFINES
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+//
+#include "rayrun.hpp"
+#include "harness.hpp"
+#include "meshcache.hpp"
+#include "plugin.hpp"
+#include "raytrace.hpp"
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <filesystem>
+
+// rayrun_bench -cで記録したレイのバッチをそのままintersect()に渡し、計測と結果の比較を行う
+// rayrun_replay <plugin> <scene.json> <trace.rrtrace> [-o result.json] [-t threads]
+// シーンはpreprocess()に渡すメッシュのためだけに使う
+
+//
+int main(int argc, char** argv)
+{
+    // 標準出力にはJSONだけを出す。経過や診断は標準エラーに出す
+    const auto usage = [&]()
+    {
+        fprintf(stderr, "usage: %s <plugin> <scene.json> <trace.rrtrace> [-o result.json] [-t threads]\n", argv[0]);
+        return 1;
+    };
+    if (argc < 4)
+    {
+        return usage();
+    }
+    const std::string pluginName = argv[1];
+    const std::string jsonName = argv[2];
+    const std::string traceName = argv[3];
+    std::string outputName;
+    int32_t numThread = 0;
+    for (int32_t ai = 4; ai < argc; ai += 2)
+    {
+        if (ai + 1 >= argc)
+        {
+            fprintf(stderr, "missing value for %s\n", argv[ai]);
+            return usage();
+        }
+        if (strcmp(argv[ai], "-o") == 0)
+        {
+            outputName = argv[ai + 1];
+        }
+        else if (strcmp(argv[ai], "-t") == 0)
+        {
+            numThread = atoi(argv[ai + 1]);
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[ai]);
+            return usage();
+        }
+    }
+    //
+    RayTraceReader trace;
+    if (!trace.open(traceName))
+    {
+        fprintf(stderr, "failed to read %s\n", traceName.c_str());
+        return 1;
+    }
+    //
+    Plugin plugin;
+    if (!plugin.load(pluginName))
+    {
+        fprintf(stderr, "failed to load %s (%s)\n", pluginName.c_str(), plugin.error().c_str());
+        return 1;
+    }
+    const neverUseOpenMPFun neverUseOpenMP = plugin.find<neverUseOpenMPFun>("neverUseOpenMP");
+    const PreprocessFun preprocess = plugin.find<PreprocessFun>("preprocess");
+    const IsectFun intersect = plugin.find<IsectFun>("intersect");
+    const KernelNameFun kernelName = plugin.find<KernelNameFun>("kernelName");
+    if (preprocess == nullptr || intersect == nullptr)
+    {
+        fprintf(stderr, "%s does not export preprocess/intersect\n", pluginName.c_str());
+        return 1;
+    }
+    const bool useOpenMP = (neverUseOpenMP != nullptr) ? !neverUseOpenMP() : true;
+    if (!useOpenMP)
+    {
+        numThread = 1;
+    }
+    if (numThread <= 0)
+    {
+        numThread = int32_t(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    //
+    const std::filesystem::path jsonpath = jsonName;
+    SceneSetting setting;
+    setting.load(jsonpath.string());
+    auto objpath = jsonpath.parent_path();
+    objpath.append(setting.model);
+    MeshCache mesh;
+    mesh.load(objpath.string());
+    if (mesh.numVerts() != trace.header().numVerts || mesh.numFace() != trace.header().numFace)
+    {
+        fprintf(stderr, "%s was not recorded with %s\n", traceName.c_str(), objpath.string().c_str());
+        return 1;
+    }
+    //
+    Stopwatch swPreprocess;
+    swPreprocess.start();
+    preprocess(mesh.vertices(), mesh.numVerts(), mesh.normals(), mesh.numNormals(), mesh.indices(), mesh.numFace());
+    swPreprocess.stop();
+    swPreprocess.print("preprocess");
+    const std::string kernel = (kernelName != nullptr) ? kernelName() : "";
+    if (!kernel.empty())
+    {
+        fprintf(stderr, "kernel %s\n", kernel.c_str());
+    }
+    // 計測にレイの展開が入らないように、全てのバッチを先にRayの配列に戻しておく
+    const auto& batches = trace.batches();
+    std::vector<std::vector<Ray>> rays(batches.size());
+    Stopwatch swRestore;
+    swRestore.start();
+    parallelFor(batches.size(), [&](size_t begin, size_t end)
+    {
+        for (size_t bi = begin; bi < end; ++bi)
+        {
+            RayTraceReader::restore(batches[bi], rays[bi]);
+        }
+    }, numThread);
+    swRestore.stop();
+    swRestore.print("restore");
+    // バッチを先頭から順に取り出して再生する。記録時のスレッドの割り当ては使わない
+    std::atomic<size_t> nextBatch(0);
+    std::vector<uint64_t> isectNs(numThread, 0);
+    Stopwatch swReplay;
+    swReplay.start();
+    parallelFor(size_t(numThread), [&](size_t begin, size_t end)
+    {
+        for (size_t ti = begin; ti < end; ++ti)
+        {
+            for (size_t bi = nextBatch++; bi < batches.size(); bi = nextBatch++)
+            {
+                const auto t0 = std::chrono::steady_clock::now();
+                intersect(rays[bi].data(), rays[bi].size(), batches[bi].hitAny);
+                const auto t1 = std::chrono::steady_clock::now();
+                isectNs[ti] += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+            }
+        }
+    }, numThread);
+    swReplay.stop();
+    swReplay.print("replay");
+    // 記録した結果との比較。交差位置は面の境界で別の面を返すことがあるのでfaceidではなく位置で比べる
+    std::atomic<size_t> totalMismatches(0);
+    std::atomic<size_t> totalPositionMismatches(0);
+    parallelFor(batches.size(), [&](size_t begin, size_t end)
+    {
+        size_t mismatches = 0;
+        size_t positionMismatches = 0;
+        for (size_t bi = begin; bi < end; ++bi)
+        {
+            const auto& batch = batches[bi];
+            for (size_t ri = 0; ri < batch.rayCount; ++ri)
+            {
+                const Ray& ray = rays[bi][ri];
+                const RRTraceHit& hit = batch.hits[ri];
+                if (ray.isisect != (hit.isisect != 0))
+                {
+                    ++mismatches;
+                    continue;
+                }
+                if (!ray.isisect || batch.hitAny)
+                {
+                    continue;
+                }
+                float diff = 0.0f;
+                float scale = 1.0f;
+                for (int32_t k = 0; k < 3; ++k)
+                {
+                    diff += std::abs(ray.isect[k] - hit.isect[k]);
+                    scale += std::abs(hit.isect[k]);
+                }
+                if (diff > 1e-4f * scale)
+                {
+                    ++positionMismatches;
+                }
+            }
+        }
+        totalMismatches += mismatches;
+        totalPositionMismatches += positionMismatches;
+    }, numThread);
+    //
+    plugin.unload();
+    //
+    const size_t rayCount = size_t(trace.header().numRay);
+    const double mrays = double(rayCount) / (swReplay.elapsed() * 1000.0);
+    fprintf(stderr, "%.2fMRays/sec\n", mrays);
+    uint64_t totalIsectNs = 0;
+    for (int32_t ti = 0; ti < numThread; ++ti)
+    {
+        totalIsectNs += isectNs[ti];
+    }
+    fprintf(stderr, "mismatch %zu (position %zu)\n", totalMismatches.load(), totalPositionMismatches.load());
+    // 計測結果
+    picojson::object stats;
+    stats["plugin"] = picojson::value(pluginName);
+    stats["scene"] = picojson::value(jsonName);
+    stats["trace"] = picojson::value(traceName);
+    stats["kernel"] = picojson::value(kernel);
+    stats["threads"] = picojson::value(double(numThread));
+    stats["batches"] = picojson::value(double(batches.size()));
+    stats["rays"] = picojson::value(double(rayCount));
+    stats["preprocess_ms"] = picojson::value(swPreprocess.elapsed());
+    stats["restore_ms"] = picojson::value(swRestore.elapsed());
+    stats["replay_ms"] = picojson::value(swReplay.elapsed());
+    // 全スレッドでintersect()の中にいた時間の合計
+    stats["isect_ms"] = picojson::value(double(totalIsectNs) / 1e6);
+    stats["mrays_per_sec"] = picojson::value(mrays);
+    stats["mismatches"] = picojson::value(double(totalMismatches.load()));
+    stats["position_mismatches"] = picojson::value(double(totalPositionMismatches.load()));
+    const std::string json = picojson::value(stats).serialize(true);
+    if (outputName.empty())
+    {
+        printf("%s", json.c_str());
+    }
+    else
+    {
+        std::ofstream file(outputName, std::ios::out);
+        file << json;
+    }
+    return (totalMismatches.load() == 0) ? 0 : 3;
+}
@@ -0,0 +1,351 @@
+﻿//
+#pragma once
+//
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+// 常駐するワーカースレッド。run()のたびにスレッドを作らず、足りない分だけ増やして使い回す。
+// ワーカーの中から呼ばれたrun()は入れ子とみなし、呼び出し元のスレッドだけで順に処理する
+class WorkerThreads
+{
+public:
+    static WorkerThreads& instance()
+    {
+        static WorkerThreads workers;
+        return workers;
+    }
+    // task(i)を[0, numTask)について呼び、全て終わるまで待つ。呼び出し元のスレッドも処理に加わる。
+    // ワーカーはnumTask - 1個まで増やすので、各タスクは別々のスレッドで同時に動ける
+    template<typename Task>
+    void run(size_t numTask, Task&& task)
+    {
+        if (numTask <= 1 || inside())
+        {
+            for (size_t i = 0; i < numTask; ++i)
+            {
+                task(i);
+            }
+            return;
+        }
+        const std::function<void(size_t)> fun = task;
+        Job job;
+        job.fun = &fun;
+        job.count = numTask;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            grow(numTask);
+            jobs_.push_back(&job);
+        }
+        wake_.notify_all();
+        // 呼び出し元も未着手のタスクを取って処理する
+        inside() = true;
+        size_t index = 0;
+        while (claim(job, index))
+        {
+            fun(index);
+            finish(job);
+        }
+        inside() = false;
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&]() { return job.done == job.count; });
+        jobs_.erase(std::find(jobs_.begin(), jobs_.end(), &job));
+    }
+    // 呼び出し元を含めてnumThread個のスレッドで動けるだけのワーカーを先に作っておく。
+    // スレッドごとにハードウェアカウンタを開く場合などに、計測の前にスレッドを揃えるために使う
+    void reserve(size_t numThread)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        grow(numThread);
+    }
+private:
+    struct Job
+    {
+        const std::function<void(size_t)>* fun = nullptr;
+        size_t count = 0;
+        size_t next = 0;
+        size_t done = 0;
+    };
+    //
+    WorkerThreads() = default;
+    WorkerThreads(const WorkerThreads&) = delete;
+    WorkerThreads& operator=(const WorkerThreads&) = delete;
+    // プロセス終了時にワーカーを起こして終了を待つ
+    ~WorkerThreads()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            exit_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_)
+        {
+            thread.join();
+        }
+    }
+    //
+    static bool& inside()
+    {
+        static thread_local bool value = false;
+        return value;
+    }
+    // ジョブはrun()のスタックにあるので、取り出しと完了の記録はmutex_の中で行う
+    bool claim(Job& job, size_t& index)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (job.next >= job.count)
+        {
+            return false;
+        }
+        index = job.next++;
+        return true;
+    }
+    //
+    void finish(Job& job)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (++job.done == job.count)
+        {
+            done_.notify_all();
+        }
+    }
+    // mutex_の中で呼ぶ
+    void grow(size_t numThread)
+    {
+        while (threads_.size() + 1 < numThread)
+        {
+            threads_.emplace_back([this]() { loop(); });
+        }
+    }
+    //
+    Job* findJob() const
+    {
+        for (Job* job : jobs_)
+        {
+            if (job->next < job->count)
+            {
+                return job;
+            }
+        }
+        return nullptr;
+    }
+    // 未着手のタスクが来るまで眠り、1つずつ取って処理する
+    void loop()
+    {
+        inside() = true;
+        for (;;)
+        {
+            Job* job = nullptr;
+            size_t index = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&]() { return exit_ || (job = findJob()) != nullptr; });
+                if (exit_)
+                {
+                    return;
+                }
+                index = job->next++;
+            }
+            (*job->fun)(index);
+            finish(*job);
+        }
+    }
+    //
+    std::vector<std::thread> threads_;
+    std::vector<Job*> jobs_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool exit_ = false;
+};
+
+// [0, count)をスレッド数で等分し、fun(begin, end)を並列に呼ぶ。呼び出し元のスレッドも処理に加わる。
+// スレッドは常駐するWorkerThreadsを使い回す
+template<typename Fun>
+inline void parallelFor(size_t count, Fun&& fun, int32_t numThread = 0)
+{
+    if (numThread <= 0)
+    {
+        numThread = int32_t(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    const size_t numRange = std::max<size_t>(1, std::min<size_t>(numThread, count));
+    WorkerThreads::instance().run(numRange, [&](size_t ri)
+    {
+        fun(count * ri / numRange, count * (ri + 1) / numRange);
+    });
+}
+
+// 1タイルを処理した区間。時刻はrun()の開始からのマイクロ秒
+struct TileSpan
+{
+    int32_t tile = 0;
+    int64_t begin = 0;
+    int64_t end = 0;
+};
+
+// スレッドごとのタイムライン。spansの隙間がアイドル時間
+struct ThreadTimeline
+{
+    std::vector<TileSpan> spans;
+    int32_t steals = 0;
+    int64_t busy = 0;
+    int64_t finish = 0;
+};
+
+// Morton順に並べたタイルをスレッドごとのdequeに分配し、
+// 自分のdequeが空になったら他のスレッドのdequeの末尾から半分を盗む
+class TileScheduler
+{
+public:
+    TileScheduler(int32_t numTileX, int32_t numTileY, int32_t numThread)
+    {
+        numThread_ = (numThread > 0) ? numThread : int32_t(std::max(1u, std::thread::hardware_concurrency()));
+        // Morton順のタイル列
+        std::vector<std::pair<uint32_t, int32_t>> order;
+        order.reserve(numTileX * numTileY);
+        for (int32_t ty = 0; ty < numTileY; ++ty)
+        {
+            for (int32_t tx = 0; tx < numTileX; ++tx)
+            {
+                order.emplace_back(morton(uint32_t(tx), uint32_t(ty)), tx + ty * numTileX);
+            }
+        }
+        std::sort(order.begin(), order.end());
+        // 連続した区間ごとに各スレッドへ割り当てる
+        queues_.resize(numThread_);
+        const size_t numTile = order.size();
+        for (int32_t ti = 0; ti < numThread_; ++ti)
+        {
+            queues_[ti].reset(new Queue());
+            const size_t b = numTile * ti / numThread_;
+            const size_t e = numTile * (ti + 1) / numThread_;
+            for (size_t i = b; i < e; ++i)
+            {
+                queues_[ti]->tiles.push_back(order[i].second);
+            }
+        }
+    }
+    //
+    int32_t numThread() const
+    {
+        return numThread_;
+    }
+    // fun(threadIndex, tileIndex)を全タイルについて呼ぶ。threadIndexごとに常駐ワーカーか呼び出し元のスレッドが1つずつ受け持つ
+    template<typename Fun>
+    void run(Fun&& fun)
+    {
+        timeline_.assign(numThread_, ThreadTimeline());
+        start_ = clock::now();
+        const auto worker = [&](int32_t ti)
+        {
+            ThreadTimeline& timeline = timeline_[ti];
+            int32_t tile = 0;
+            while (pop(ti, tile) || steal(ti, tile))
+            {
+                TileSpan span;
+                span.tile = tile;
+                span.begin = now();
+                fun(ti, tile);
+                span.end = now();
+                timeline.busy += span.end - span.begin;
+                timeline.spans.push_back(span);
+            }
+            timeline.finish = now();
+        };
+        WorkerThreads::instance().run(size_t(numThread_), [&](size_t ti)
+        {
+            worker(int32_t(ti));
+        });
+        end_ = now();
+    }
+    //
+    const std::vector<ThreadTimeline>& timeline() const
+    {
+        return timeline_;
+    }
+    // run()全体の所要時間(マイクロ秒)
+    int64_t elapsed() const
+    {
+        return end_;
+    }
+private:
+    using clock = std::chrono::steady_clock;
+    //
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<int32_t> tiles;
+    };
+    //
+    static uint32_t morton(uint32_t x, uint32_t y)
+    {
+        const auto part = [](uint32_t v)
+        {
+            v &= 0x0000ffff;
+            v = (v | (v << 8)) & 0x00ff00ff;
+            v = (v | (v << 4)) & 0x0f0f0f0f;
+            v = (v | (v << 2)) & 0x33333333;
+            v = (v | (v << 1)) & 0x55555555;
+            return v;
+        };
+        return part(x) | (part(y) << 1);
+    }
+    //
+    int64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start_).count();
+    }
+    // 自分のdequeの先頭から取る
+    bool pop(int32_t ti, int32_t& tile)
+    {
+        Queue& queue = *queues_[ti];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tiles.empty())
+        {
+            return false;
+        }
+        tile = queue.tiles.front();
+        queue.tiles.pop_front();
+        return true;
+    }
+    // 他のスレッドのdequeの末尾から半分を盗み、1つを返して残りは自分のdequeに積む。
+    // 盗んだタイルは相手のロックを離す前に自分のdequeへ移すので、どのdequeにも無い瞬間ができない。
+    // そうしないと、その間に他のスレッドが全てのdequeを空と見て抜けてしまう
+    bool steal(int32_t ti, int32_t& tile)
+    {
+        Queue& queue = *queues_[ti];
+        for (int32_t i = 1; i < numThread_; ++i)
+        {
+            Queue& victim = *queues_[(ti + i) % numThread_];
+            // 2つのスレッドが互いに盗み合ってもデッドロックしないように、まとめてロックする
+            std::unique_lock<std::mutex> victimLock(victim.mutex, std::defer_lock);
+            std::unique_lock<std::mutex> queueLock(queue.mutex, std::defer_lock);
+            std::lock(victimLock, queueLock);
+            if (victim.tiles.empty())
+            {
+                continue;
+            }
+            const size_t count = (victim.tiles.size() + 1) / 2;
+            const auto first = victim.tiles.end() - count;
+            tile = *first;
+            queue.tiles.insert(queue.tiles.end(), first + 1, victim.tiles.end());
+            victim.tiles.erase(first, victim.tiles.end());
+            ++timeline_[ti].steals;
+            return true;
+        }
+        return false;
+    }
+    //
+    int32_t numThread_ = 1;
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<ThreadTimeline> timeline_;
+    clock::time_point start_;
+    int64_t end_ = 0;
+};
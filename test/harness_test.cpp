@@ -0,0 +1,481 @@
+﻿//
+#define _USE_MATH_DEFINES
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+//
+#include "rayrun.hpp"
+#include "harness.hpp"
+#include "meshcache.hpp"
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <random>
+#include <algorithm>
+//
+#if __has_include("tiny_obj_loader.h")
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+#define HAS_TINYOBJ (1)
+#else
+#define HAS_TINYOBJ (0)
+#endif
+
+namespace
+{
+    // 結果を表示して失敗数を数える
+    int32_t failures = 0;
+    void check(bool ok, const char* group, const std::string& name)
+    {
+        printf("%-5s %-8s %s\n", ok ? "ok" : "FAIL", group, name.c_str());
+        failures += ok ? 0 : 1;
+    }
+    //
+    void writeFile(const std::filesystem::path& path, const std::string& text)
+    {
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write(text.data(), text.size());
+    }
+    //
+    template<typename T>
+    bool sameArray(const T* data, size_t count, const std::vector<T>& expected)
+    {
+        return count == expected.size() && (count == 0 || memcmp(data, expected.data(), count * sizeof(T)) == 0);
+    }
+    //
+    bool aligned(const void* ptr)
+    {
+        return (reinterpret_cast<uintptr_t>(ptr) % MeshCache::kAlignment) == 0;
+    }
+    // キャッシュを読み直し、objから読んだ配列と一致するか調べる
+    bool sameMesh(const MeshCache& mesh, const std::vector<float>& vertices, const std::vector<float>& normals, const std::vector<uint32_t>& indices)
+    {
+        return
+            sameArray(mesh.vertices(), mesh.numVerts() * 3, vertices) &&
+            sameArray(mesh.normals(), mesh.numNormals() * 3, normals) &&
+            sameArray(mesh.indices(), mesh.numFace() * 6, indices);
+    }
+
+    // .rrmeshの書き出しと読み込みで配列が変わらないこと、各区間が揃っていること、壊れたキャッシュを使わないことを調べる
+    void testMeshCache(const std::filesystem::path& dir)
+    {
+        // 頂点数と法線数の和を奇数にして、インデックスの区間が詰めると4バイト境界になる配置にする
+        const auto objPath = (dir / "cache.obj").string();
+        writeFile(objPath,
+            "v 0 0 0\nv 1 0 0\nv 0 1 0\nv 1 1 0\nv 2 2 1\n"
+            "vn 0 0 1\nvn 0 1 0\nvn 1 0 0\nvn 0 0 -1\n"
+            "f 1//1 2//1 3//1\nf 2//2 4//2 3//2\nf 3//3 4//4 5//4\n");
+        const std::string cachePath = objPath + ".rrmesh";
+        std::error_code ec;
+        std::filesystem::remove(cachePath, ec);
+
+        MeshCache first;
+        const bool parsed = first.load(objPath) && !first.cached();
+        check(parsed && first.numVerts() == 5 && first.numNormals() == 4 && first.numFace() == 3, "rrmesh", "parse obj and write cache");
+        const std::vector<float> vertices(first.vertices(), first.vertices() + first.numVerts() * 3);
+        const std::vector<float> normals(first.normals(), first.normals() + first.numNormals() * 3);
+        const std::vector<uint32_t> indices(first.indices(), first.indices() + first.numFace() * 6);
+        check(std::filesystem::file_size(cachePath, ec) % MeshCache::kAlignment == 0, "rrmesh", "cache size is padded");
+
+        // マップしたままだとWindowsではファイルを書き換えられないので、ブロックの中で閉じる
+        {
+            MeshCache second;
+            const bool mapped = second.load(objPath) && second.cached();
+            check(mapped && sameMesh(second, vertices, normals, indices), "rrmesh", "round trip through mapped cache");
+            check(mapped && aligned(second.vertices()) && aligned(second.normals()) && aligned(second.indices()), "rrmesh", "sections are 16 byte aligned");
+        }
+
+        // 途中で切れたキャッシュは使わずにobjから読み直す
+        const auto size = std::filesystem::file_size(cachePath, ec);
+        std::filesystem::resize_file(cachePath, size - 4, ec);
+        MeshCache truncated;
+        check(truncated.load(objPath) && !truncated.cached() && sameMesh(truncated, vertices, normals, indices), "rrmesh", "truncated cache is rebuilt");
+
+        // 個数が壊れたキャッシュは掛け算があふれる前に弾く
+        {
+            RRMeshHeader header = {};
+            std::fstream file(cachePath, std::ios::in | std::ios::out | std::ios::binary);
+            file.read(reinterpret_cast<char*>(&header), sizeof(header));
+            header.numFace = uint64_t(1) << 62;
+            header.numVerts = ~uint64_t(0) / 12 + 1;
+            file.seekp(0);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+        MeshCache corrupt;
+        check(corrupt.load(objPath) && !corrupt.cached() && sameMesh(corrupt, vertices, normals, indices), "rrmesh", "corrupt counts are rejected");
+    }
+
+    // 範囲外のインデックスを持つobjは読み込みに失敗し、行番号付きの理由が返ること
+    void testObjBadIndex(const std::filesystem::path& dir)
+    {
+        const char* cases[][2] =
+        {
+            { "vertex", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\nf 1 2 4\n" },
+            { "zero", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 0 1 2\n" },
+            { "relative", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf -1 -2 -4\n" },
+            { "normal", "v 0 0 0\nv 1 0 0\nv 0 1 0\nvn 0 0 1\nf 1//1 2//1 3//2\n" },
+            // 2^32 + 1は32bitに切り詰めると1番目の頂点になってしまう
+            { "wrapped", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 4294967297 2 3\n" },
+            { "huge", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 123456789012345678901234567890\n" },
+        };
+        for (const auto& c : cases)
+        {
+            const auto objPath = (dir / (std::string("bad_") + c[0] + ".obj")).string();
+            writeFile(objPath, c[1]);
+            std::vector<float> vertices;
+            std::vector<float> normals;
+            std::vector<uint32_t> indices;
+            ObjParser parser;
+            const bool failed = !parser.parse(objPath, vertices, normals, indices);
+            const bool reported = parser.error.find(":4:") != std::string::npos || parser.error.find(":5:") != std::string::npos;
+            check(failed && reported && indices.empty(), "obj", std::string("reject out of range ") + c[0] + " index");
+        }
+    }
+
+    // vnが一部の角にだけ無い場合は、ファイルの法線を残してその角にだけ法線を補うこと
+    void testObjMissingNormals(const std::filesystem::path& dir)
+    {
+        const auto objPath = (dir / "partial.obj").string();
+        writeFile(objPath,
+            "v 0 0 0\nv 1 0 0\nv 0 1 0\nv 1 1 0\n"
+            "vn 0.5 0.5 0.5\n"
+            "f 1//1 2//1 3//1\nf 2 4 3\n");
+        auto[vertices, normals, indices] = loadMesh(objPath);
+        const std::vector<float> expectedNormals =
+        {
+            0.5f, 0.5f, 0.5f,
+            0.0f, 0.0f, 1.0f,
+            0.0f, 0.0f, 1.0f,
+            0.0f, 0.0f, 1.0f,
+        };
+        const std::vector<uint32_t> expectedIndices =
+        {
+            0, 0, 1, 0, 2, 0,
+            1, 1, 3, 2, 2, 3,
+        };
+        check(normals == expectedNormals && indices == expectedIndices, "obj", "fill only missing normals");
+        // vnが1つも無い場合は従来通り全ての頂点の法線を生成する
+        const auto noneObjPath = (dir / "none.obj").string();
+        writeFile(noneObjPath, "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n");
+        auto[noneVertices, noneNormals, noneIndices] = loadMesh(noneObjPath);
+        check(noneNormals.size() == 9 && noneIndices == std::vector<uint32_t>({ 0, 0, 1, 1, 2, 2 }), "obj", "generate normals when there is no vn");
+    }
+
+    // 並列化する前のloadMesh()の法線の生成。面法線を順に足してから正規化する
+    void generateNormalsSerial(const std::vector<float>& vertices, std::vector<uint32_t>& indices, std::vector<float>& normals)
+    {
+        const int32_t numVerts = int32_t(vertices.size() / 3);
+        std::vector<glm::vec3> vnormals(numVerts, glm::vec3(0.0f, 0.0f, 0.0f));
+        const int32_t numFace = int32_t(indices.size() / 6);
+        for (int32_t fi = 0; fi < numFace; ++fi)
+        {
+            const int32_t vi0 = indices[fi * 6 + 0];
+            const int32_t vi1 = indices[fi * 6 + 2];
+            const int32_t vi2 = indices[fi * 6 + 4];
+            const glm::vec3 v0(vertices[vi0 * 3 + 0], vertices[vi0 * 3 + 1], vertices[vi0 * 3 + 2]);
+            const glm::vec3 v1(vertices[vi1 * 3 + 0], vertices[vi1 * 3 + 1], vertices[vi1 * 3 + 2]);
+            const glm::vec3 v2(vertices[vi2 * 3 + 0], vertices[vi2 * 3 + 1], vertices[vi2 * 3 + 2]);
+            const glm::vec3 e01 = v1 - v0;
+            const glm::vec3 e02 = v2 - v0;
+            const glm::vec3 n = glm::cross(e01, e02);
+            vnormals[vi0] += n;
+            vnormals[vi1] += n;
+            vnormals[vi2] += n;
+            indices[fi * 6 + 1] = vi0;
+            indices[fi * 6 + 3] = vi1;
+            indices[fi * 6 + 5] = vi2;
+        }
+        normals.resize(vertices.size());
+        for (int32_t ni = 0; ni < numVerts; ++ni)
+        {
+            const glm::vec3 n = glm::normalize(vnormals[ni]);
+            normals[ni * 3 + 0] = n.x;
+            normals[ni * 3 + 1] = n.y;
+            normals[ni * 3 + 2] = n.z;
+        }
+    }
+
+    // generateNormals()が範囲の数によらず逐次処理と同じ法線を返すこと。
+    // 格子の頂点番号を並べ替えて、1つの面の頂点と、1つの頂点を共有する面がいくつもの範囲にまたがるようにする
+    void testGenerateNormals()
+    {
+        const uint32_t kGrid = 160;
+        const uint32_t numVerts = (kGrid + 1) * (kGrid + 1);
+        std::mt19937 rng(1);
+        std::vector<uint32_t> order(numVerts);
+        for (uint32_t vi = 0; vi < numVerts; ++vi)
+        {
+            order[vi] = vi;
+        }
+        std::shuffle(order.begin(), order.end(), rng);
+        std::uniform_real_distribution<float> height(-0.5f, 0.5f);
+        std::vector<float> vertices(numVerts * 3);
+        for (uint32_t y = 0; y <= kGrid; ++y)
+        {
+            for (uint32_t x = 0; x <= kGrid; ++x)
+            {
+                float* v = &vertices[order[y * (kGrid + 1) + x] * 3];
+                v[0] = float(x);
+                v[1] = height(rng);
+                v[2] = float(y);
+            }
+        }
+        std::vector<uint32_t> indices;
+        for (uint32_t y = 0; y < kGrid; ++y)
+        {
+            for (uint32_t x = 0; x < kGrid; ++x)
+            {
+                const uint32_t v00 = order[y * (kGrid + 1) + x];
+                const uint32_t v10 = order[y * (kGrid + 1) + x + 1];
+                const uint32_t v01 = order[(y + 1) * (kGrid + 1) + x];
+                const uint32_t v11 = order[(y + 1) * (kGrid + 1) + x + 1];
+                for (const uint32_t vi : { v00, v01, v10, v10, v01, v11 })
+                {
+                    indices.push_back(vi);
+                    indices.push_back(ObjParser::kMissingNormal);
+                }
+            }
+        }
+        std::vector<uint32_t> expectedIndices = indices;
+        std::vector<float> expected;
+        generateNormalsSerial(vertices, expectedIndices, expected);
+        for (const int32_t numThread : { 1, 2, 7, 16, 0 })
+        {
+            std::vector<uint32_t> actualIndices = indices;
+            std::vector<float> actual;
+            generateNormals(vertices, actualIndices, actual, numThread);
+            bool same = (actual.size() == expected.size()) && (actualIndices == expectedIndices);
+            for (size_t i = 0; same && i < expected.size(); ++i)
+            {
+                same = std::abs(actual[i] - expected[i]) <= 1e-6f;
+            }
+            check(same, "normals", "match serial loop with " + ((numThread > 0) ? std::to_string(numThread) : std::string("default")) + " range(s)");
+        }
+    }
+
+    // 同梱のシーンのobjを元のローダー(tinyobjloader)と同じ配列に読めること。objが無い場合は飛ばす
+    void testObjAgainstTinyObj(const std::filesystem::path& assetDir)
+    {
+        for (const char* name : { "hairball", "head", "moriknob" })
+        {
+            const char* group = "obj";
+            const auto objPath = (assetDir / (std::string(name) + ".obj")).string();
+            std::error_code ec;
+            if (!std::filesystem::exists(objPath, ec))
+            {
+                printf("%-5s %-8s %s (%s not found)\n", "skip", group, name, objPath.c_str());
+                continue;
+            }
+#if HAS_TINYOBJ
+            std::vector<float> vertices;
+            std::vector<float> normals;
+            std::vector<uint32_t> indices;
+            ObjParser parser;
+            const bool parsed = parser.parse(objPath, vertices, normals, indices);
+            //
+            tinyobj::attrib_t attrib;
+            std::vector<tinyobj::shape_t> shapes;
+            std::vector<tinyobj::material_t> materials;
+            std::string warn;
+            std::string err;
+            tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, objPath.c_str(), nullptr, true);
+            std::vector<uint32_t> expected;
+            for (const auto& shape : shapes)
+            {
+                for (const auto& index : shape.mesh.indices)
+                {
+                    expected.push_back(uint32_t(index.vertex_index));
+                    expected.push_back((index.normal_index < 0) ? ObjParser::kMissingNormal : uint32_t(index.normal_index));
+                }
+            }
+            // 数値の読み方は実装によって最下位ビットが変わることがあるので、相対誤差で比べる
+            const auto sameFloats = [](const std::vector<float>& a, const std::vector<float>& b)
+            {
+                if (a.size() != b.size())
+                {
+                    return false;
+                }
+                for (size_t i = 0; i < a.size(); ++i)
+                {
+                    if (std::abs(a[i] - b[i]) > 1e-6f * std::max(1.0f, std::abs(b[i])))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            };
+            check(parsed && sameFloats(vertices, attrib.vertices), group, std::string(name) + " vertices match tinyobjloader");
+            check(parsed && sameFloats(normals, attrib.normals), group, std::string(name) + " normals match tinyobjloader");
+            check(parsed && indices == expected, group, std::string(name) + " indices match tinyobjloader");
+#else
+            printf("%-5s %-8s %s (tinyobjloader is not available)\n", "skip", group, name);
+#endif
+        }
+    }
+
+    // 記録と再生に使う交差判定。全ての三角形を調べるだけなので、同じレイには常に同じ結果を返す
+    struct TraceScene
+    {
+        std::vector<glm::vec3> vertices;
+        std::vector<uint32_t> indices;
+    };
+    TraceScene traceScene;
+    void traceIntersect(Ray* rays, size_t numRay, bool hitany)
+    {
+        const size_t numFace = traceScene.indices.size() / 3;
+        for (size_t ri = 0; ri < numRay; ++ri)
+        {
+            Ray& ray = rays[ri];
+            ray.isisect = false;
+            if (!ray.valid)
+            {
+                continue;
+            }
+            const glm::vec3 org(ray.pos[0], ray.pos[1], ray.pos[2]);
+            const glm::vec3 dir(ray.dir[0], ray.dir[1], ray.dir[2]);
+            float tfar = ray.tfar;
+            for (size_t fi = 0; fi < numFace && !(hitany && ray.isisect); ++fi)
+            {
+                const glm::vec3& v0 = traceScene.vertices[traceScene.indices[fi * 3 + 0]];
+                const glm::vec3 e1 = traceScene.vertices[traceScene.indices[fi * 3 + 1]] - v0;
+                const glm::vec3 e2 = traceScene.vertices[traceScene.indices[fi * 3 + 2]] - v0;
+                const glm::vec3 p = glm::cross(dir, e2);
+                const float det = glm::dot(e1, p);
+                if (std::abs(det) < 1e-8f)
+                {
+                    continue;
+                }
+                const float invDet = 1.0f / det;
+                const glm::vec3 s = org - v0;
+                const float u = glm::dot(s, p) * invDet;
+                const glm::vec3 q = glm::cross(s, e1);
+                const float v = glm::dot(dir, q) * invDet;
+                const float t = glm::dot(e2, q) * invDet;
+                if (u < 0.0f || v < 0.0f || u + v > 1.0f || t < ray.tnear || t > tfar)
+                {
+                    continue;
+                }
+                tfar = t;
+                const glm::vec3 isect = org + dir * t;
+                const glm::vec3 ns = glm::normalize(glm::cross(e1, e2));
+                ray.isisect = true;
+                ray.faceid = int32_t(fi);
+                ray.isect[0] = isect.x;
+                ray.isect[1] = isect.y;
+                ray.isect[2] = isect.z;
+                ray.ns[0] = ns.x;
+                ray.ns[1] = ns.y;
+                ray.ns[2] = ns.z;
+            }
+        }
+    }
+
+    // AOのレンダリングを.rrtraceに記録し、読み直したレイを同じ交差判定で再生すると記録した結果と一致すること
+    void testRayTrace(const std::filesystem::path& dir)
+    {
+        // 床と、床に影を落とす三角形
+        traceScene.vertices = {
+            { -2.0f, 0.0f, -2.0f }, { 2.0f, 0.0f, -2.0f }, { 2.0f, 0.0f, 2.0f }, { -2.0f, 0.0f, 2.0f },
+            { -0.5f, 0.3f, -0.5f }, { 0.5f, 0.3f, -0.5f }, { 0.0f, 0.8f, 0.5f } };
+        traceScene.indices = { 0, 2, 1, 0, 3, 2, 4, 5, 6 };
+        SceneSetting setting;
+        setting.pos = glm::vec3(0.0f, 1.5f, 3.0f);
+        setting.dir = glm::normalize(glm::vec3(0.0f, -0.5f, -1.0f));
+        setting.up = glm::vec3(0.0f, 1.0f, 0.0f);
+        setting.fovy = 0.8f;
+        setting.samplePerPixel = 1;
+        setting.sampleAo = 4;
+        //
+        const std::string tracePath = (dir / "replay.rrtrace").string();
+        const size_t numVerts = traceScene.vertices.size();
+        const size_t numFace = traceScene.indices.size() / 3;
+        RayTraceWriter writer;
+        const bool opened = writer.open(tracePath, numVerts, numFace);
+        RenderOption option;
+        option.tileSize = 4;
+        option.numThread = 2;
+        option.trace = &writer;
+        const int32_t width = 16;
+        const int32_t height = 16;
+        std::vector<std::array<float, 4>> pixels(width * height);
+        Stopwatch swIsect;
+        swIsect.start();
+        int32_t renderingPercent = 0;
+        const RenderResult result = renderAo(setting, option, width, height, traceIntersect, pixels, swIsect, renderingPercent);
+        check(opened && writer.close() && !result.timeout, "rrtrace", "record render");
+        // マップしたままだとWindowsではファイルを切り詰められないので、ブロックの中で閉じる
+        {
+            RayTraceReader reader;
+            const bool read = reader.open(tracePath);
+            const auto& batches = reader.batches();
+            size_t numRay = 0;
+            size_t numHit = 0;
+            bool hasHitAny = false;
+            for (const auto& batch : batches)
+            {
+                numRay += batch.rayCount;
+                hasHitAny = hasHitAny || batch.hitAny;
+                for (size_t ri = 0; ri < batch.rayCount; ++ri)
+                {
+                    numHit += batch.hits[ri].isisect;
+                }
+            }
+            check(read && reader.header().numVerts == numVerts && reader.header().numFace == numFace, "rrtrace", "header records the mesh");
+            check(read && reader.header().numBatch == batches.size() && reader.header().numRay == numRay && numRay == result.rayCount, "rrtrace", "every batch and ray is recorded");
+            check(read && hasHitAny && numHit != 0 && numHit != numRay, "rrtrace", "trace has hit, miss and hitany batches");
+            // 再生。交差判定が同じなので位置も含めて完全に一致する
+            bool restored = read;
+            bool replayed = read;
+            std::vector<Ray> rays;
+            for (const auto& batch : batches)
+            {
+                RayTraceReader::restore(batch, rays);
+                std::vector<RRTraceRay> inputs;
+                RayTraceWriter::capture(rays.data(), rays.size(), inputs);
+                restored = restored && (memcmp(inputs.data(), batch.rays, batch.rayCount * sizeof(RRTraceRay)) == 0);
+                traceIntersect(rays.data(), rays.size(), batch.hitAny);
+                for (size_t ri = 0; ri < batch.rayCount; ++ri)
+                {
+                    const Ray& ray = rays[ri];
+                    const RRTraceHit& hit = batch.hits[ri];
+                    replayed = replayed &&
+                        ray.isisect == (hit.isisect != 0) &&
+                        (!ray.isisect || (ray.faceid == hit.faceid && memcmp(ray.isect, hit.isect, sizeof(hit.isect)) == 0));
+                }
+            }
+            check(restored, "rrtrace", "restored rays equal the recorded rays");
+            check(replayed, "rrtrace", "replay matches the recorded hits");
+        }
+        // 途中で切れたトレースは読まない
+        std::error_code ec;
+        std::filesystem::resize_file(tracePath, std::filesystem::file_size(tracePath, ec) - 4, ec);
+        RayTraceReader truncated;
+        check(!truncated.open(tracePath), "rrtrace", "truncated trace is rejected");
+    }
+}
+
+//
+// rayrun_test [assetDir]
+int main(int argc, char** argv)
+{
+    const std::filesystem::path assetDir = (argc > 1) ? argv[1] : "asset";
+    std::random_device random;
+    const auto dir = std::filesystem::temp_directory_path() / ("rayrun_test." + std::to_string(random()));
+    std::filesystem::create_directories(dir);
+    //
+    testMeshCache(dir);
+    testObjBadIndex(dir);
+    testObjMissingNormals(dir);
+    testGenerateNormals();
+    testObjAgainstTinyObj(assetDir);
+    testRayTrace(dir);
+    //
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    printf("%d failure(s)\n", failures);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}